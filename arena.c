@@ -0,0 +1,176 @@
+/*
+ * arena.c - bump allocator for the entities of one OSM_Data
+ *
+ * The entities, their tag lists, strings and node / member arrays are
+ * cut from large chunks instead of being malloc()ed one by one. Nothing
+ * is freed individually, osm_arena_free() releases all chunks at once.
+ * Entities in an arena carry OSM_FLAG_ARENA and are ignored by the
+ * osm_free_*() functions. Their arrays are sized exactly, so they must
+ * not be grown with the osm_realloc_*() functions.
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "osm.h"
+
+#define ARENA_ALIGN(s) (((s) + 7) & ~(size_t)7)
+
+struct osm_arena_chunk {
+    struct osm_arena_chunk *next;
+    size_t size;
+    size_t used;
+    unsigned char data[];
+};
+
+OSM_Arena *osm_arena_new(size_t chunk_size) {
+    OSM_Arena *A = malloc(sizeof(OSM_Arena));
+    if (A == NULL) {
+        fprintf(stderr, "failed to malloc arena: %s\n", strerror(errno));
+        return (OSM_Arena *)NULL;
+    }
+    A->chunks     = NULL;
+    A->chunk_size = chunk_size ? chunk_size : OSM_ARENA_CHUNK_SIZE;
+    A->allocated  = 0;
+    return A;
+}
+
+/* 8 byte aligned memory from the current chunk, NULL if out of memory */
+void *osm_arena_alloc(OSM_Arena *A, size_t size) {
+    struct osm_arena_chunk *c = A->chunks;
+    void *p;
+
+    size = ARENA_ALIGN(size);
+    if (c == NULL || c->size - c->used < size) {
+        size_t csize = size > A->chunk_size ? size : A->chunk_size;
+        c = malloc(sizeof(struct osm_arena_chunk) + csize);
+        if (c == NULL) {
+            fprintf(stderr, "failed to malloc arena chunk: %s\n", strerror(errno));
+            return NULL;
+        }
+        c->size = csize;
+        c->used = 0;
+        /* an oversized chunk is full anyway, keep filling the current one */
+        if (size > A->chunk_size && A->chunks != NULL) {
+            c->next = A->chunks->next;
+            A->chunks->next = c;
+        }
+        else {
+            c->next = A->chunks;
+            A->chunks = c;
+        }
+        A->allocated += csize;
+    }
+    p = c->data + c->used;
+    c->used += size;
+    return p;
+}
+
+/* empty strings are not copied, like in the rest of libosm */
+char *osm_arena_strdup(OSM_Arena *A, const char *s) {
+    size_t len;
+    char *d;
+
+    if (s == NULL || *s == '\0')
+        return "";
+    len = strlen(s) + 1;
+    d = osm_arena_alloc(A, len);
+    if (d == NULL)
+        return "";
+    memcpy(d, s, len);
+    return d;
+}
+
+void osm_arena_free(OSM_Arena *A) {
+    struct osm_arena_chunk *c, *next;
+
+    if (A == NULL)
+        return;
+    for (c = A->chunks; c != NULL; c = next) {
+        next = c->next;
+        free(c);
+    }
+    free(A);
+}
+
+OSM_Tag_List *osm_arena_tags(OSM_Arena *A, OSM_Tag_List *t) {
+    OSM_Tag_List *tl;
+    uint32_t i;
+
+    if (t == NULL)
+        return NULL;
+    tl = osm_arena_alloc(A, sizeof(OSM_Tag_List));
+    tl->num  = t->num;
+    tl->size = t->num;
+    tl->data = osm_arena_alloc(A, sizeof(OSM_Tag) * (t->num ? t->num : 1));
+    for (i=0; i<t->num; i++) {
+        tl->data[i].key = osm_arena_strdup(A, t->data[i].key);
+        tl->data[i].val = osm_arena_strdup(A, t->data[i].val);
+    }
+    return tl;
+}
+
+/*
+   osm_arena_node() & co: copy an entity (with OSM_FLAG_VIEW or not) into
+   the arena and free the original. Returns the copy.
+*/
+OSM_Node *osm_arena_node(OSM_Arena *A, OSM_Node *n) {
+    OSM_Node *N = osm_arena_alloc(A, sizeof(OSM_Node));
+
+    *N = *n;
+    N->user  = osm_arena_strdup(A, n->user);
+    N->tags  = osm_arena_tags(A, n->tags);
+    N->flags = (n->flags & ~OSM_FLAG_VIEW) | OSM_FLAG_ARENA;
+    osm_free_node(n);
+    return N;
+}
+
+OSM_Way *osm_arena_way(OSM_Arena *A, OSM_Way *w) {
+    OSM_Way *W = osm_arena_alloc(A, sizeof(OSM_Way));
+    uint32_t num = 0;
+
+    *W = *w;
+    W->user = osm_arena_strdup(A, w->user);
+    W->tags = osm_arena_tags(A, w->tags);
+    if (w->nodes != NULL) {
+        while (w->nodes[num])
+            ++num;
+        W->nodes = osm_arena_alloc(A, sizeof(uint64_t) * (num + 1));
+        memcpy(W->nodes, w->nodes, sizeof(uint64_t) * (num + 1));
+    }
+    W->flags = (w->flags & ~OSM_FLAG_VIEW) | OSM_FLAG_ARENA;
+    osm_free_way(w);
+    return W;
+}
+
+OSM_Relation *osm_arena_relation(OSM_Arena *A, OSM_Relation *r) {
+    OSM_Relation *R = osm_arena_alloc(A, sizeof(OSM_Relation));
+    OSM_Rel_Member_List *m;
+    uint32_t i;
+
+    *R = *r;
+    R->user = osm_arena_strdup(A, r->user);
+    R->tags = osm_arena_tags(A, r->tags);
+    if (r->member != NULL) {
+        m = osm_arena_alloc(A, sizeof(OSM_Rel_Member_List));
+        m->num  = r->member->num;
+        m->size = r->member->num;
+        m->data = osm_arena_alloc(A, sizeof(OSM_Rel_Member) * (m->num ? m->num : 1));
+        for (i=0; i<m->num; i++) {
+            m->data[i] = r->member->data[i];
+            m->data[i].role = osm_arena_strdup(A, r->member->data[i].role);
+        }
+        R->member = m;
+    }
+    R->flags = (r->flags & ~OSM_FLAG_VIEW) | OSM_FLAG_ARENA;
+    osm_free_relation(r);
+    return R;
+}
+
+/* END */
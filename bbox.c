@@ -39,4 +39,30 @@ OSM_BBox *osm_bbox_from_nodes(OSM_Node_List *n) {
     return box;
 }
 
+/* same from the integer coordinates, the columns need not be sorted */
+OSM_BBox *osm_bbox_from_node_columns(OSM_Node_Columns *C) {
+    uint32_t i;
+    int32_t left = 1800000000, right = -1800000000;
+    int32_t bottom = 900000000, top = -900000000;
+    OSM_BBox *box = malloc(sizeof(OSM_BBox));
+
+    for (i=0; i< C->num; i++) {
+        if (C->lon[i] < left)
+            left = C->lon[i];
+        if (C->lon[i] > right)
+            right = C->lon[i];
+    }
+    for (i=0; i< C->num; i++) {
+        if (C->lat[i] < bottom)
+            bottom = C->lat[i];
+        if (C->lat[i] > top)
+            top = C->lat[i];
+    }
+    box->left_lon   = left   / 1e7;
+    box->right_lon  = right  / 1e7;
+    box->bottom_lat = bottom / 1e7;
+    box->top_lat    = top    / 1e7;
+    return box;
+}
+
 /* END */
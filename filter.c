@@ -0,0 +1,688 @@
+/*
+ * filter.c - compiled entity filters
+ *
+ * A filter expression is compiled once into an OSM_Filter, which the
+ * parsers run on every entity (set OSM_File.filter before osm_parse()).
+ * The syntax:
+ *
+ *   expr   := term { '|' term }
+ *   term   := factor { '&' factor }
+ *   factor := '!' factor | '(' expr ')' | cond
+ *   cond   := KEY                  entity has a tag KEY
+ *           | KEY '=' VALUE        entity has the tag KEY=VALUE
+ *           | '@node' | '@way' | '@relation'
+ *           | '@id=' NUM | '@user=' NAME | '@uid=' NUM
+ *
+ * Words end at white space and at any of ()&|!="; anything else can be
+ * given in double quotes, with \" and \\ inside. Example:
+ *
+ *   (highway=primary | highway=secondary) & !@user="Some One"
+ *
+ * The conditions (at most OSM_FILTER_MAX_CONDS) are numbered, the
+ * expression is turned into a postfix program over the condition
+ * numbers. For an entity all conditions are evaluated into a bit mask
+ * first, the program then only shifts and masks bits. The strings of the
+ * filter (keys, values, user names) are in a hash table with the bits of
+ * the conditions they fulfill, see struct osm_filter_string. The tags are
+ * matched with one walk over the tag list and two lookups per tag.
+ *
+ * In .osm.pbf files the tags and users are indexes into the string table
+ * of the block: osm_filter_pbf_strings() looks up each string of the table
+ * once, osm_filter_pbf_row() then evaluates an entity on the undecoded
+ * columns with integer operations only.
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+
+#define _GNU_SOURCE /* strndup */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "osm.h"
+
+enum {
+    FILTER_OP_AND = -1,
+    FILTER_OP_OR  = -2,
+    FILTER_OP_NOT = -3
+};
+
+/* the tokens of the expression */
+enum {
+    TOK_END = 0,
+    TOK_WORD,
+    TOK_EQ,
+    TOK_AND,
+    TOK_OR,
+    TOK_NOT,
+    TOK_OPEN,
+    TOK_CLOSE,
+    TOK_ERROR
+};
+
+struct filter_parser {
+    const char *expr;
+    const char *pos;
+    int tok;
+    char *word;                 /* of TOK_WORD */
+    OSM_Filter *f;
+};
+
+/* FNV-1a */
+static uint32_t filter_hash(const char *s, uint32_t len) {
+    uint32_t h = 2166136261U;
+    while (len--) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+static void filter_error(struct filter_parser *p, const char *msg) {
+    fprintf(stderr, "filter: %s at position %d of '%s'\n",
+                    msg, (int)(p->pos - p->expr), p->expr);
+}
+
+/* reads the next token into p->tok (and p->word) */
+static void filter_next(struct filter_parser *p) {
+    const char *s = p->pos;
+    char *w;
+
+    free(p->word);
+    p->word = NULL;
+
+    while (*s == ' ' || *s == '\t' || *s == '\n')
+        ++s;
+    p->pos = s;
+    switch (*s) {
+        case '\0':
+            p->tok = TOK_END;
+            return;
+        case '=':
+            p->tok = TOK_EQ;
+            break;
+        case '&':
+            p->tok = TOK_AND;
+            break;
+        case '|':
+            p->tok = TOK_OR;
+            break;
+        case '!':
+            p->tok = TOK_NOT;
+            break;
+        case '(':
+            p->tok = TOK_OPEN;
+            break;
+        case ')':
+            p->tok = TOK_CLOSE;
+            break;
+        case '"':
+            w = p->word = malloc(strlen(s));
+            for (++s; *s && *s != '"'; s++) {
+                if (*s == '\\' && (s[1] == '"' || s[1] == '\\'))
+                    ++s;
+                *w++ = *s;
+            }
+            *w = '\0';
+            if (*s != '"') {
+                filter_error(p, "unterminated string");
+                p->tok = TOK_ERROR;
+                return;
+            }
+            p->tok = TOK_WORD;
+            p->pos = s + 1;
+            return;
+        default:
+            while (*s && strchr(" \t\n()&|!=\"", *s) == NULL)
+                ++s;
+            p->word = strndup(p->pos, s - p->pos);
+            p->tok  = TOK_WORD;
+            p->pos  = s;
+            return;
+    }
+    p->pos = s + 1;
+}
+
+static int filter_emit(OSM_Filter *f, int32_t op) {
+    if (f->num_ops == f->size_ops) {
+        uint32_t size = f->size_ops ? f->size_ops * 2 : 32;
+        int32_t *tmp = realloc(f->ops, sizeof(int32_t) * size);
+        if (tmp == NULL) {
+            fprintf(stderr, "failed to grow filter program: %s\n", strerror(errno));
+            return -1;
+        }
+        f->ops      = tmp;
+        f->size_ops = size;
+    }
+    f->ops[f->num_ops++] = op;
+    return 0;
+}
+
+/*
+   the slot of str in the word table, the empty slot if it's not there.
+   The strcmp() is only done if the hashes are equal.
+*/
+static struct osm_filter_word *filter_word_slot(OSM_Filter *f, const char *str,
+                                                uint32_t len)
+{
+    uint32_t hash = filter_hash(str, len);
+    uint32_t pos  = hash & (f->size_words - 1);
+    struct osm_filter_word *w;
+
+    for (w = &f->words[pos]; w->str != NULL; w = &f->words[pos]) {
+        if (w->hash == hash && w->len == len && memcmp(w->str, str, len) == 0)
+            break;
+        pos = (pos + 1) & (f->size_words - 1);
+    }
+    return w;
+}
+
+/* no condition, e.g. for strings which are not in the filter */
+static const struct osm_filter_string filter_no_string;
+
+/*
+   the conditions the len bytes of str fulfill (which need not be NUL
+   terminated), empty keys, values and users never match
+*/
+static const struct osm_filter_string *filter_word(OSM_Filter *f, const char *str,
+                                                   uint32_t len)
+{
+    struct osm_filter_word *w;
+
+    if (len == 0)
+        return &filter_no_string;
+    w = filter_word_slot(f, str, len);
+    return w->str != NULL ? &w->m : &filter_no_string;
+}
+
+/*
+   the entry of str, added if it's new. Each condition adds at most two
+   words, the table is never more than half full.
+*/
+static struct osm_filter_string *filter_add_word(OSM_Filter *f, const char *str) {
+    uint32_t len = strlen(str);
+    struct osm_filter_word *w = filter_word_slot(f, str, len);
+
+    if (w->str == NULL) {
+        w->str  = strdup(str);
+        w->len  = len;
+        w->hash = filter_hash(str, len);
+        f->num_words += 1;
+    }
+    return &w->m;
+}
+
+/* cond := word [ '=' word ], p->tok is the first word */
+static int filter_cond(struct filter_parser *p) {
+    OSM_Filter *f = p->f;
+    struct osm_filter_cond *c;
+    char *name = p->word, *val = NULL, *end;
+    int num = f->num_conds;
+
+    if (num == OSM_FILTER_MAX_CONDS) {
+        filter_error(p, "too many conditions");
+        return -1;
+    }
+    p->word = NULL;
+    filter_next(p);
+    if (p->tok == TOK_EQ) {
+        filter_next(p);
+        if (p->tok != TOK_WORD) {
+            filter_error(p, "missing value");
+            free(name);
+            return -1;
+        }
+        val = p->word;
+        p->word = NULL;
+        filter_next(p);
+    }
+
+    c = &f->conds[num];
+    memset(c, 0, sizeof(struct osm_filter_cond));
+    if (*name == '@') {
+        if      (strcmp(name, "@node") == 0 && val == NULL) {
+            c->type  = OSM_FILTER_TYPE;
+            c->types = OSMDATA_NODE;
+        }
+        else if (strcmp(name, "@way") == 0 && val == NULL) {
+            c->type  = OSM_FILTER_TYPE;
+            c->types = OSMDATA_WAY;
+        }
+        else if (strcmp(name, "@relation") == 0 && val == NULL) {
+            c->type  = OSM_FILTER_TYPE;
+            c->types = OSMDATA_REL;
+        }
+        else if (strcmp(name, "@user") == 0 && val != NULL) {
+            c->type = OSM_FILTER_USER;
+            filter_add_word(f, val)->user |= 1ULL << num;
+            f->user_conds |= 1ULL << num;
+        }
+        else if ((strcmp(name, "@id") == 0 || strcmp(name, "@uid") == 0) && val != NULL) {
+            c->type = name[1] == 'i' ? OSM_FILTER_ID : OSM_FILTER_UID;
+            c->num  = strtoull(val, &end, 10);
+            if (*val == '\0' || *end != '\0') {
+                filter_error(p, "not a number");
+                free(name);
+                free(val);
+                return -1;
+            }
+        }
+        else {
+            filter_error(p, "unknown attribute");
+            free(name);
+            free(val);
+            return -1;
+        }
+        if (c->type == OSM_FILTER_USER || c->type == OSM_FILTER_UID)
+            f->info_conds |= 1ULL << num;
+    }
+    else {
+        if (val != NULL) {
+            c->type = OSM_FILTER_TAG;
+            filter_add_word(f, name)->key_val |= 1ULL << num;
+            filter_add_word(f, val)->val      |= 1ULL << num;
+        }
+        else {
+            c->type = OSM_FILTER_KEY;
+            filter_add_word(f, name)->key |= 1ULL << num;
+        }
+        f->tag_conds |= 1ULL << num;
+    }
+    free(name);
+    free(val);
+    f->num_conds += 1;
+    return filter_emit(f, num);
+}
+
+static int filter_expr(struct filter_parser *p);
+
+static int filter_factor(struct filter_parser *p) {
+    switch (p->tok) {
+        case TOK_NOT:
+            filter_next(p);
+            if (filter_factor(p) != 0)
+                return -1;
+            return filter_emit(p->f, FILTER_OP_NOT);
+        case TOK_OPEN:
+            filter_next(p);
+            if (filter_expr(p) != 0)
+                return -1;
+            if (p->tok != TOK_CLOSE) {
+                filter_error(p, "missing ')'");
+                return -1;
+            }
+            filter_next(p);
+            return 0;
+        case TOK_WORD:
+            return filter_cond(p);
+        case TOK_ERROR:
+            return -1;
+    }
+    filter_error(p, "condition expected");
+    return -1;
+}
+
+static int filter_term(struct filter_parser *p) {
+    if (filter_factor(p) != 0)
+        return -1;
+    while (p->tok == TOK_AND) {
+        filter_next(p);
+        if (filter_factor(p) != 0 || filter_emit(p->f, FILTER_OP_AND) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int filter_expr(struct filter_parser *p) {
+    if (filter_term(p) != 0)
+        return -1;
+    while (p->tok == TOK_OR) {
+        filter_next(p);
+        if (filter_term(p) != 0 || filter_emit(p->f, FILTER_OP_OR) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+   runs the program on the condition bits: the stack of results is kept
+   in the bits of one word, the top in bit 0. The depth is at most the
+   number of conditions.
+*/
+static int filter_run(OSM_Filter *f, uint64_t bits) {
+    uint64_t stack = 0, top;
+    uint32_t i;
+    int32_t op;
+
+    for (i = 0; i < f->num_ops; i++) {
+        op = f->ops[i];
+        if (op >= 0) {
+            stack = (stack << 1) | ((bits >> op) & 1);
+            continue;
+        }
+        switch (op) {
+            case FILTER_OP_NOT:
+                stack ^= 1;
+                break;
+            case FILTER_OP_AND:
+                top   = stack & 1;
+                stack = (stack >> 1) & (~1ULL | top);
+                break;
+            case FILTER_OP_OR:
+                top   = stack & 1;
+                stack = (stack >> 1) | top;
+                break;
+        }
+    }
+    return stack & 1;
+}
+
+/*
+   1 if the filter may match an entity of type: the program is run in
+   three valued logic, the type conditions and the conditions in never
+   are known (the latter false), everything else is unknown. Used by the
+   parsers to skip entities of a type (or blocks) the filter never takes.
+*/
+static int filter_may_match(OSM_Filter *f, uint32_t type, uint64_t never) {
+    /* two stacks: known value and "is known" */
+    uint64_t val = 0, known = 0, v, k;
+    uint32_t i;
+    int32_t op;
+    struct osm_filter_cond *c;
+
+    for (i = 0; i < f->num_ops; i++) {
+        op = f->ops[i];
+        if (op >= 0) {
+            c = &f->conds[op];
+            val   <<= 1;
+            known <<= 1;
+            if (c->type == OSM_FILTER_TYPE) {
+                val   |= (c->types & type) != 0;
+                known |= 1;
+            }
+            else if ((never >> op) & 1)
+                known |= 1;
+            continue;
+        }
+        switch (op) {
+            case FILTER_OP_NOT:
+                val ^= 1;
+                break;
+            case FILTER_OP_AND:
+            case FILTER_OP_OR:
+                v = val & 1;
+                k = known & 1;
+                val   >>= 1;
+                known >>= 1;
+                /* a known false (AND) / true (OR) decides */
+                if (op == FILTER_OP_AND) {
+                    if ((k && !v) || ((known & 1) && !(val & 1))) {
+                        val &= ~1ULL;
+                        known |= 1;
+                    }
+                    else if (k && (known & 1))
+                        val = (val & ~1ULL) | (v & val & 1);
+                    else
+                        known &= ~1ULL;
+                }
+                else {
+                    if ((k && v) || ((known & 1) && (val & 1))) {
+                        val |= 1;
+                        known |= 1;
+                    }
+                    else if (k && (known & 1))
+                        val = (val & ~1ULL) | ((v | val) & 1);
+                    else
+                        known &= ~1ULL;
+                }
+                break;
+        }
+    }
+    return !(known & 1) || (val & 1);
+}
+
+OSM_Filter *osm_filter_compile(const char *expr) {
+    struct filter_parser p;
+    OSM_Filter *f = calloc(1, sizeof(OSM_Filter));
+
+    if (f == NULL) {
+        fprintf(stderr, "failed to malloc filter: %s\n", strerror(errno));
+        return (OSM_Filter *)NULL;
+    }
+    f->size_words = 4 * OSM_FILTER_MAX_CONDS;
+    f->words = calloc(f->size_words, sizeof(struct osm_filter_word));
+    if (f->words == NULL) {
+        fprintf(stderr, "failed to malloc filter: %s\n", strerror(errno));
+        free(f);
+        return (OSM_Filter *)NULL;
+    }
+
+    p.expr = expr;
+    p.pos  = expr;
+    p.word = NULL;
+    p.f    = f;
+    filter_next(&p);
+    if (filter_expr(&p) != 0 || (p.tok != TOK_END && (filter_error(&p, "garbage"), 1))) {
+        free(p.word);
+        osm_filter_free(f);
+        return (OSM_Filter *)NULL;
+    }
+
+    if (filter_may_match(f, OSMDATA_NODE, 0))
+        f->types |= OSMDATA_NODE;
+    if (filter_may_match(f, OSMDATA_WAY, 0))
+        f->types |= OSMDATA_WAY;
+    if (filter_may_match(f, OSMDATA_REL, 0))
+        f->types |= OSMDATA_REL;
+    if (debug)
+        fprintf(stderr, "%s:%d:%s(): '%s': %u conditions, %u ops, types=%u\n",
+                        __FILE__, __LINE__, __FUNCTION__,
+                        expr, f->num_conds, f->num_ops, f->types);
+    return f;
+}
+
+void osm_filter_free(OSM_Filter *f) {
+    uint32_t i;
+
+    if (f == NULL)
+        return;
+    for (i = 0; i < f->size_words; i++)
+        free(f->words[i].str);
+    free(f->words);
+    free(f->ops);
+    free(f);
+}
+
+/* the bits of the tag conditions matched by t */
+static uint64_t filter_tags(OSM_Filter *f, OSM_Tag_List *t) {
+    const struct osm_filter_string *k;
+    uint64_t bits = 0;
+    uint32_t i;
+
+    if (t == NULL)
+        return 0;
+    for (i = 0; i < t->num; i++) {
+        k = filter_word(f, t->data[i].key, strlen(t->data[i].key));
+        bits |= k->key;
+        if (k->key_val)
+            bits |= k->key_val
+                    & filter_word(f, t->data[i].val, strlen(t->data[i].val))->val;
+    }
+    return bits;
+}
+
+/* the bits of the conditions on the type, id and uid */
+static uint64_t filter_attrs(OSM_Filter *f, uint32_t type, uint64_t id, uint32_t uid) {
+    struct osm_filter_cond *c;
+    uint64_t bits = 0;
+    uint32_t i;
+
+    for (i = 0; i < f->num_conds; i++) {
+        c = &f->conds[i];
+        switch (c->type) {
+            case OSM_FILTER_TYPE:
+                bits |= (uint64_t)((c->types & type) != 0) << i;
+                break;
+            case OSM_FILTER_ID:
+                bits |= (uint64_t)(c->num == id) << i;
+                break;
+            case OSM_FILTER_UID:
+                bits |= (uint64_t)(c->num == uid) << i;
+                break;
+            default: /* tags and users are looked up by string */
+                break;
+        }
+    }
+    return bits;
+}
+
+static int filter_entity(OSM_Filter *f, uint32_t type, uint64_t id,
+                         char *user, uint32_t uid, OSM_Tag_List *tags)
+{
+    uint64_t bits;
+
+    if (!(f->types & type))
+        return 0;
+    bits = filter_attrs(f, type, id, uid);
+    if (f->user_conds && user != NULL)
+        bits |= filter_word(f, user, strlen(user))->user;
+    if (f->tag_conds)
+        bits |= filter_tags(f, tags);
+    return filter_run(f, bits);
+}
+
+/*
+   looks up the strings of the block's string table, once per block before
+   osm_filter_pbf_row(). Returns 0 or -1 if out of memory.
+*/
+int osm_filter_pbf_strings(OSM_Filter *f, OSM_Pbf_Primitive *P) {
+    uint32_t i;
+
+    if (!(f->tag_conds | f->user_conds))
+        return 0;
+    if (P->num_strings > P->size_fstrings) {
+        uint32_t size = P->size_fstrings ? P->size_fstrings : 4096;
+        struct osm_filter_string *tmp;
+
+        while (size < P->num_strings)
+            size *= 2;
+        tmp = realloc(P->fstrings, sizeof(struct osm_filter_string) * size);
+        if (tmp == NULL) {
+            fprintf(stderr, "failed to grow filter string table: %s\n", strerror(errno));
+            return -1;
+        }
+        P->fstrings      = tmp;
+        P->size_fstrings = size;
+    }
+    for (i = 0; i < P->num_strings; i++)
+        P->fstrings[i] = *filter_word(f, P->strings[i].data, P->strings[i].len);
+    return 0;
+}
+
+/*
+   0 if no entity of types in the block can match the filter, because the
+   strings its conditions need are not in the string table. Needs
+   osm_filter_pbf_strings() first, the groups need not be decoded.
+*/
+int osm_filter_pbf_may_match(OSM_Filter *f, OSM_Pbf_Primitive *P, uint32_t types) {
+    uint64_t key = 0, key_val = 0, val = 0, user = 0, never;
+    uint32_t i;
+
+    types &= f->types;
+    if (types == 0)
+        return 0;
+    if (!(f->tag_conds | f->user_conds))
+        return 1;
+
+    for (i = 0; i < P->num_strings; i++) {
+        key     |= P->fstrings[i].key;
+        key_val |= P->fstrings[i].key_val;
+        val     |= P->fstrings[i].val;
+        user    |= P->fstrings[i].user;
+    }
+    /* a KEY=VALUE condition needs both strings */
+    never = (f->tag_conds | f->user_conds) & ~(key | (key_val & val) | user);
+    if (never == 0)
+        return 1;
+
+    return ((types & OSMDATA_NODE) && filter_may_match(f, OSMDATA_NODE, never))
+        || ((types & OSMDATA_WAY)  && filter_may_match(f, OSMDATA_WAY,  never))
+        || ((types & OSMDATA_REL)  && filter_may_match(f, OSMDATA_REL,  never));
+}
+
+/*
+   the filter on row of E (P->nodes, ways or relations of type) without
+   creating the entity: the tags and the user are the string table
+   indexes of the block, no strings are compared.
+*/
+int osm_filter_pbf_row(OSM_Filter *f, OSM_Pbf_Primitive *P, OSM_Pbf_Entities *E,
+                       uint32_t type, uint32_t row)
+{
+    struct osm_filter_string *S = P->fstrings;
+    uint32_t x, k, v, start, num;
+    uint64_t bits;
+
+    if (!(f->types & type))
+        return 0;
+    bits = filter_attrs(f, type, E->id[row], E->uid[row]);
+    if (f->user_conds && E->user_sid[row] >= 0 && E->user_sid[row] < P->num_strings)
+        bits |= S[E->user_sid[row]].user;
+    if (f->tag_conds) {
+        start = E->tag_start[row];
+        num   = E->num_tags[row];
+        for (x = start; x < start + num; x++) {
+            k = P->keys[x];
+            v = P->vals[x];
+            if (k >= P->num_strings || v >= P->num_strings)
+                continue;
+            bits |= S[k].key | (S[k].key_val & S[v].val);
+        }
+    }
+    return filter_run(f, bits);
+}
+
+/* the fields of a lazy entity the filter looks at */
+#define FILTER_FIELDS(f) ((f->tag_conds ? OSM_FIELD_TAGS : 0) \
+                        | (f->info_conds ? OSM_FIELD_INFO : 0))
+
+int osm_filter_node(OSM_Filter *f, OSM_Node *n) {
+    osm_node_fields(n, FILTER_FIELDS(f));
+    return filter_entity(f, OSMDATA_NODE, n->id, n->user, n->uid, n->tags);
+}
+
+int osm_filter_way(OSM_Filter *f, OSM_Way *w) {
+    osm_way_fields(w, FILTER_FIELDS(f));
+    return filter_entity(f, OSMDATA_WAY, w->id, w->user, w->uid, w->tags);
+}
+
+int osm_filter_relation(OSM_Filter *f, OSM_Relation *r) {
+    osm_relation_fields(r, FILTER_FIELDS(f));
+    return filter_entity(f, OSMDATA_REL, r->id, r->user, r->uid, r->tags);
+}
+
+/*
+   for the parsers: the filter callback and the compiled filter must both
+   take the entity, no filter at all takes everything
+*/
+int osm_filter_take_node(int (*cb)(OSM_Node *), OSM_Filter *f, OSM_Node *n) {
+    if (cb != NULL && !cb(n))
+        return 0;
+    return f == NULL || osm_filter_node(f, n);
+}
+
+int osm_filter_take_way(int (*cb)(OSM_Way *), OSM_Filter *f, OSM_Way *w) {
+    if (cb != NULL && !cb(w))
+        return 0;
+    return f == NULL || osm_filter_way(f, w);
+}
+
+int osm_filter_take_relation(int (*cb)(OSM_Relation *), OSM_Filter *f, OSM_Relation *r) {
+    if (cb != NULL && !cb(r))
+        return 0;
+    return f == NULL || osm_filter_relation(f, r);
+}
+
+/* END */
@@ -10,35 +10,41 @@
 
 #include "osm.h"
 
-void osm_free_tags(OSM_Tag_List *t) {
+static void free_tag_list(OSM_Tag_List *t, uint32_t flags) {
     int i;
     if (t == NULL)
         return;
 
-    for (i=0; i< t->num; i++) {
-        if (*t->data[i].key)
-            free(t->data[i].key);
-        if (*t->data[i].val)
-            free(t->data[i].val);
+    if (!(flags & OSM_FLAG_VIEW)) {
+        for (i=0; i< t->num; i++) {
+            if (*t->data[i].key)
+                free(t->data[i].key);
+            if (*t->data[i].val)
+                free(t->data[i].val);
+        }
     }
     free(t->data);
     free(t);
 }
 
+void osm_free_tags(OSM_Tag_List *t) {
+    free_tag_list(t, 0);
+}
+
 void osm_free_node(OSM_Node *n) {
-    if (n == NULL)
+    if (n == NULL || (n->flags & OSM_FLAG_ARENA))
         return;
-    osm_free_tags(n->tags);
-    if (*n->user)
+    free_tag_list(n->tags, n->flags);
+    if (*n->user && !(n->flags & OSM_FLAG_VIEW))
         free(n->user);
     free(n);
 }
 
 void osm_free_way(OSM_Way *w) {
-    if (w == NULL)
+    if (w == NULL || (w->flags & OSM_FLAG_ARENA))
         return;
-    osm_free_tags(w->tags);
-    if (*w->user)
+    free_tag_list(w->tags, w->flags);
+    if (*w->user && !(w->flags & OSM_FLAG_VIEW))
         free(w->user);
     free(w->nodes);
     free(w);
@@ -53,15 +59,17 @@ void osm_free_way_list(OSM_Way_List *w) {
 
 void osm_free_relation(OSM_Relation *r) {
     int i;
-    if (r == NULL)
+    if (r == NULL || (r->flags & OSM_FLAG_ARENA))
         return;
-    osm_free_tags(r->tags);
-    if (*r->user)
+    free_tag_list(r->tags, r->flags);
+    if (*r->user && !(r->flags & OSM_FLAG_VIEW))
         free(r->user);
     if (r->member != NULL) {
-        for (i=0; i<r->member->num; i++) {
-            if (*r->member->data[i].role)
-                free(r->member->data[i].role);
+        if (!(r->flags & OSM_FLAG_VIEW)) {
+            for (i=0; i<r->member->num; i++) {
+                if (*r->member->data[i].role)
+                    free(r->member->data[i].role);
+            }
         }
         free(r->member->data);
         free(r->member);
@@ -69,4 +77,83 @@ void osm_free_relation(OSM_Relation *r) {
     free(r);
 }
 
+/*
+   frees the lists and all entities of d, with an arena in one go
+*/
+void osm_free_data(OSM_Data *d) {
+    int i;
+    if (d == NULL)
+        return;
+    if (d->nodes != NULL) {
+        if (d->arena == NULL)
+            for (i=0; i<d->nodes->num; i++)
+                osm_free_node(d->nodes->data[i]);
+        free(d->nodes->data);
+        free(d->nodes);
+    }
+    osm_node_columns_free(d->node_cols);
+    if (d->ways != NULL) {
+        if (d->arena == NULL)
+            for (i=0; i<d->ways->num; i++)
+                osm_free_way(d->ways->data[i]);
+        free(d->ways->data);
+        free(d->ways);
+    }
+    if (d->relations != NULL) {
+        if (d->arena == NULL)
+            for (i=0; i<d->relations->num; i++)
+                osm_free_relation(d->relations->data[i]);
+        free(d->relations->data);
+        free(d->relations);
+    }
+    osm_arena_free(d->arena);
+    free(d);
+}
+
+/*
+   osm_keep_*(): copy the strings of an entity with OSM_FLAG_VIEW, so it
+   stays valid after the filter callback returned. Does nothing for
+   entities which already own their strings.
+*/
+#define KEEP_STR(s) { if (*(s)) (s) = strdup(s); else (s) = ""; }
+
+static void keep_tags(OSM_Tag_List *t) {
+    int i;
+    if (t == NULL)
+        return;
+    for (i=0; i<t->num; i++) {
+        KEEP_STR(t->data[i].key);
+        KEEP_STR(t->data[i].val);
+    }
+}
+
+void osm_keep_node(OSM_Node *n) {
+    if (!(n->flags & OSM_FLAG_VIEW))
+        return;
+    KEEP_STR(n->user);
+    keep_tags(n->tags);
+    n->flags &= ~OSM_FLAG_VIEW;
+}
+
+void osm_keep_way(OSM_Way *w) {
+    if (!(w->flags & OSM_FLAG_VIEW))
+        return;
+    KEEP_STR(w->user);
+    keep_tags(w->tags);
+    w->flags &= ~OSM_FLAG_VIEW;
+}
+
+void osm_keep_relation(OSM_Relation *r) {
+    int i;
+    if (!(r->flags & OSM_FLAG_VIEW))
+        return;
+    KEEP_STR(r->user);
+    keep_tags(r->tags);
+    if (r->member != NULL) {
+        for (i=0; i<r->member->num; i++)
+            KEEP_STR(r->member->data[i].role);
+    }
+    r->flags &= ~OSM_FLAG_VIEW;
+}
+
 /* END */
@@ -9,6 +9,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <math.h>
 
 #include "osm.h"
@@ -59,10 +60,21 @@ static int gpx_sort_nodes(const void *a, const void *b) {
 }
 
 
+/*
+   the sorted ids of all way nodes, NULL on error. Collects every ref and
+   drops the duplicates after sorting.
+*/
 uint64_t *osm_gpx_write_init(OSM_Data *data, uint32_t *num) {
     int i, k;
-    uint32_t num_nodes = 0;
-    uint64_t *way_nodes = malloc(sizeof(uint64_t) * data->nodes->num);
+    uint32_t num_nodes = 0, size = 1024, j;
+    uint64_t *way_nodes = malloc(sizeof(uint64_t) * size);
+    uint64_t *tmp;
+
+    *num = 0;
+    if (way_nodes == NULL) {
+        fprintf(stderr, "failed to malloc way node list: %s\n", strerror(errno));
+        return NULL;
+    }
     qsort(data->nodes->data, data->nodes->num, sizeof(OSM_Node *), gpx_sort_nodes);
     if (debug) {
         int x;
@@ -79,15 +91,28 @@ uint64_t *osm_gpx_write_init(OSM_Data *data, uint32_t *num) {
         OSM_Way *w = data->ways->data[i]; 
         k = 0;
         while (w->nodes[k]) {
-            if (in_node_list(way_nodes, num_nodes, w->nodes[k]) == -1) {
-                way_nodes[num_nodes] = w->nodes[k];
-                ++num_nodes;
-                qsort(way_nodes, num_nodes, sizeof(uint64_t), osm_cmp_member);
+            if (num_nodes == size) {
+                tmp = realloc(way_nodes, sizeof(uint64_t) * size * 2);
+                if (tmp == NULL) {
+                    fprintf(stderr, "failed to realloc way node list: %s\n",
+                                    strerror(errno));
+                    free(way_nodes);
+                    return NULL;
+                }
+                way_nodes = tmp;
+                size *= 2;
             }
+            way_nodes[num_nodes] = w->nodes[k];
+            ++num_nodes;
             k++;
         }
     }
-    *num = num_nodes;
+    qsort(way_nodes, num_nodes, sizeof(uint64_t), osm_cmp_member);
+    for (i=0, j=0; j<num_nodes; j++) {
+        if (i == 0 || way_nodes[i-1] != way_nodes[j])
+            way_nodes[i++] = way_nodes[j];
+    }
+    *num = i;
     return way_nodes;
 }
 
@@ -123,16 +148,20 @@ void osm_gpx_write_tags(OSM_Tag_List *t, FILE *outfh) {
     char gpx_keys[4][32] = { "ele", "name", "desc", "link" };
     for (k=0; k<4; k++) {
         for (i=0; i<t->num; i++) {
-            if (strcmp(t->data[i].key, osm_keys[k]) == 0)
-                fprintf(outfh, "  <%s>%s</%s>\n",
-                            gpx_keys[k],
-                            osm_encode_xml(t->data[i].val),
-                            gpx_keys[k]);
+            if (strcmp(t->data[i].key, osm_keys[k]) == 0) {
+                char *val = osm_encode_xml(t->data[i].val);
+                if (val == NULL)
+                    continue;
+                fprintf(outfh, "  <%s>%s</%s>\n", gpx_keys[k], val, gpx_keys[k]);
+                if (val != t->data[i].val)
+                    free(val);
+            }
         }
     }
 }
 
-void osm_gpx_write_node(OSM_Node *n, FILE *outfh, int is_trk) {
+/* a wpt / trkpt without tags, e.g. from an OSM_Locations store */
+void osm_gpx_write_point(uint64_t id, double lat, double lon, FILE *outfh, int is_trk) {
     char *type = "wpt";
     char *indent = " ";
     if (is_trk) {
@@ -140,22 +169,34 @@ void osm_gpx_write_node(OSM_Node *n, FILE *outfh, int is_trk) {
         indent = "   ";
     }
 
-    fprintf(outfh, "%s<!-- node id=\"%lu\" -->\n", indent, n->id);
-    fprintf(outfh, "%s<%s lat=\"%.7f\" lon=\"%.7f\"", indent, type, n->lat, n->lon);
-    if (n->tags != NULL && n->tags->num) {
-        fprintf(outfh, ">\n");
-        osm_gpx_write_tags(n->tags, outfh);
-        fprintf(outfh, "%s</%s>\n", indent, type);
+    fprintf(outfh, "%s<!-- node id=\"%lu\" -->\n", indent, id);
+    fprintf(outfh, "%s<%s lat=\"%.7f\" lon=\"%.7f\"/>\n", indent, type, lat, lon);
+}
+
+void osm_gpx_write_node(OSM_Node *n, FILE *outfh, int is_trk) {
+    char *type = "wpt";
+    char *indent = " ";
+    if (is_trk) {
+        type = "trkpt";
+        indent = "   ";
     }
-    else {
-        fprintf(outfh, "/>\n");
+
+    if (n->tags == NULL || n->tags->num == 0) {
+        osm_gpx_write_point(n->id, n->lat, n->lon, outfh, is_trk);
+        return;
     }
+    fprintf(outfh, "%s<!-- node id=\"%lu\" -->\n", indent, n->id);
+    fprintf(outfh, "%s<%s lat=\"%.7f\" lon=\"%.7f\">\n", indent, type, n->lat, n->lon);
+    osm_gpx_write_tags(n->tags, outfh);
+    fprintf(outfh, "%s</%s>\n", indent, type);
 }
 
-void osm_gpx_write(OSM_Data *data, FILE *outfh, char *creator) {
+int osm_gpx_write(OSM_Data *data, FILE *outfh, char *creator) {
     uint32_t num_nodes = 0;
     uint64_t *nodes = osm_gpx_write_init(data, &num_nodes);
     int i, k;
+    if (nodes == NULL)
+        return -1;
     if (debug)
         fprintf(stderr, "%s:%d:%s(): num_nodes=%u\n", 
                     __FILE__, __LINE__, __FUNCTION__, num_nodes);
@@ -201,6 +242,8 @@ void osm_gpx_write(OSM_Data *data, FILE *outfh, char *creator) {
         fprintf(outfh, " </trk>\n");
     }
     osm_gpx_write_footer(outfh);
+    free(nodes);
+    return 0;
 }
 
 /* END */
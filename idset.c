@@ -0,0 +1,387 @@
+/*
+ * idset.c - sets of entity ids
+ *
+ * OSM_Id_Set is an open addressing hash table with linear probing, the
+ * ids themselves are the keys. Adding and looking up an id is O(1) on
+ * average, no matter in which order the ids come in, so the member ids of
+ * relations and ways don't have to be sorted again and again. The slot
+ * value 0 marks a free slot, id 0 is kept in a flag.
+ *
+ * osm_id_set_has_range() needs the ids in order, it works on a sorted
+ * copy which is rebuilt only if ids were added since the last call. The
+ * passes of osm_pbf_parse() only call it between two passes.
+ *
+ * OSM_Id_Bitmap is for the node ids, which may be billions: the id space
+ * is cut into chunks of 64K ids (id >> 16 is the index into the chunk
+ * list). A chunk holds a sorted array of the low 16 bits of its ids as
+ * long as that is smaller than a bitmap of the whole chunk (4096 ids,
+ * 8KB) and is turned into the bitmap then. Duplicates are dropped when
+ * added, a dense region costs about one bit per id. The chunk list is
+ * flat, so it only covers the ids below 2^36. Ids beyond (the negative
+ * ids of editor files are >= 2^63 as uint64_t) go to an OSM_Id_Set.
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "osm.h"
+
+#define ID_SET_MIN_BITS 16
+
+/* Fibonacci hashing, the upper bits are well mixed even for dense ids */
+static inline uint64_t id_set_slot(OSM_Id_Set *s, uint64_t id) {
+    return (id * 0x9E3779B97F4A7C15ULL) >> (64 - s->bits);
+}
+
+static int id_set_alloc(OSM_Id_Set *s, uint32_t bits) {
+    s->slots = calloc((size_t)1 << bits, sizeof(uint64_t));
+    if (s->slots == NULL) {
+        fprintf(stderr, "failed to malloc id set: %s\n", strerror(errno));
+        return -1;
+    }
+    s->bits = bits;
+    s->size = (uint64_t)1 << bits;
+    return 0;
+}
+
+OSM_Id_Set *osm_id_set_new(void) {
+    OSM_Id_Set *s = malloc(sizeof(OSM_Id_Set));
+    if (s == NULL) {
+        fprintf(stderr, "failed to malloc id set: %s\n", strerror(errno));
+        return (OSM_Id_Set *)NULL;
+    }
+    s->num         = 0;
+    s->has_zero    = 0;
+    s->sorted      = NULL;
+    s->num_sorted  = 0;
+    s->size_sorted = 0;
+    s->dirty       = 0;
+    if (id_set_alloc(s, ID_SET_MIN_BITS) != 0) {
+        free(s);
+        return (OSM_Id_Set *)NULL;
+    }
+    return s;
+}
+
+void osm_id_set_free(OSM_Id_Set *s) {
+    if (s == NULL)
+        return;
+    free(s->slots);
+    free(s->sorted);
+    free(s);
+}
+
+/* doubles the table when it's half full */
+static int id_set_grow(OSM_Id_Set *s) {
+    uint64_t *old = s->slots, old_size = s->size, i, pos;
+
+    if (id_set_alloc(s, s->bits + 1) != 0) {
+        s->slots = old;
+        return -1;
+    }
+    for (i = 0; i < old_size; i++) {
+        if (old[i] == 0)
+            continue;
+        pos = id_set_slot(s, old[i]);
+        while (s->slots[pos] != 0)
+            pos = (pos + 1) & (s->size - 1);
+        s->slots[pos] = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+/* 1 if id was added, 0 if it was already in the set, -1 on error */
+int osm_id_set_add(OSM_Id_Set *s, uint64_t id) {
+    uint64_t pos;
+
+    if (id == 0) {
+        if (s->has_zero)
+            return 0;
+        s->has_zero = 1;
+        s->num += 1;
+        s->dirty = 1;
+        return 1;
+    }
+    if ((s->num + 1) * 2 > s->size && id_set_grow(s) != 0)
+        return -1;
+
+    pos = id_set_slot(s, id);
+    while (s->slots[pos] != 0) {
+        if (s->slots[pos] == id)
+            return 0;
+        pos = (pos + 1) & (s->size - 1);
+    }
+    s->slots[pos] = id;
+    s->num += 1;
+    s->dirty = 1;
+    return 1;
+}
+
+int osm_id_set_has(OSM_Id_Set *s, uint64_t id) {
+    uint64_t pos;
+
+    if (id == 0)
+        return s->has_zero;
+    pos = id_set_slot(s, id);
+    while (s->slots[pos] != 0) {
+        if (s->slots[pos] == id)
+            return 1;
+        pos = (pos + 1) & (s->size - 1);
+    }
+    return 0;
+}
+
+static int id_set_sort(OSM_Id_Set *s) {
+    uint64_t i, n = 0;
+
+    if (s->num > s->size_sorted) {
+        uint64_t *tmp = realloc(s->sorted, sizeof(uint64_t) * s->num);
+        if (tmp == NULL) {
+            fprintf(stderr, "failed to malloc sorted id list: %s\n", strerror(errno));
+            return -1;
+        }
+        s->sorted      = tmp;
+        s->size_sorted = s->num;
+    }
+    if (s->has_zero)
+        s->sorted[n++] = 0;
+    for (i = 0; i < s->size; i++) {
+        if (s->slots[i] != 0)
+            s->sorted[n++] = s->slots[i];
+    }
+    qsort(s->sorted, n, sizeof(uint64_t), osm_cmp_member);
+    s->num_sorted = n;
+    s->dirty = 0;
+    return 0;
+}
+
+/* 1 if the set has at least one id between min and max */
+int osm_id_set_has_range(OSM_Id_Set *s, uint64_t min, uint64_t max) {
+    uint64_t lower = 0, upper, pos;
+
+    /* without the sorted copy we can't tell, so say yes */
+    if (s->dirty && id_set_sort(s) != 0)
+        return 1;
+
+    upper = s->num_sorted;
+    while (lower < upper) {
+        pos = lower + (upper - lower) / 2;
+        if (s->sorted[pos] < min)
+            lower = pos + 1;
+        else
+            upper = pos;
+    }
+    return lower < s->num_sorted && s->sorted[lower] <= max;
+}
+
+#define ID_CHUNK_BITS   16
+#define ID_CHUNK_IDS    (1 << ID_CHUNK_BITS)
+#define ID_CHUNK_WORDS  (ID_CHUNK_IDS / 64)
+#define ID_CHUNK_SPARSE (ID_CHUNK_IDS / 16) /* 16 bit ids in a bitmap's size */
+#define ID_CHUNK_MAX    ((uint64_t)1 << 20) /* chunks in the list at most */
+
+OSM_Id_Bitmap *osm_id_bitmap_new(void) {
+    OSM_Id_Bitmap *m = malloc(sizeof(OSM_Id_Bitmap));
+    if (m == NULL) {
+        fprintf(stderr, "failed to malloc id bitmap: %s\n", strerror(errno));
+        return (OSM_Id_Bitmap *)NULL;
+    }
+    m->num        = 0;
+    m->num_chunks = 0;
+    m->chunks     = NULL;
+    m->outside    = NULL;
+    return m;
+}
+
+void osm_id_bitmap_free(OSM_Id_Bitmap *m) {
+    uint64_t i;
+
+    if (m == NULL)
+        return;
+    for (i = 0; i < m->num_chunks; i++)
+        free(m->chunks[i].data);
+    free(m->chunks);
+    osm_id_set_free(m->outside);
+    free(m);
+}
+
+/* position of the first id >= low in a sparse chunk */
+static uint32_t id_chunk_find(struct osm_id_chunk *c, uint16_t low) {
+    uint16_t *ids = c->data;
+    uint32_t lower = 0, upper = c->num, pos;
+
+    while (lower < upper) {
+        pos = lower + (upper - lower) / 2;
+        if (ids[pos] < low)
+            lower = pos + 1;
+        else
+            upper = pos;
+    }
+    return lower;
+}
+
+static int id_chunk_to_bitmap(struct osm_id_chunk *c) {
+    uint16_t *ids = c->data;
+    uint64_t *bits;
+    uint32_t i;
+
+    bits = calloc(ID_CHUNK_WORDS, sizeof(uint64_t));
+    if (bits == NULL) {
+        fprintf(stderr, "failed to malloc id bitmap chunk: %s\n", strerror(errno));
+        return -1;
+    }
+    for (i = 0; i < c->num; i++)
+        bits[ids[i] >> 6] |= (uint64_t)1 << (ids[i] & 63);
+    free(ids);
+    c->data  = bits;
+    c->size  = 0;
+    c->dense = 1;
+    return 0;
+}
+
+/* 1 if id was added, 0 if it was already in the set, -1 on error */
+int osm_id_bitmap_add(OSM_Id_Bitmap *m, uint64_t id) {
+    uint64_t key = id >> ID_CHUNK_BITS;
+    uint16_t low = id & (ID_CHUNK_IDS - 1);
+    struct osm_id_chunk *c;
+    uint16_t *ids;
+    uint32_t pos;
+    int ret;
+
+    if (key >= ID_CHUNK_MAX) {
+        if (m->outside == NULL && (m->outside = osm_id_set_new()) == NULL)
+            return -1;
+        ret = osm_id_set_add(m->outside, id);
+        if (ret == 1)
+            m->num += 1;
+        return ret;
+    }
+    if (key >= m->num_chunks) {
+        uint64_t num = m->num_chunks ? m->num_chunks : 1024;
+        struct osm_id_chunk *tmp;
+
+        while (num <= key)
+            num *= 2;
+        tmp = realloc(m->chunks, sizeof(struct osm_id_chunk) * num);
+        if (tmp == NULL) {
+            fprintf(stderr, "failed to malloc id bitmap: %s\n", strerror(errno));
+            return -1;
+        }
+        memset(tmp + m->num_chunks, 0, sizeof(struct osm_id_chunk) * (num - m->num_chunks));
+        m->chunks     = tmp;
+        m->num_chunks = num;
+    }
+    c = &m->chunks[key];
+
+    if (c->dense) {
+        uint64_t *word = (uint64_t *)c->data + (low >> 6);
+        uint64_t bit   = (uint64_t)1 << (low & 63);
+        if (*word & bit)
+            return 0;
+        *word |= bit;
+        c->num += 1;
+        m->num += 1;
+        return 1;
+    }
+
+    pos = id_chunk_find(c, low);
+    if (pos < c->num && ((uint16_t *)c->data)[pos] == low)
+        return 0;
+    if (c->num == ID_CHUNK_SPARSE) {
+        if (id_chunk_to_bitmap(c) != 0)
+            return -1;
+        return osm_id_bitmap_add(m, id);
+    }
+    if (c->num == c->size) {
+        uint32_t size = c->size ? c->size * 2 : 4;
+        ids = realloc(c->data, sizeof(uint16_t) * size);
+        if (ids == NULL) {
+            fprintf(stderr, "failed to malloc id bitmap chunk: %s\n", strerror(errno));
+            return -1;
+        }
+        c->data = ids;
+        c->size = size;
+    }
+    ids = c->data;
+    memmove(ids + pos + 1, ids + pos, sizeof(uint16_t) * (c->num - pos));
+    ids[pos] = low;
+    c->num += 1;
+    m->num += 1;
+    return 1;
+}
+
+int osm_id_bitmap_has(OSM_Id_Bitmap *m, uint64_t id) {
+    uint64_t key = id >> ID_CHUNK_BITS;
+    uint16_t low = id & (ID_CHUNK_IDS - 1);
+    struct osm_id_chunk *c;
+    uint32_t pos;
+
+    if (key >= ID_CHUNK_MAX)
+        return m->outside != NULL && osm_id_set_has(m->outside, id);
+    if (key >= m->num_chunks)
+        return 0;
+    c = &m->chunks[key];
+    if (c->dense)
+        return (((uint64_t *)c->data)[low >> 6] >> (low & 63)) & 1;
+    if (c->num == 0)
+        return 0;
+    pos = id_chunk_find(c, low);
+    return pos < c->num && ((uint16_t *)c->data)[pos] == low;
+}
+
+/* 1 if chunk c has an id with the low bits between lo and hi */
+static int id_chunk_has_range(struct osm_id_chunk *c, uint32_t lo, uint32_t hi) {
+    uint64_t *bits;
+    uint32_t w, first = lo >> 6, last = hi >> 6;
+    uint64_t mask;
+
+    if (c->num == 0)
+        return 0;
+    if (!c->dense) {
+        uint32_t pos = id_chunk_find(c, lo);
+        return pos < c->num && ((uint16_t *)c->data)[pos] <= hi;
+    }
+    bits = c->data;
+    for (w = first; w <= last; w++) {
+        mask = ~(uint64_t)0;
+        if (w == first)
+            mask &= ~(uint64_t)0 << (lo & 63);
+        if (w == last && (hi & 63) != 63)
+            mask &= ((uint64_t)1 << ((hi & 63) + 1)) - 1;
+        if (bits[w] & mask)
+            return 1;
+    }
+    return 0;
+}
+
+/* 1 if the set has at least one id between min and max */
+int osm_id_bitmap_has_range(OSM_Id_Bitmap *m, uint64_t min, uint64_t max) {
+    uint64_t key, first = min >> ID_CHUNK_BITS, last = max >> ID_CHUNK_BITS;
+    uint64_t bound = ID_CHUNK_MAX << ID_CHUNK_BITS;
+
+    if (min > max)
+        return 0;
+    if (max >= bound && m->outside != NULL
+        && osm_id_set_has_range(m->outside, min > bound ? min : bound, max))
+        return 1;
+    if (first >= m->num_chunks)
+        return 0;
+    if (last >= m->num_chunks)
+        last = m->num_chunks - 1;
+    for (key = first; key <= last; key++) {
+        uint32_t lo = key == first ? min & (ID_CHUNK_IDS - 1) : 0;
+        uint32_t hi = key == (max >> ID_CHUNK_BITS) ? max & (ID_CHUNK_IDS - 1) : ID_CHUNK_IDS - 1;
+        if (id_chunk_has_range(&m->chunks[key], lo, hi))
+            return 1;
+    }
+    return 0;
+}
+
+/* END */
@@ -0,0 +1,240 @@
+/*
+ * locations.c - node id -> location index
+ *
+ * Code which only needs the coordinates of the nodes of a way does not
+ * have to keep (and search) the full OSM_Node with its tags and user.
+ * An OSM_Locations store maps the node id to the location packed into
+ * two 32 bit ints in units of 1e-7 degrees, which is the precision of
+ * OSM (PBF granularity 100, seven decimals in XML). The store is filled
+ * with osm_locations_set() during the node pass, e.g. from the node
+ * callback of osm_stream() or with osm_locations_add_nodes() from an
+ * OSM_Node_List.
+ *
+ * The backends:
+ *  OSM_LOCATIONS_SPARSE: sorted array of (id, location), 16 bytes per
+ *      node. Appending in id order (as in PBF and XML files) is O(1), an
+ *      id out of order marks the array for sorting before the next
+ *      lookup. Lookups are a binary search over one flat array.
+ *  OSM_LOCATIONS_DENSE: array indexed by the id, 8 bytes per id up to
+ *      the highest id, O(1) lookups. The memory is mapped anonymously,
+ *      pages without any node are never touched.
+ *  OSM_LOCATIONS_MMAP: same as DENSE, but backed by a file, e.g. for
+ *      the whole planet. The file is created (or truncated) and removed
+ *      again right away, it only provides the disk space.
+ *
+ * The coordinates are stored with a bias of 2^31, so the all zero bits
+ * of a fresh (or sparse file) page mean "no location".
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+
+#define _GNU_SOURCE /* mremap */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include "osm.h"
+
+#define LOC_BIAS 0x80000000U
+#define LOC_UNSET 0U
+
+/* smallest dense mapping: 1M ids, 8MB */
+#define LOC_DENSE_MIN (1ULL << 20)
+
+struct osm_location_entry {
+    uint64_t id;
+    struct osm_location loc;
+};
+
+static inline uint32_t loc_pack(double deg) {
+    return (uint32_t)(int32_t)lround(deg * 1e7) + LOC_BIAS;
+}
+
+static inline double loc_unpack(uint32_t v) {
+    return (int32_t)(v - LOC_BIAS) / 1e7;
+}
+
+OSM_Locations *osm_locations_new(enum OSM_Locations_Type type, const char *filename) {
+    OSM_Locations *L = malloc(sizeof(OSM_Locations));
+    if (L == NULL) {
+        fprintf(stderr, "failed to malloc location store: %s\n", strerror(errno));
+        return (OSM_Locations *)NULL;
+    }
+    L->type    = type;
+    L->num     = 0;
+    L->size    = 0;
+    L->sorted  = 1;
+    L->last_id = 0;
+    L->entries = NULL;
+    L->locs    = NULL;
+    L->fd      = -1;
+
+    if (type == OSM_LOCATIONS_MMAP) {
+        if (filename == NULL) {
+            fprintf(stderr, "location store: missing file name\n");
+            free(L);
+            return (OSM_Locations *)NULL;
+        }
+        L->fd = open(filename, O_RDWR|O_CREAT|O_TRUNC, 0600);
+        if (L->fd == -1) {
+            fprintf(stderr, "failed to open location file %s: %s\n",
+                            filename, strerror(errno));
+            free(L);
+            return (OSM_Locations *)NULL;
+        }
+        unlink(filename);
+    }
+    return L;
+}
+
+void osm_locations_free(OSM_Locations *L) {
+    if (L == NULL)
+        return;
+    free(L->entries);
+    if (L->locs != NULL)
+        munmap(L->locs, L->size * sizeof(struct osm_location));
+    if (L->fd != -1)
+        close(L->fd);
+    free(L);
+}
+
+/* the dense mapping covers ids 0 ... L->size - 1 */
+static int locations_map(OSM_Locations *L, uint64_t id) {
+    uint64_t size = L->size ? L->size : LOC_DENSE_MIN;
+    size_t len, old_len = L->size * sizeof(struct osm_location);
+    void *tmp;
+
+    while (size <= id)
+        size *= 2;
+    len = size * sizeof(struct osm_location);
+
+    if (L->fd != -1 && ftruncate(L->fd, len) != 0) {
+        fprintf(stderr, "failed to grow location file to %zu bytes: %s\n",
+                        len, strerror(errno));
+        return -1;
+    }
+    if (L->locs == NULL) {
+        if (L->fd != -1)
+            tmp = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, L->fd, 0);
+        else
+            tmp = mmap(NULL, len, PROT_READ|PROT_WRITE,
+                        MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    }
+    else
+        tmp = mremap(L->locs, old_len, len, MREMAP_MAYMOVE);
+
+    if (tmp == MAP_FAILED) {
+        fprintf(stderr, "failed to map %zu bytes for node locations: %s\n",
+                        len, strerror(errno));
+        return -1;
+    }
+    if (debug)
+        fprintf(stderr, "%s:%d:%s(): mapped %lu ids\n",
+                        __FILE__, __LINE__, __FUNCTION__, size);
+    L->locs = tmp;
+    L->size = size;
+    return 0;
+}
+
+static int locations_entry_cmp(const void *a, const void *b) {
+    const struct osm_location_entry *x = a;
+    const struct osm_location_entry *y = b;
+    if      (x->id > y->id) return  1;
+    else if (x->id < y->id) return -1;
+    else                    return  0;
+}
+
+static void locations_sort(OSM_Locations *L) {
+    qsort(L->entries, L->num, sizeof(struct osm_location_entry),
+            locations_entry_cmp);
+    L->sorted  = 1;
+    L->last_id = L->num ? L->entries[L->num - 1].id : 0;
+}
+
+/* returns 0 on success, -1 if the store could not be grown */
+int osm_locations_set(OSM_Locations *L, uint64_t id, double lat, double lon) {
+    struct osm_location loc;
+
+    loc.lat = loc_pack(lat);
+    loc.lon = loc_pack(lon);
+
+    if (L->type != OSM_LOCATIONS_SPARSE) {
+        if (id >= L->size && locations_map(L, id) != 0)
+            return -1;
+        if (L->locs[id].lon == LOC_UNSET)
+            ++L->num;
+        L->locs[id] = loc;
+        return 0;
+    }
+
+    if (L->num == L->size) {
+        uint64_t size = L->size ? L->size * 2 : LOC_DENSE_MIN;
+        struct osm_location_entry *tmp
+            = realloc(L->entries, sizeof(struct osm_location_entry) * size);
+        if (tmp == NULL) {
+            fprintf(stderr, "failed to grow location store to %lu nodes: %s\n",
+                            size, strerror(errno));
+            return -1;
+        }
+        L->entries = tmp;
+        L->size    = size;
+    }
+    if (L->num && id <= L->last_id)
+        L->sorted = 0;
+    L->last_id = id;
+    L->entries[L->num].id  = id;
+    L->entries[L->num].loc = loc;
+    ++L->num;
+    return 0;
+}
+
+/* returns 1 and sets lat / lon if the node is known, 0 if not */
+int osm_locations_get(OSM_Locations *L, uint64_t id, double *lat, double *lon) {
+    struct osm_location loc;
+
+    if (L->type != OSM_LOCATIONS_SPARSE) {
+        if (id >= L->size)
+            return 0;
+        loc = L->locs[id];
+        if (loc.lon == LOC_UNSET)
+            return 0;
+    }
+    else {
+        uint64_t lower = 0, upper = L->num, pos;
+
+        if (!L->sorted)
+            locations_sort(L);
+        while (lower < upper) {
+            pos = lower + (upper - lower) / 2;
+            if (L->entries[pos].id < id)
+                lower = pos + 1;
+            else
+                upper = pos;
+        }
+        if (lower == L->num || L->entries[lower].id != id)
+            return 0;
+        loc = L->entries[lower].loc;
+    }
+    *lat = loc_unpack(loc.lat);
+    *lon = loc_unpack(loc.lon);
+    return 1;
+}
+
+int osm_locations_add_nodes(OSM_Locations *L, OSM_Node_List *n) {
+    uint32_t i;
+    for (i=0; i<n->num; i++) {
+        if (osm_locations_set(L, n->data[i]->id, n->data[i]->lat, n->data[i]->lon) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* END */
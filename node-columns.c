@@ -0,0 +1,205 @@
+/*
+ * node-columns.c - nodes as parallel arrays
+ *
+ * An OSM_Node_List is an array of pointers to malloc()ed OSM_Nodes, each
+ * with room for the user and tags even if it has none (like most nodes).
+ * OSM_Node_Columns keeps the id and the location of a node in three
+ * arrays (16 bytes per node), scans over the coordinates walk the lat /
+ * lon arrays only. The metadata goes to a table of its own, runs of
+ * nodes with the same metadata share one entry. The tags and user
+ * strings are copied into an arena owned by the columns.
+ *
+ * The parsers fill the columns instead of OSM_Data.nodes if OSMDATA_COLUMNS
+ * is given, the node filters still get a full OSM_Node.
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include "osm.h"
+
+#define COLUMNS_SIZE 65536
+
+OSM_Node_Columns *osm_node_columns_new(void) {
+    OSM_Node_Columns *C = calloc(1, sizeof(OSM_Node_Columns));
+    if (C == NULL) {
+        fprintf(stderr, "failed to malloc node columns: %s\n", strerror(errno));
+        return (OSM_Node_Columns *)NULL;
+    }
+    C->strings = osm_arena_new(0);
+    if (C->strings == NULL) {
+        free(C);
+        return (OSM_Node_Columns *)NULL;
+    }
+    return C;
+}
+
+void osm_node_columns_free(OSM_Node_Columns *C) {
+    if (C == NULL)
+        return;
+    free(C->id);
+    free(C->lat);
+    free(C->lon);
+    free(C->info);
+    free(C->infos);
+    free(C->tagged);
+    free(C->tags);
+    osm_arena_free(C->strings);
+    free(C);
+}
+
+static int columns_grow(void **data, uint32_t size, size_t elem) {
+    void *tmp = realloc(*data, elem * size);
+    if (tmp == NULL) {
+        fprintf(stderr, "failed to grow node columns to %u nodes: %s\n",
+                        size, strerror(errno));
+        return -1;
+    }
+    *data = tmp;
+    return 0;
+}
+
+static int columns_grow_rows(OSM_Node_Columns *C) {
+    uint32_t size = C->size ? C->size * 2 : COLUMNS_SIZE;
+
+    if (   columns_grow((void **)&C->id,  size, sizeof(uint64_t)) != 0
+        || columns_grow((void **)&C->lat, size, sizeof(int32_t))  != 0
+        || columns_grow((void **)&C->lon, size, sizeof(int32_t))  != 0)
+        return -1;
+    if (C->info != NULL
+        && columns_grow((void **)&C->info, size, sizeof(uint32_t)) != 0)
+        return -1;
+    C->size = size;
+    return 0;
+}
+
+/* the index of n's metadata in C->infos, 0 if it has none */
+static int64_t columns_info(OSM_Node_Columns *C, OSM_Node *n) {
+    struct osm_node_info *last;
+    char *user = n->user != NULL ? n->user : "";
+
+    if (n->version == 0 && n->uid == 0 && n->changeset == 0
+        && n->timestamp == 0 && *user == '\0')
+        return 0;
+
+    if (C->info == NULL) { /* first node with metadata */
+        C->info = calloc(C->size, sizeof(uint32_t));
+        C->infos = malloc(sizeof(struct osm_node_info) * COLUMNS_SIZE);
+        if (C->info == NULL || C->infos == NULL) {
+            fprintf(stderr, "failed to malloc node info: %s\n", strerror(errno));
+            return -1;
+        }
+        C->size_infos = COLUMNS_SIZE;
+        memset(&C->infos[0], 0, sizeof(struct osm_node_info));
+        C->infos[0].user = "";
+        C->num_infos = 1;
+    }
+
+    last = &C->infos[C->num_infos - 1];
+    if (   last->version   == n->version
+        && last->changeset == n->changeset
+        && last->timestamp == n->timestamp
+        && last->uid       == n->uid
+        && strcmp(last->user, user) == 0)
+        return C->num_infos - 1;
+
+    if (C->num_infos == C->size_infos) {
+        if (columns_grow((void **)&C->infos, C->size_infos * 2,
+                                sizeof(struct osm_node_info)) != 0)
+            return -1;
+        C->size_infos *= 2;
+        last = &C->infos[C->num_infos - 1];
+    }
+    C->infos[C->num_infos].version   = n->version;
+    C->infos[C->num_infos].changeset = n->changeset;
+    C->infos[C->num_infos].timestamp = n->timestamp;
+    C->infos[C->num_infos].uid       = n->uid;
+    C->infos[C->num_infos].user      = strcmp(last->user, user) == 0
+                                        ? last->user
+                                        : osm_arena_strdup(C->strings, user);
+    return C->num_infos++;
+}
+
+/*
+   appends a copy of n, returns 0 or -1 if out of memory. n itself is not
+   touched, it may be an OSM_FLAG_VIEW node.
+*/
+int osm_node_columns_add(OSM_Node_Columns *C, OSM_Node *n) {
+    uint32_t row = C->num;
+    int64_t info;
+
+    if (C->num == C->size && columns_grow_rows(C) != 0)
+        return -1;
+
+    info = columns_info(C, n);
+    if (info < 0)
+        return -1;
+    if (C->info != NULL)
+        C->info[row] = info;
+
+    if (n->tags != NULL && n->tags->num) {
+        if (C->num_tagged == C->size_tagged) {
+            uint32_t size = C->size_tagged ? C->size_tagged * 2 : 1024;
+            if (   columns_grow((void **)&C->tagged, size, sizeof(uint32_t)) != 0
+                || columns_grow((void **)&C->tags, size, sizeof(OSM_Tag_List *)) != 0)
+                return -1;
+            C->size_tagged = size;
+        }
+        C->tagged[C->num_tagged] = row;
+        C->tags[C->num_tagged]   = osm_arena_tags(C->strings, n->tags);
+        C->num_tagged += 1;
+    }
+
+    C->id[row]  = n->id;
+    C->lat[row] = lround(n->lat * 1e7);
+    C->lon[row] = lround(n->lon * 1e7);
+    C->num += 1;
+    return 0;
+}
+
+/* the tags of the node in row, NULL if it has none */
+OSM_Tag_List *osm_node_columns_tags(OSM_Node_Columns *C, uint32_t row) {
+    uint32_t lower = 0, upper = C->num_tagged, pos;
+
+    while (lower < upper) {
+        pos = lower + (upper - lower) / 2;
+        if (C->tagged[pos] < row)
+            lower = pos + 1;
+        else
+            upper = pos;
+    }
+    if (lower == C->num_tagged || C->tagged[lower] != row)
+        return NULL;
+    return C->tags[lower];
+}
+
+/*
+   fills n with the node in row, e.g. for the osm_xml_write_node() & co.
+   The strings and tags belong to the columns, n must not be freed with
+   osm_free_node().
+*/
+void osm_node_columns_get(OSM_Node_Columns *C, uint32_t row, OSM_Node *n) {
+    struct osm_node_info *info = NULL;
+
+    n->id  = C->id[row];
+    n->lat = C->lat[row] / 1e7;
+    n->lon = C->lon[row] / 1e7;
+    if (C->info != NULL)
+        info = &C->infos[C->info[row]];
+    n->user      = info != NULL ? info->user      : "";
+    n->uid       = info != NULL ? info->uid       : 0;
+    n->version   = info != NULL ? info->version   : 0;
+    n->changeset = info != NULL ? info->changeset : 0;
+    n->timestamp = info != NULL ? info->timestamp : 0;
+    n->tags  = osm_node_columns_tags(C, row);
+    n->flags = OSM_FLAG_ARENA;
+}
+
+/* END */
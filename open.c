@@ -89,7 +89,36 @@ OSM_File *osm_open(const char *filename, enum OSM_File_Type type) {
     
     osm_file->type = type;
     osm_file->file = file;
+    osm_file->map  = NULL;
+    osm_file->buf.size = 0;
+    osm_file->buf.data = NULL;
+    osm_file->threads  = 1;
+    osm_file->filter   = NULL;
+    osm_file->index    = NULL;
+    if (type == OSM_FTYPE_PBF) {
+        if (osm_pbf_reader_open(osm_file) != 0) {
+            fclose(file);
+            free(osm_file);
+            return (OSM_File *)NULL;
+        }
+        osm_pbf_index_load(osm_file, filename);
+    }
+    else if (osm_xml_reader_open(osm_file) != 0) {
+        fclose(file);
+        free(osm_file);
+        return (OSM_File *)NULL;
+    }
     return osm_file;
 }
 
+void osm_close(OSM_File *F) {
+    if (F->type == OSM_FTYPE_PBF)
+        osm_pbf_reader_close(F);
+    else
+        osm_xml_reader_close(F);
+    osm_pbf_index_free(F->index);
+    fclose(F->file);
+    free(F);
+}
+
 /* END */
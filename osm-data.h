@@ -23,6 +23,30 @@ typedef struct _osm_relation OSM_Relation;
 typedef struct _osm_rel_list OSM_Relation_List;
 typedef struct _osm_data OSM_Data;
 typedef struct _osm_bbox OSM_BBox;
+typedef struct _osm_arena OSM_Arena;
+typedef struct _osm_node_columns OSM_Node_Columns;
+
+/*
+   entity flags: with OSM_FLAG_VIEW the strings (user, tags, roles) are not
+   owned by the entity but point into the block it was decoded from. They
+   are only valid inside the filter callback, see osm_keep_node() & co.
+*/
+#define OSM_FLAG_VIEW 0x01
+/* the entity and everything it points to lives in the OSM_Data's arena */
+#define OSM_FLAG_ARENA 0x02
+/*
+   some fields are not decoded yet (user, uid, version, changeset, timestamp
+   and tags are empty), see osm_node_fields() & co. Like OSM_FLAG_VIEW only
+   inside the filter callback.
+*/
+#define OSM_FLAG_LAZY 0x04
+
+/* the fields for osm_node_fields() & co. */
+#define OSM_FIELD_INFO 0x01 /* user, uid, version, changeset, timestamp */
+#define OSM_FIELD_TAGS 0x02
+#define OSM_FIELD_ALL  (OSM_FIELD_INFO|OSM_FIELD_TAGS)
+
+struct osm_lazy;
 
 struct _osm_bbox {
     double left_lon;
@@ -52,6 +76,8 @@ struct _osm_node {
     uint64_t     changeset;
     uint64_t     timestamp;
     OSM_Tag_List *tags;
+    uint32_t     flags;
+    struct osm_lazy *lazy;   /* with OSM_FLAG_LAZY */
 };
 
 struct _osm_way {
@@ -63,6 +89,8 @@ struct _osm_way {
     uint64_t     timestamp;
     uint64_t     *nodes;
     OSM_Tag_List *tags;
+    uint32_t     flags;
+    struct osm_lazy *lazy;
 };
 
 struct _osm_way_list {
@@ -108,6 +136,8 @@ struct _osm_relation {
     uint64_t        timestamp;
     OSM_Rel_Member_List  *member;
     OSM_Tag_List   *tags;
+    uint32_t        flags;
+    struct osm_lazy *lazy;
 };
 
 struct _osm_rel_list {
@@ -116,11 +146,46 @@ struct _osm_rel_list {
     OSM_Relation **data;
 };
 
+/*
+   nodes as parallel arrays (see node-columns.c): row i is the node id[i]
+   at lat[i] / lon[i] in 1e-7 degrees. The metadata is kept in a table of
+   its own, info[i] is the index into it (0: none, the info column is only
+   allocated when the first node with metadata comes in). The tags are
+   kept for the tagged nodes only, tagged[] holds their rows in ascending
+   order.
+*/
+struct osm_node_info {
+    uint64_t     changeset;
+    uint64_t     timestamp;
+    uint32_t     version;
+    uint32_t     uid;
+    char        *user;
+};
+
+struct _osm_node_columns {
+    uint32_t      size;
+    uint32_t      num;
+    uint64_t     *id;
+    int32_t      *lat;
+    int32_t      *lon;
+    uint32_t     *info;
+    uint32_t      size_infos;
+    uint32_t      num_infos;
+    struct osm_node_info *infos;
+    uint32_t      size_tagged;
+    uint32_t      num_tagged;
+    uint32_t     *tagged;
+    OSM_Tag_List **tags;
+    OSM_Arena    *strings;   /* users and tags */
+};
+
 struct _osm_data {
     OSM_Node_List     *nodes;
+    OSM_Node_Columns  *node_cols; /* instead of nodes with OSMDATA_COLUMNS */
     OSM_Way_List      *ways;
     OSM_Relation_List *relations;
 //    OSM_CSet_List     *changesets;
+    OSM_Arena         *arena;     /* NULL if the entities are malloc()ed */
 };
 
 #endif /* _OSM_DATA_H */
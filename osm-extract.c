@@ -8,17 +8,26 @@
  */
 
 /* ToDo: usage():
-   "b:dr:w:n:u:t:v:PXG
+   "b:dj:r:w:n:u:t:v:Of:PXGB
    -b llon,botlat,rlon,toplat - use bounding box instead of full file
    -d  - debug
+   -j N - decode (and with -B encode) .osm.pbf blocks with N threads
    -r ID - get relation ID
    -w ID - get way ID
    -n ID - get node ID
    -u USER - fetch objects from user USER
-   -v TAG [-v VAL] - only objects with tag TAG (and value VAL)
+   -t TAG [-v VAL] - only objects with tag TAG (and value VAL)
+   -O - objects with any of the -t tags instead of all
+   -f EXPR - filter expression, see filter.c
    -P - file is pbf format
    -X - file is xml format
    -G - write GPX instead of .osm XML
+   -B - write .osm.pbf instead of .osm XML
+
+   -r, -w, -n, -u and -t can be given more than once: objects with any of
+   the ids, by any of the users, with all (-O: any) of the tags. These
+   groups and -f are and'ed, e.g. -n 1 -w 2 -u bob gets node 1 and way 2
+   (and its nodes) if they were last edited by bob.
 */
 #include <stdlib.h>
 #include <string.h>
@@ -29,148 +38,132 @@
 
 #define OSMX_VERSION "0.2"
 
-uint64_t wanted_id = 0;
 int debug = 0;
-int type;
-char *user = NULL, *tag = NULL, *value = NULL;
 char *file;
-int use_rel = 0, use_way = 0, use_node = 0;
 int file_type = OSM_FTYPE_UNKNOWN;
 int write_gpx = 0;
+int write_pbf = 0;
+int threads = 1;
 OSM_BBox *bbox = NULL;
 
-int rel_wanted(OSM_Relation *r) {
-    if (r->id == wanted_id)
-        return 1;
-    return 0;
-}
+/* the parts of the filter expression, see build_filter() */
+char *ids   = NULL;             /* "(@way & @id=1) | ..." */
+char *users = NULL;
+char *expr  = NULL;             /* -f */
+struct tag_cond {
+    char *cond;                 /* the quoted key, -v adds "=value" */
+    int has_value;              /* -v was given for this -t */
+};
+struct tag_cond *tags = NULL;   /* one condition per -t */
+int num_tags = 0;
+int any_tag  = 0;               /* -O */
 
-int way_wanted(OSM_Way *w) {
-    if (w->id == wanted_id)
-        return 1;
-    return 0;
-}
+/* appends fmt with arg to *str, after sep if *str isn't empty */
+void append(char **str, const char *sep, const char *fmt, const char *arg) {
+    size_t len = *str != NULL ? strlen(*str) : 0;
+    size_t add = strlen(sep) + strlen(fmt) + strlen(arg) + 1;
 
-int node_wanted(OSM_Node *n) {
-    if (n->id == wanted_id)
-        return 1;
-    return 0;
+    *str = realloc(*str, len + add);
+    if (*str == NULL) {
+        fprintf(stderr, "failed to realloc filter expression\n");
+        exit(1);
+    }
+    if (len == 0)
+        **str = '\0';
+    else
+        strcat(*str, sep);
+    len = strlen(*str);
+    snprintf(*str + len, add, fmt, arg);
 }
 
-int user_node(OSM_Node *n) {
-    if (!*n->user)
-        return 0;
-    if (strcmp(user, n->user) == 0) 
-        return 1;
-    return 0;
-}
+/* arg as double quoted word of the filter expression */
+char *quote(const char *arg) {
+    char *q = malloc(2 * strlen(arg) + 3), *p = q;
 
-int user_way(OSM_Way *n) {
-    if (!*n->user)
-        return 0;
-    if (strcmp(user, n->user) == 0) 
-        return 1;
-    return 0;
-}
-int user_rel(OSM_Relation *n) {
-    if (!*n->user)
-        return 0;
-    if (strcmp(user, n->user) == 0) 
-        return 1;
-    return 0;
+    *p++ = '"';
+    for (; *arg; arg++) {
+        if (*arg == '"' || *arg == '\\')
+            *p++ = '\\';
+        *p++ = *arg;
+    }
+    *p++ = '"';
+    *p   = '\0';
+    return q;
 }
 
-int tag_node(OSM_Node *n) {
-    int i;
-    if (n->tags == NULL)
-        return 0;
-    if (tag == NULL)
-        return 1;
-    if (value != NULL) {
-        for (i=0; i<n->tags->num; i++) {
-            char *key = n->tags->data[i].key;
-            char *val = n->tags->data[i].val;
-            if (*key && *val)
-            {
-                if (strcmp(tag, key) == 0 && strcmp(value, val) == 0)
-                    return 1;
-            }
-        }
-    }
-    else {
-        for (i=0; i<n->tags->num; i++) {
-            if (*n->tags->data[i].key) {
-                char *key = n->tags->data[i].key;
-                if (strcmp(tag, key) == 0)
-                    return 1;
-            }
-        }
+void add_id(const char *type, char *arg) {
+    char *end, cond[64];
+    unsigned long long id = strtoull(arg, &end, 10);
+
+    if (*arg == '\0' || *end != '\0') {
+        fprintf(stderr, "invalid id '%s'\n", arg);
+        exit(1);
     }
-    return 0;
+    snprintf(cond, sizeof(cond), "@%s & @id=%llu", type, id);
+    append(&ids, " | ", "(%s)", cond);
 }
 
-int tag_way(OSM_Way *n) {
-    int i;
-    if (n->tags == NULL)
-        return 0;
-    if (tag == NULL)
-        return 1;
-    if (value != NULL) {
-        for (i=0; i<n->tags->num; i++) {
-            char *key = n->tags->data[i].key;
-            char *val = n->tags->data[i].val;
-            if (*key && *val)
-            {
-                if (strcmp(tag, key) == 0 && strcmp(value, val) == 0)
-                    return 1;
-            }
-        }
+void add_tag(char *key) {
+    struct tag_cond *tmp = realloc(tags, sizeof(struct tag_cond) * (num_tags + 1));
+
+    if (tmp == NULL) {
+        fprintf(stderr, "failed to realloc tag list\n");
+        exit(1);
     }
-    else {
-        for (i=0; i<n->tags->num; i++) {
-            if (*n->tags->data[i].key) {
-                char *key = n->tags->data[i].key;
-                if (strcmp(tag, key) == 0)
-                    return 1;
-            }
-        }
+    tags = tmp;
+    tags[num_tags].cond      = quote(key);
+    tags[num_tags].has_value = 0;
+    num_tags++;
+}
+
+void add_value(char *val) {
+    char *q;
+
+    if (num_tags == 0 || tags[num_tags - 1].has_value) {
+        fprintf(stderr, "-v without -t\n");
+        exit(1);
     }
-    return 0;
+    q = quote(val);
+    append(&tags[num_tags - 1].cond, "", "=%s", q);
+    tags[num_tags - 1].has_value = 1;
+    free(q);
 }
 
-int tag_rel(OSM_Relation *n) {
+/*
+   and's the selected parts, NULL if there are none. The -f expression is
+   compiled on its own first, so errors refer to what the user typed, the
+   other parts are generated and always parse.
+*/
+char *build_filter(void) {
+    char *f = NULL, *t = NULL;
+    OSM_Filter *check;
     int i;
-    if (n->tags == NULL)
-        return 0;
-    if (tag == NULL)
-        return 1;
-    if (value != NULL) {
-        for (i=0; i<n->tags->num; i++) {
-            char *key = n->tags->data[i].key;
-            char *val = n->tags->data[i].val;
-            if (*key && *val)
-            {
-                if (strcmp(tag, key) == 0 && strcmp(value, val) == 0)
-                    return 1;
-            }
-        }
-    }
-    else {
-        for (i=0; i<n->tags->num; i++) {
-            if (*n->tags->data[i].key) {
-                char *key = n->tags->data[i].key;
-                if (strcmp(tag, key) == 0)
-                    return 1;
-            }
-        }
+
+    if (expr != NULL) {
+        check = osm_filter_compile(expr);
+        if (check == NULL)
+            exit(1);
+        osm_filter_free(check);
     }
-    return 0;
+
+    for (i = 0; i < num_tags; i++)
+        append(&t, any_tag ? " | " : " & ", "%s", tags[i].cond);
+    if (ids != NULL)
+        append(&f, " & ", "(%s)", ids);
+    if (t != NULL)
+        append(&f, " & ", "(%s)", t);
+    if (users != NULL)
+        append(&f, " & ", "(%s)", users);
+    if (expr != NULL)
+        append(&f, " & ", "(%s)", expr);
+    free(t);
+    return f;
 }
 
 void parse_args(int argc, char **argv) {
-    char c;
+    char c, *q;
     opterr = 0;
-    while ((c = getopt(argc, argv, "b:dr:w:n:u:t:v:PXG")) != -1) {
+    while ((c = getopt(argc, argv, "b:dj:r:w:n:u:t:v:Of:PXGB")) != -1) {
         switch (c) {
             case 'b':
                 bbox = malloc(sizeof(OSM_BBox));
@@ -203,26 +196,34 @@ void parse_args(int argc, char **argv) {
             case 'd':
                 debug = 1;
                 break;
+            case 'j':
+                threads = atoi(optarg);
+                break;
             case 'r':
-                wanted_id = atol(optarg);
-                use_rel   = 1;
+                add_id("relation", optarg);
                 break;
             case 'w':
-                wanted_id = atol(optarg);
-                use_way   = 1;
+                add_id("way", optarg);
                 break;
             case 'n':
-                wanted_id = atol(optarg);
-                use_node  = 1;
+                add_id("node", optarg);
                 break;
             case 'u':
-                user = strdup(optarg);
+                q = quote(optarg);
+                append(&users, " | ", "@user=%s", q);
+                free(q);
                 break;
             case 't':
-                tag  = strdup(optarg);
+                add_tag(optarg);
                 break;
             case 'v':
-                value = strdup(optarg);
+                add_value(optarg);
+                break;
+            case 'O':
+                any_tag = 1;
+                break;
+            case 'f':
+                expr = optarg;
                 break;
             case 'P':
                 file_type = OSM_FTYPE_PBF;
@@ -233,11 +234,18 @@ void parse_args(int argc, char **argv) {
             case 'G':
                 write_gpx = 1;
                 break;
+            case 'B':
+                write_pbf = 1;
+                break;
             default:
                 fprintf(stderr, "unknown option %c\n", c);
                 exit(1);
         }
     }
+    if (write_gpx && write_pbf) {
+        fprintf(stderr, "-G and -B are exclusive\n");
+        exit(1);
+    }
     if (argc == optind) {
         fprintf(stderr, "missing file\n");
         exit(1);
@@ -263,53 +271,106 @@ int main(int argc, char **argv) {
     int i;
     OSM_File *F;
     OSM_Data *O;
+    OSM_Filter *filter = NULL;
+    OSM_Pbf_Writer *W;
+    OSM_Xml_Writer *X;
+    char *expr;
+    int flags, mode, ret = 0;
 
     parse_args(argc, argv);
 
     if (file_type == OSM_FTYPE_UNKNOWN)
         file_type = ftype_by_suffix(file);
 
+    expr = build_filter();
+    if (expr == NULL && bbox == NULL) {
+        fprintf(stderr, "no selection specified\n");
+        exit(1);
+    }
+    if (expr != NULL) {
+        filter = osm_filter_compile(expr);
+        if (filter == NULL)
+            exit(1);
+    }
+
     osm_init();
 
     F = osm_open(file, file_type);
     if (F == NULL)
         return 1;
+    F->threads = threads;
+    F->filter  = filter;
 
-    if (bbox != NULL) {
-        if (tag != NULL) 
-            O = osm_parse(F, OSMDATA_BBOX, bbox, tag_node, tag_way, tag_rel);
-        else if (user != NULL)
-            O = osm_parse(F, OSMDATA_BBOX, bbox, user_node, user_way, user_rel);
-        else
-            O = osm_parse(F, OSMDATA_BBOX, bbox, NULL, NULL, NULL);
-    }
-    else if (use_rel)
-        O = osm_parse(F, OSMDATA_REL, NULL, NULL, NULL, rel_wanted);
-    else if (use_way) 
-        O = osm_parse(F, OSMDATA_WAY, NULL, NULL, way_wanted, NULL);
-    else if (use_node) 
-        O = osm_parse(F, OSMDATA_NODE, NULL, node_wanted, NULL, NULL);
-    else if (user != NULL) 
-        O = osm_parse(F, OSMDATA_REL, NULL, user_node, user_way, user_rel);
-    else if (tag != NULL)
-        O = osm_parse(F, OSMDATA_REL, NULL, tag_node, tag_way, tag_rel);    
-    else {
-        fprintf(stderr, "no selection specified\n");
-        exit(1);
-    }
+    /* the filter fetches the fields it needs, see osm_filter_node() */
+    flags = OSMDATA_ARENA|OSMDATA_LAZY;
+    /* the GPX writer wants the nodes as OSM_Node_List */
+    if (!write_gpx)
+        flags |= OSMDATA_COLUMNS;
+
+    /*
+       start with the relations unless the filter can only take nodes
+       (-n only) or ways and their nodes (-w only)
+    */
+    if (bbox != NULL)
+        mode = OSMDATA_BBOX;
+    else if (filter->types == OSMDATA_NODE)
+        mode = OSMDATA_NODE;
+    else if (!(filter->types & OSMDATA_REL))
+        mode = OSMDATA_WAY;
+    else
+        mode = OSMDATA_REL;
+    O = osm_parse(F, mode|flags, bbox, NULL, NULL, NULL);
     osm_close(F);
+    if (O == NULL) {
+        osm_filter_free(filter);
+        free(expr);
+        return 1;
+    }
 
-    if (write_gpx)
-        osm_gpx_write(O, stdout, "osm-extract v" OSMX_VERSION);
+    if (write_gpx) {
+        if (osm_gpx_write(O, stdout, "osm-extract v" OSMX_VERSION) != 0)
+            ret = 1;
+    }
+    else if (write_pbf) {
+        W = osm_pbf_write_open("osm-extract v" OSMX_VERSION, stdout, threads);
+        if (W == NULL)
+            ret = 1;
+        else {
+            if (O->node_cols != NULL)
+                ret = osm_pbf_write_node_columns(W, O->node_cols);
+            else
+                for (i=0; ret == 0 && O->nodes != NULL && i<O->nodes->num; i++)
+                    ret = osm_pbf_write_node(W, O->nodes->data[i]);
+            for (i=0; ret == 0 && O->ways != NULL && i<O->ways->num; i++)
+                ret = osm_pbf_write_way(W, O->ways->data[i]);
+            for (i=0; ret == 0 && O->relations != NULL && i<O->relations->num; i++)
+                ret = osm_pbf_write_relation(W, O->relations->data[i]);
+            if (osm_pbf_write_close(W) != 0 || ret != 0)
+                ret = 1;
+        }
+    }
     else {
-        osm_xml_write_header("osm-extract v" OSMX_VERSION, stdout);
-        for (i=0; i<O->nodes->num; i++)
-            osm_xml_write_node(O->nodes->data[i], stdout);
-        for (i=0; i<O->ways->num; i++)
-            osm_xml_write_way(O->ways->data[i], stdout);
-        for (i=0; i<O->relations->num; i++)
-            osm_xml_write_relation(O->relations->data[i], stdout);
-       osm_xml_write_footer(stdout);
-    } 
-    return 0;
+        X = osm_xml_writer_open(stdout);
+        if (X == NULL)
+            ret = 1;
+        else {
+            osm_xml_put_header(X, "osm-extract v" OSMX_VERSION);
+            if (O->node_cols != NULL)
+                osm_xml_put_node_columns(X, O->node_cols);
+            else
+                for (i=0; O->nodes != NULL && i<O->nodes->num; i++)
+                    osm_xml_put_node(X, O->nodes->data[i]);
+            for (i=0; O->ways != NULL && i<O->ways->num; i++)
+                osm_xml_put_way(X, O->ways->data[i]);
+            for (i=0; O->relations != NULL && i<O->relations->num; i++)
+                osm_xml_put_relation(X, O->relations->data[i]);
+            osm_xml_put_footer(X);
+            if (osm_xml_writer_close(X) != 0)
+                ret = 1;
+        }
+    }
+    osm_free_data(O);
+    osm_filter_free(filter);
+    free(expr);
+    return ret;
 }
@@ -12,6 +12,8 @@
 #define LIBOSM_VERSION "0.3"
 
 #include <stdio.h> /* FILE */
+#include <sys/types.h> /* off_t */
+#include <zlib.h> /* z_stream */
 #include "fileformat.pb-c.h"
 #include "osmformat.pb-c.h"
 
@@ -26,6 +28,15 @@
 #define OSMDATA_CSET 0x08
 #define OSMDATA_DUMP 0x10
 #define OSMDATA_BBOX 0x20
+/* or'ed to the mode of osm_parse(): allocate the result in an OSM_Arena */
+#define OSMDATA_ARENA 0x40
+/* or'ed to the mode of osm_parse(): nodes go to OSM_Data.node_cols */
+#define OSMDATA_COLUMNS 0x80
+/*
+   or'ed to the mode of osm_parse(): the filters get OSM_FLAG_LAZY entities
+   and fetch the fields they look at with osm_node_fields() & co.
+*/
+#define OSMDATA_LAZY 0x100
 
 #define NANO_DEGREE .000000001
 #define MAX_BLOCK_HEADER_SIZE 64*1024
@@ -41,14 +52,358 @@ enum OSM_File_Type {
     OSM_FTYPE_XML
 };
 
+enum OSM_Reader_Type {
+    OSM_READER_PREAD,
+    OSM_READER_MMAP
+};
+
+struct osm_buffer {
+    uint32_t size;
+    unsigned char *data;
+};
+
+/* reusable zlib context plus output buffer, see osm_pbf_inflate() */
+struct osm_inflate {
+    z_stream strm;
+    int ready;                  /* inflateInit() done */
+    struct osm_buffer out;
+};
+
+/* the fields of a BlobHeader we need, type points into the read buffer */
+struct osm_pbf_bh {
+    const char *type;
+    uint32_t type_len;
+    uint32_t datasize;
+};
+
+struct _osm_pbf_block;
+
+/*
+   a PrimitiveBlock decoded by osm_pbf_decode_primitive(), see pbf-decode.c.
+   All arrays are scratch space which is reused for the next block, strings
+   point into the uncompressed block and are NUL terminated.
+*/
+struct osm_pbf_string {
+    const char *data;
+    uint32_t len;
+};
+
+/*
+   the conditions of a filter a string fulfills as tag key, value or user:
+   a tag (k, v) sets key[k] | (key_val[k] & val[v]), see filter.c
+*/
+struct osm_filter_string {
+    uint64_t key;               /* KEY */
+    uint64_t key_val;           /* KEY=any value */
+    uint64_t val;               /* any key=VALUE */
+    uint64_t user;              /* @user=NAME */
+};
+
+/* the entities of one PrimitiveGroup: entities [start, end) of type */
+typedef struct _osm_pbf_group {
+    uint32_t type;              /* OSMDATA_NODE, OSMDATA_WAY, OSMDATA_REL */
+    uint32_t start;
+    uint32_t end;
+} OSM_Pbf_Group;
+
+/* one column per field, entity i of a type is the i-th row */
+typedef struct _osm_pbf_entities {
+    uint32_t  num;
+    uint32_t  size;
+    int64_t  *id;
+    int64_t  *lat;              /* nodes, delta decoded, in granularity */
+    int64_t  *lon;
+    uint32_t *tag_start;        /* into keys/vals */
+    uint32_t *num_tags;
+    uint32_t *ref_start;        /* ways, relations: into refs */
+    uint32_t *num_refs;
+    int32_t  *version;
+    int64_t  *timestamp;        /* in date_granularity */
+    int64_t  *changeset;
+    int32_t  *uid;
+    int32_t  *user_sid;         /* -1: no user */
+} OSM_Pbf_Entities;
+
+typedef struct _osm_pbf_primitive {
+    int32_t  granularity;
+    int32_t  date_granularity;
+    int64_t  lat_offset;
+    int64_t  lon_offset;
+    uint32_t num_strings;
+    uint32_t size_strings;
+    struct osm_pbf_string *strings;
+    uint32_t num_groups;
+    uint32_t size_groups;
+    OSM_Pbf_Group *groups;
+    OSM_Pbf_Entities nodes;
+    OSM_Pbf_Entities ways;
+    OSM_Pbf_Entities relations;
+    uint32_t num_tags;          /* string table indexes of all tags */
+    uint32_t size_tags;
+    uint32_t *keys;
+    uint32_t *vals;
+    uint32_t num_refs;          /* way nodes and relation members */
+    uint32_t size_refs;
+    int64_t  *refs;             /* delta decoded */
+    int32_t  *roles;            /* relations: role string */
+    int32_t  *types;            /* relations: Relation.MemberType */
+    uint32_t size_rows;
+    uint32_t *rows;             /* osm_pbf_nodes_in_box() result */
+    uint32_t size_fstrings;
+    struct osm_filter_string *fstrings; /* osm_filter_pbf_strings() result */
+} OSM_Pbf_Primitive;
+
+/* where the missing fields of an OSM_FLAG_LAZY entity are decoded from */
+struct osm_lazy {
+    OSM_Pbf_Primitive *P;
+    OSM_Pbf_Entities  *E;
+    uint32_t row;
+    uint32_t missing;           /* OSM_FIELD_* */
+};
+
+/* a bbox in the integer coordinates of one block, bounds included */
+struct osm_pbf_box {
+    int64_t min_lat;
+    int64_t max_lat;
+    int64_t min_lon;
+    int64_t max_lon;
+};
+
+#define OSM_ARENA_CHUNK_SIZE (1024*1024)
+
+struct osm_arena_chunk;
+
+/* see arena.c */
+struct _osm_arena {
+    struct osm_arena_chunk *chunks;  /* the current one first */
+    size_t chunk_size;
+    size_t allocated;
+};
+
+/* one OSMData block in the sidecar index, see pbf-index.c */
+typedef struct _osm_pbf_index_entry {
+    uint64_t offset;            /* of the frame in the .osm.pbf file */
+    uint32_t types;             /* OSMDATA_NODE | OSMDATA_WAY | OSMDATA_REL */
+    uint32_t num;               /* number of entities */
+    uint64_t min_id;
+    uint64_t max_id;
+    int32_t  bottom, left;      /* bbox of the nodes in 1e-7 degrees */
+    int32_t  top, right;
+} OSM_Pbf_Index_Entry;
+
+typedef struct _osm_pbf_index {
+    uint32_t num;
+    uint32_t size;
+    OSM_Pbf_Index_Entry *data;
+} OSM_Pbf_Index;
+
+#define OSM_PBF_INDEX_SUFFIX ".idx"
+
+/* compiled filter expression, see filter.c */
+#define OSM_FILTER_MAX_CONDS 64
+
+enum OSM_Filter_Cond_Type {
+    OSM_FILTER_KEY = 0,         /* has a tag key */
+    OSM_FILTER_TAG,             /* has the tag key=val */
+    OSM_FILTER_TYPE,            /* is an OSMDATA_NODE / _WAY / _REL */
+    OSM_FILTER_ID,
+    OSM_FILTER_USER,
+    OSM_FILTER_UID
+};
+
+struct osm_filter_cond {
+    enum OSM_Filter_Cond_Type type;
+    uint32_t types;             /* OSM_FILTER_TYPE */
+    uint64_t num;               /* OSM_FILTER_ID, OSM_FILTER_UID */
+};
+
+/* a string of the filter with the condition bits it sets */
+struct osm_filter_word {
+    char     *str;              /* NULL: free slot */
+    uint32_t  len;
+    uint32_t  hash;
+    struct osm_filter_string m;
+};
+
+typedef struct _osm_filter {
+    uint32_t num_conds;
+    struct osm_filter_cond conds[OSM_FILTER_MAX_CONDS];
+    uint32_t num_words;
+    uint32_t size_words;        /* power of 2 */
+    struct osm_filter_word *words;
+    uint32_t num_ops;
+    uint32_t size_ops;
+    int32_t *ops;               /* postfix, >= 0: condition, < 0: operator */
+    uint64_t tag_conds;         /* conditions on the tags */
+    uint64_t info_conds;        /* ... on the user or uid */
+    uint64_t user_conds;        /* ... on the user */
+    uint32_t types;             /* OSMDATA_* the filter may take */
+} OSM_Filter;
+
 typedef struct _osm_file {
     FILE *file;
     enum OSM_File_Type type;
+    /* .osm.pbf block reader, see pbf-read.c */
+    enum OSM_Reader_Type reader;
+    int fd;
+    unsigned char *map;
+    off_t size;
+    off_t pos;
+    struct osm_buffer buf;
+    /* number of decoder threads for .osm.pbf files, see pbf-run.c */
+    int threads;
+    /* compiled filter, applied by the parsers after the filter callbacks */
+    OSM_Filter *filter;
+    /* block slots of osm_pbf_run(), kept over all passes */
+    struct _osm_pbf_block *blocks;
+    uint32_t num_blocks;
+    /* sidecar block index, NULL if there is none */
+    OSM_Pbf_Index *index;
 } OSM_File;
 
+#define OSM_PBF_BLOCKS_PER_THREAD 4
+
+/* buffer size for osm_timestamp_format() */
+#define OSM_TIMESTAMP_SIZE 32
+
+/* the date of the last timestamp, see osm_timestamp_format() */
+struct osm_timestamp_cache {
+    int64_t day;
+    int     valid;
+    char    date[12];           /* "YYYY-MM-DDT" */
+};
+
+/* .osm XML output buffer, see xml-write.c */
+typedef struct _osm_xml_writer {
+    FILE   *outfh;              /* NULL: only collect in data */
+    char   *data;
+    size_t  len;
+    size_t  size;
+    int     failed;
+    struct osm_timestamp_cache ts;
+} OSM_Xml_Writer;
+
+/* one element of a .osm XML file, see xml-read.c */
+#define OSM_XML_MAX_ATTRS 16
+
+enum OSM_Xml_Tag_Type {
+    OSM_XML_OPEN,               /* <node ...> */
+    OSM_XML_EMPTY,              /* <node .../> */
+    OSM_XML_CLOSE               /* </node> */
+};
+
+struct osm_xml_attr {
+    const char *name;           /* pointers into the file, */
+    const char *val;            /* not \0 terminated */
+    uint32_t name_len;
+    uint32_t val_len;
+};
+
+struct osm_xml_tag {
+    enum OSM_Xml_Tag_Type type;
+    off_t offset;               /* of the '<' */
+    const char *name;
+    uint32_t name_len;
+    uint32_t num_attrs;
+    struct osm_xml_attr attrs[OSM_XML_MAX_ATTRS];
+};
+
+#define OSM_XML_IS(t, s) \
+    ((t)->name_len == sizeof(s) - 1 && memcmp((t)->name, s, sizeof(s) - 1) == 0)
+#define OSM_XML_ATTR_IS(a, s) OSM_XML_IS(a, s)
+
+/* .osm.pbf writer, see pbf-write.c */
+typedef struct _osm_pbf_writer OSM_Pbf_Writer;
+
+typedef struct _osm_pbf_block {
+    int state;
+    off_t offset;               /* file offset of the frame */
+    unsigned char *blob;        /* the Blob message */
+    uint32_t blob_len;
+    struct osm_buffer frame;    /* read buffer, if the file isn't mmap()ed */
+    struct osm_inflate inflate; /* uncompressed block, valid until the
+                                   slot is reused */
+    OSM_Pbf_Primitive primitive;/* decode scratch space of this slot */
+    void *data;                 /* decoded block, owned by the handler */
+} OSM_Pbf_Block;
+
+typedef struct _osm_pbf_handler {
+    int  (*decode)(OSM_Pbf_Block *b, void *ctx); /* runs in any thread */
+    int  (*apply)(OSM_Pbf_Block *b, void *ctx);  /* in file order */
+    void (*free_data)(void *data);
+    /* with an index: called before the pass, 0 skips the block */
+    int  (*want)(OSM_Pbf_Index_Entry *e, void *ctx);
+    void *ctx;
+} OSM_Pbf_Handler;
+
+/* a set of entity ids, see idset.c */
+typedef struct _osm_id_set {
+    uint64_t  num;              /* ids in the set */
+    uint64_t  size;             /* slots, 1 << bits */
+    uint32_t  bits;
+    int       has_zero;
+    uint64_t *slots;            /* 0: free */
+    uint64_t *sorted;           /* for osm_id_set_has_range() */
+    uint64_t  num_sorted;
+    uint64_t  size_sorted;
+    int       dirty;            /* ids added since sorted was built */
+} OSM_Id_Set;
+
+/* a set of node ids in 64K id chunks, see idset.c */
+struct osm_id_chunk {
+    uint32_t num;               /* ids in the chunk */
+    uint16_t size;              /* of the sparse id array */
+    uint16_t dense;             /* data is a bitmap, not a sorted array */
+    void    *data;
+};
+
+typedef struct _osm_id_bitmap {
+    uint64_t num;               /* ids in the set */
+    uint64_t num_chunks;
+    struct osm_id_chunk *chunks;/* chunk i holds the ids i << 16 ... */
+    OSM_Id_Set *outside;        /* ids beyond the chunks, e.g. negative
+                                   ones, NULL until there is one */
+} OSM_Id_Bitmap;
+
+/* node id -> location, see locations.c */
+enum OSM_Locations_Type {
+    OSM_LOCATIONS_SPARSE = 0,
+    OSM_LOCATIONS_DENSE,
+    OSM_LOCATIONS_MMAP
+};
+
+struct osm_location {
+    uint32_t lat;               /* 1e-7 degrees + 2^31, 0: unset */
+    uint32_t lon;
+};
+
+typedef struct _osm_locations {
+    enum OSM_Locations_Type type;
+    uint64_t num;               /* nodes in the store */
+    uint64_t size;              /* sparse: entries, dense: ids mapped */
+    int      sorted;
+    uint64_t last_id;
+    struct osm_location_entry *entries; /* sparse */
+    struct osm_location *locs;  /* dense, indexed by id */
+    int      fd;                /* OSM_LOCATIONS_MMAP */
+} OSM_Locations;
+
+/* callbacks of osm_stream(), see stream.c */
+typedef struct _osm_stream_handler {
+    int  (*node)(OSM_Node *n, void *ctx);
+    int  (*way)(OSM_Way *w, void *ctx);
+    int  (*relation)(OSM_Relation *r, void *ctx);
+    int  (*block)(void *ctx);
+    void *ctx;
+} OSM_Stream_Handler;
+
+#define OSM_STREAM_XML_BLOCK 8000
+
 /* util.c */
 extern char *osm_relmember_type(int id);
 extern void osm_init();
+extern size_t osm_xml_plain_len(const char *s, size_t len);
+extern const char *osm_xml_entity(char c);
 extern char *osm_encode_xml(char *src);
 struct osm_members {
     uint32_t num;
@@ -59,6 +414,40 @@ extern int osm_cmp_member(const void *a, const void *b);
 extern void osm_sort_member(struct osm_members *m);
 extern void osm_add_members(struct osm_members *m, uint32_t num, uint64_t *list, int sort);
 extern int osm_is_member(struct osm_members *m, uint64_t id);
+extern int osm_timestamp_format(struct osm_timestamp_cache *c, int64_t t, char *buf);
+
+/* idset.c */
+extern OSM_Id_Set *osm_id_set_new(void);
+extern void osm_id_set_free(OSM_Id_Set *s);
+extern int osm_id_set_add(OSM_Id_Set *s, uint64_t id);
+extern int osm_id_set_has(OSM_Id_Set *s, uint64_t id);
+extern int osm_id_set_has_range(OSM_Id_Set *s, uint64_t min, uint64_t max);
+extern OSM_Id_Bitmap *osm_id_bitmap_new(void);
+extern void osm_id_bitmap_free(OSM_Id_Bitmap *m);
+extern int osm_id_bitmap_add(OSM_Id_Bitmap *m, uint64_t id);
+extern int osm_id_bitmap_has(OSM_Id_Bitmap *m, uint64_t id);
+extern int osm_id_bitmap_has_range(OSM_Id_Bitmap *m, uint64_t min, uint64_t max);
+
+/* locations.c */
+extern OSM_Locations *osm_locations_new(enum OSM_Locations_Type type, const char *filename);
+extern void osm_locations_free(OSM_Locations *L);
+extern int osm_locations_set(OSM_Locations *L, uint64_t id, double lat, double lon);
+extern int osm_locations_get(OSM_Locations *L, uint64_t id, double *lat, double *lon);
+extern int osm_locations_add_nodes(OSM_Locations *L, OSM_Node_List *n);
+
+/* filter.c */
+extern OSM_Filter *osm_filter_compile(const char *expr);
+extern void osm_filter_free(OSM_Filter *f);
+extern int osm_filter_node(OSM_Filter *f, OSM_Node *n);
+extern int osm_filter_way(OSM_Filter *f, OSM_Way *w);
+extern int osm_filter_relation(OSM_Filter *f, OSM_Relation *r);
+extern int osm_filter_take_node(int (*cb)(OSM_Node *), OSM_Filter *f, OSM_Node *n);
+extern int osm_filter_take_way(int (*cb)(OSM_Way *), OSM_Filter *f, OSM_Way *w);
+extern int osm_filter_take_relation(int (*cb)(OSM_Relation *), OSM_Filter *f, OSM_Relation *r);
+extern int osm_filter_pbf_strings(OSM_Filter *f, OSM_Pbf_Primitive *P);
+extern int osm_filter_pbf_may_match(OSM_Filter *f, OSM_Pbf_Primitive *P, uint32_t types);
+extern int osm_filter_pbf_row(OSM_Filter *f, OSM_Pbf_Primitive *P, OSM_Pbf_Entities *E,
+                              uint32_t type, uint32_t row);
 
 
 /* free.c */
@@ -67,19 +456,38 @@ extern void osm_free_node(OSM_Node *n);
 extern void osm_free_way(OSM_Way *w);
 extern void osm_free_way_list(OSM_Way_List *w);
 extern void osm_free_relation(OSM_Relation *r);
+extern void osm_keep_node(OSM_Node *n);
+extern void osm_keep_way(OSM_Way *w);
+extern void osm_keep_relation(OSM_Relation *r);
+extern void osm_free_data(OSM_Data *d);
+
+/* arena.c */
+extern OSM_Arena *osm_arena_new(size_t chunk_size);
+extern void *osm_arena_alloc(OSM_Arena *A, size_t size);
+extern char *osm_arena_strdup(OSM_Arena *A, const char *s);
+extern void osm_arena_free(OSM_Arena *A);
+extern OSM_Tag_List *osm_arena_tags(OSM_Arena *A, OSM_Tag_List *t);
+extern OSM_Node *osm_arena_node(OSM_Arena *A, OSM_Node *n);
+extern OSM_Way *osm_arena_way(OSM_Arena *A, OSM_Way *w);
+extern OSM_Relation *osm_arena_relation(OSM_Arena *A, OSM_Relation *r);
+
+/* node-columns.c */
+extern OSM_Node_Columns *osm_node_columns_new(void);
+extern void osm_node_columns_free(OSM_Node_Columns *C);
+extern int osm_node_columns_add(OSM_Node_Columns *C, OSM_Node *n);
+extern OSM_Tag_List *osm_node_columns_tags(OSM_Node_Columns *C, uint32_t row);
+extern void osm_node_columns_get(OSM_Node_Columns *C, uint32_t row, OSM_Node *n);
 
 /* realloc.c */
 extern void osm_realloc_tag_list(OSM_Tag_List *t);
 extern void osm_realloc_node_list(OSM_Node_List *n);
 extern void osm_realloc_way_list(OSM_Way_List *w);
 extern void osm_realloc_rel_list(OSM_Relation_List *r);
-extern void osm_realloc_nodes(uint64_t *n, int num, int *size);
+extern void osm_realloc_nodes(uint64_t **n, int num, int *size);
 extern void osm_realloc_rel_member(OSM_Rel_Member_List *r);
 
 /* xml.c */
 extern uint64_t osm_timestamp2epoch(char *ts);
-char *osm_xml_decode(char *src);
-extern char *osm_xml_fetch_param(char *src, char *str, char *dest);
 extern OSM_Data *osm_xml_parse(OSM_File *F,
               int mode,
               OSM_BBox *bbox,
@@ -88,38 +496,73 @@ extern OSM_Data *osm_xml_parse(OSM_File *F,
               int (*rel_filter)(OSM_Relation *)/*,
               int (*cset_filter)(OSM_Changeset *) */
         );
+extern int osm_xml_stream(OSM_File *F, OSM_Stream_Handler *h);
+
+/* xml-read.c */
+extern int osm_xml_reader_open(OSM_File *F);
+extern void osm_xml_reader_close(OSM_File *F);
+extern int osm_xml_next(OSM_File *F, struct osm_xml_tag *T);
+extern struct osm_xml_attr *osm_xml_attr(struct osm_xml_tag *T, const char *name);
+extern char *osm_xml_string(const char *s, uint32_t len);
+extern int64_t osm_xml_int(const char *s, uint32_t len);
+extern double osm_xml_double(const char *s, uint32_t len);
+extern uint64_t osm_xml_timestamp(const char *s, uint32_t len);
+extern int osm_xml_node_attr(OSM_Node *n, struct osm_xml_attr *a);
+extern int osm_xml_way_attr(OSM_Way *w, struct osm_xml_attr *a);
+extern int osm_xml_relation_attr(OSM_Relation *r, struct osm_xml_attr *a);
+extern void osm_xml_add_tag(OSM_Tag_List **tl, struct osm_xml_tag *T);
 
 /* xml-relation.c */
-extern OSM_Relation *osm_xml_get_relation(FILE *file, char *buffer, char *param);
-extern OSM_Relation_List *osm_xml_parse_relations(long int start,
-                            FILE *file,
+extern OSM_Relation *osm_xml_get_relation(OSM_File *F);
+extern OSM_Relation_List *osm_xml_parse_relations(off_t start,
+                            OSM_File *F,
                             int mode,
                             int(*filter)(OSM_Relation *r),
-                            struct osm_members *mem_ways,
-                            struct osm_members *mem_node);
+                            OSM_Filter *cfilter,
+                            OSM_Id_Set *mem_ways,
+                            OSM_Id_Bitmap *mem_node,
+                            OSM_Arena *arena);
 /* xml-way.c */
-extern OSM_Way *osm_xml_get_way(FILE *file, char *buffer, char *param);
-extern OSM_Way_List *osm_xml_parse_ways(long int start,
-                        FILE *file,
+extern OSM_Way *osm_xml_get_way(OSM_File *F);
+extern OSM_Way_List *osm_xml_parse_ways(off_t start,
+                        OSM_File *F,
                         int mode,
                         int(*filter)(OSM_Way *w),
-                        struct osm_members *mem_ways,
-                        struct osm_members *mem_node);
+                        OSM_Filter *cfilter,
+                        OSM_Id_Set *mem_ways,
+                        OSM_Id_Bitmap *mem_node,
+                        OSM_Arena *arena);
 /* xml-node.c */
-extern OSM_Node *osm_xml_get_node(FILE *file, char *buffer, char *param);
-extern OSM_Node_List *osm_xml_parse_nodes(long int start,
-                                    FILE *file,
+extern OSM_Node *osm_xml_get_node(OSM_File *F);
+extern OSM_Node_List *osm_xml_parse_nodes(off_t start,
+                                    OSM_File *F,
                                     int mode,
                                     int(*filter)(OSM_Node *n),
-                                    struct osm_members *wanted);
+                                    OSM_Filter *cfilter,
+                                    OSM_Id_Bitmap *wanted,
+                                    OSM_Arena *arena,
+                                    OSM_Node_Columns *cols);
 
 /* xml-write.c */
 extern void osm_xml_write_header(char *who, FILE *outfh);
 extern void osm_xml_write_footer(FILE *outfh);
 extern void osm_xml_write_tags(OSM_Tag_List *t, FILE *outfh);
 extern void osm_xml_write_node(OSM_Node *n, FILE *outfh);
+extern void osm_xml_write_node_columns(OSM_Node_Columns *C, FILE *outfh);
 extern void osm_xml_write_way(OSM_Way *w, FILE *outfh);
 extern void osm_xml_write_relation(OSM_Relation *r, FILE *outfh);
+extern OSM_Xml_Writer *osm_xml_writer_open(FILE *outfh);
+extern int osm_xml_writer_flush(OSM_Xml_Writer *X);
+extern int osm_xml_writer_close(OSM_Xml_Writer *X);
+extern void osm_xml_put_header(OSM_Xml_Writer *X, char *who);
+extern void osm_xml_put_footer(OSM_Xml_Writer *X);
+extern void osm_xml_put_tags(OSM_Xml_Writer *X, OSM_Tag_List *t);
+extern void osm_xml_put_node(OSM_Xml_Writer *X, OSM_Node *n);
+extern void osm_xml_put_node_columns(OSM_Xml_Writer *X, OSM_Node_Columns *C);
+extern void osm_xml_put_way(OSM_Xml_Writer *X, OSM_Way *w);
+extern void osm_xml_put_relation(OSM_Xml_Writer *X, OSM_Relation *r);
+extern void osm_xml_put_chunk(OSM_Xml_Writer *X, OSM_Xml_Writer *C);
+extern int osm_xml_put_file(OSM_Xml_Writer *X, OSM_File *F);
 
 /* pbf.c */
 extern OSM_Data *osm_pbf_parse(OSM_File *F,
@@ -130,6 +573,11 @@ extern OSM_Data *osm_pbf_parse(OSM_File *F,
               int (*rel_filter)(OSM_Relation *) /*,
               int (*cset_filter)(OSM_Changeset *) */
         );
+extern int osm_pbf_stream(OSM_File *F, OSM_Stream_Handler *h);
+extern int osm_pbf_xml(OSM_File *F, OSM_Xml_Writer *X);
+extern void osm_node_fields(OSM_Node *n, int fields);
+extern void osm_way_fields(OSM_Way *w, int fields);
+extern void osm_relation_fields(OSM_Relation *r, int fields);
 
 /* pbf-util.c */
 extern void osm_pbf_timestamp(const long int deltatimestamp, char *timestamp);
@@ -138,9 +586,51 @@ extern uint32_t osm_pbf_bh_length(OSM_File *F);
 extern void osm_pbf_free_bh(BlobHeader *bh);
 extern BlobHeader *osm_pbf_get_bh(OSM_File *F, uint32_t len);
 extern void osm_pbf_free_blob(Blob *B, unsigned char *uncompressed);
+extern Blob *osm_pbf_unpack_blob(unsigned char *buffer, uint32_t len, unsigned char **uncompressed);
 extern Blob *osm_pbf_get_blob(OSM_File *F, uint32_t len, unsigned char **uncompressed);
 extern void osm_pbf_free_primitive(PrimitiveBlock *P);
 extern PrimitiveBlock *osm_pbf_unpack_data(Blob *B, unsigned char *uncompressed);
+extern PrimitiveBlock *osm_pbf_unpack_primitive(unsigned char *data, uint32_t len);
+extern int osm_pbf_parse_bh(unsigned char *buffer, uint32_t len, struct osm_pbf_bh *bh);
+extern unsigned char *osm_pbf_inflate(struct osm_inflate *z, unsigned char *blob, uint32_t len, uint32_t *raw_size);
+extern void osm_inflate_free(struct osm_inflate *z);
+extern uint32_t osm_pbf_block_types(unsigned char *data, uint32_t len);
+
+/* pbf-decode.c */
+extern int osm_pbf_field(unsigned char **pos, unsigned char *end, uint64_t *val, unsigned char **data);
+extern int osm_pbf_decode_primitive(OSM_Pbf_Primitive *P, unsigned char *data, uint32_t len);
+extern int osm_pbf_decode_strings(OSM_Pbf_Primitive *P, unsigned char *data, uint32_t len);
+extern int osm_pbf_decode_groups(OSM_Pbf_Primitive *P, unsigned char *data, uint32_t len);
+extern void osm_pbf_primitive_free(OSM_Pbf_Primitive *P);
+extern int osm_pbf_nodes_in_box(OSM_Pbf_Primitive *P, OSM_Pbf_Group *G, OSM_BBox *bbox, uint32_t **rows);
+
+/* pbf-read.c */
+extern int osm_pbf_reader_open(OSM_File *F);
+extern void osm_pbf_reader_close(OSM_File *F);
+extern int osm_buffer_grow(struct osm_buffer *b, uint32_t len);
+extern unsigned char *osm_pbf_read(OSM_File *F, uint32_t len, struct osm_buffer *buf);
+extern void osm_pbf_seek(OSM_File *F, off_t pos);
+extern off_t osm_pbf_tell(OSM_File *F);
+
+/* pbf-run.c */
+extern int osm_pbf_run(OSM_File *F, OSM_Pbf_Handler *h);
+extern void osm_pbf_free_blocks(OSM_File *F);
+
+/* pbf-write.c */
+extern OSM_Pbf_Writer *osm_pbf_write_open(char *who, FILE *outfh, int threads);
+extern int osm_pbf_write_node(OSM_Pbf_Writer *W, OSM_Node *n);
+extern int osm_pbf_write_node_columns(OSM_Pbf_Writer *W, OSM_Node_Columns *C);
+extern int osm_pbf_write_way(OSM_Pbf_Writer *W, OSM_Way *w);
+extern int osm_pbf_write_relation(OSM_Pbf_Writer *W, OSM_Relation *r);
+extern int osm_pbf_write_close(OSM_Pbf_Writer *W);
+
+/* pbf-index.c */
+extern OSM_Pbf_Index *osm_pbf_index_build(OSM_File *F);
+extern int osm_pbf_index_write(OSM_Pbf_Index *I, OSM_File *F, const char *filename);
+extern OSM_Pbf_Index *osm_pbf_index_read(OSM_File *F, const char *filename);
+extern int osm_pbf_index_load(OSM_File *F, const char *pbf_file);
+extern void osm_pbf_index_free(OSM_Pbf_Index *I);
+extern int osm_pbf_index_in_bbox(OSM_Pbf_Index_Entry *e, OSM_BBox *bbox);
 
 /* nodes.c */
 extern int osm_node_pos(OSM_Node_List *n, uint64_t id);
@@ -149,8 +639,10 @@ extern void osm_node_list_sort(OSM_Node_List *n);
 
 /* bbox.c */
 extern OSM_BBox *osm_bbox_from_nodes(OSM_Node_List *n);
+extern OSM_BBox *osm_bbox_from_node_columns(OSM_Node_Columns *C);
 /* open.c */
 extern OSM_File *osm_open(const char *filename, enum OSM_File_Type type);
+extern void osm_close(OSM_File *F);
 /* parse.c */
 extern OSM_Data *osm_parse(OSM_File *F,
               int mode,
@@ -160,29 +652,16 @@ extern OSM_Data *osm_parse(OSM_File *F,
               int (*rel_filter)(OSM_Relation *)/*,
               int (*cset_filter)(OSM_Changeset *) */
         );
+/* stream.c */
+extern int osm_stream(OSM_File *F, OSM_Stream_Handler *h);
 
 /* gpx-write.c */
 extern uint64_t *osm_gpx_write_init(OSM_Data *data, uint32_t *num);
 extern void osm_gpx_write_header(char *who, FILE *outfh);
 extern void osm_gpx_write_footer(FILE *outfh);
 extern void osm_gpx_write_tags(OSM_Tag_List *t, FILE *outfh);
+extern void osm_gpx_write_point(uint64_t id, double lat, double lon, FILE *outfh, int is_trkpt);
 extern void osm_gpx_write_node(OSM_Node *n, FILE *outfh, int is_trkpt);
-extern void osm_gpx_write(OSM_Data *data, FILE *outfh, char *creator);
-
-/* shortcuts */
-#define osm_close(f) { fclose(f->file); free(f); }
-
-#define trim_left(l) { while (*l && (*l == ' ' || *l == '\t')) ++l; }
-
-#define FETCH_TAG(t, n) { \
-        osm_realloc_tag_list(t); \
-        str = osm_xml_fetch_param(line, "k", param); \
-        if (str == NULL) continue; \
-        t->data[ n ].key = strdup(str); \
-        str = osm_xml_fetch_param(line, "v", param); \
-        if (str == NULL) t->data[ n ].val = ""; \
-        else t->data[ n ].val = osm_xml_decode(str); \
-        t->num += 1; \
-    }
+extern int osm_gpx_write(OSM_Data *data, FILE *outfh, char *creator);
 
 #endif /* _OSM_H */
@@ -37,7 +37,8 @@ int main(int argc, char **argv) {
         return 1;
 
     osm_close(F);
-    osm_gpx_write(O, stdout, name);
+    if (osm_gpx_write(O, stdout, name) != 0)
+        return 1;
     return 0;
 }
 
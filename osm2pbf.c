@@ -0,0 +1,78 @@
+/*
+ * osm2pbf.c - convert .osm XML to .osm.pbf
+ *           - example and test for libosm
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "osm.h"
+int debug = 0;
+
+int node2pbf(OSM_Node *n, void *ctx) {
+    return osm_pbf_write_node((OSM_Pbf_Writer *)ctx, n);
+}
+
+int way2pbf(OSM_Way *w, void *ctx) {
+    return osm_pbf_write_way((OSM_Pbf_Writer *)ctx, w);
+}
+
+int rel2pbf(OSM_Relation *r, void *ctx) {
+    return osm_pbf_write_relation((OSM_Pbf_Writer *)ctx, r);
+}
+
+char *name = "osm2pbf";
+
+void usage(void) {
+    fprintf(stderr, "%s: Usage: %s [-d] [-j THREADS] file.osm > file.osm.pbf\n",
+                    name, name);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int c, ret, threads = 1;
+    OSM_Pbf_Writer *W;
+    OSM_Stream_Handler handler = { node2pbf, way2pbf, rel2pbf, NULL, NULL };
+
+    while ((c = getopt(argc, argv, "dj:")) != -1) {
+        switch (c) {
+            case 'd':
+                debug = 1;
+                break;
+            case 'j':
+                threads = atoi(optarg);
+                break;
+            default:
+                usage();
+        }
+    }
+    if (argc == optind)
+        usage();
+
+    char *file = argv[optind];
+
+    osm_init();
+
+    OSM_File *F = osm_open(file, OSM_FTYPE_XML);
+    if (F == NULL)
+        return 1;
+    W = osm_pbf_write_open(name, stdout, threads);
+    if (W == NULL) {
+        osm_close(F);
+        return 1;
+    }
+    handler.ctx = W;
+    ret = osm_stream(F, &handler);
+    osm_close(F);
+    if (osm_pbf_write_close(W) != 0 || ret != 0)
+        return 1;
+    return 0;
+}
+
+/* END */
@@ -0,0 +1,77 @@
+/*
+ * osmpbf-index.c - write the block index FILE.osm.pbf.idx for a .osm.pbf
+ *                - example and test for libosm
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "osm.h"
+int debug = 0;
+
+char *name = "osmpbf-index";
+
+void usage(void) {
+    fprintf(stderr, "%s: Usage: %s [-d] [-j THREADS] [-o FILE.idx] file.osm.pbf\n",
+                    name, name);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int c, threads = 1;
+    char *out = NULL;
+    OSM_Pbf_Index *I;
+    OSM_File *F;
+
+    while ((c = getopt(argc, argv, "dj:o:")) != -1) {
+        switch (c) {
+            case 'd':
+                debug = 1;
+                break;
+            case 'j':
+                threads = atoi(optarg);
+                break;
+            case 'o':
+                out = strdup(optarg);
+                break;
+            default:
+                usage();
+        }
+    }
+    if (argc == optind)
+        usage();
+
+    char *file = argv[optind];
+    if (out == NULL) {
+        out = malloc(strlen(file) + strlen(OSM_PBF_INDEX_SUFFIX) + 1);
+        strcpy(out, file);
+        strcat(out, OSM_PBF_INDEX_SUFFIX);
+    }
+
+    osm_init();
+
+    F = osm_open(file, OSM_FTYPE_PBF);
+    if (F == NULL)
+        return 1;
+    F->threads = threads;
+
+    I = osm_pbf_index_build(F);
+    if (I == NULL || osm_pbf_index_write(I, F, out) != 0) {
+        osm_close(F);
+        return 1;
+    }
+    if (debug)
+        fprintf(stderr, "%s: %u blocks written to %s\n", name, I->num, out);
+    osm_pbf_index_free(I);
+    osm_close(F);
+    free(out);
+    return 0;
+}
+
+/* END */
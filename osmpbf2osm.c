@@ -10,45 +10,58 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
 
 #include "osm.h"
 int debug = 0;
 
-int node2xml(OSM_Node *n) {
-    osm_xml_write_node(n, stdout);
-    return 0;
-}
-
-int way2xml(OSM_Way *w) {
-    osm_xml_write_way(w, stdout);
-    return 0;
-}
+char *name = "osmpbf2osm";
 
-int rel2xml(OSM_Relation *r) {
-    osm_xml_write_relation(r, stdout);
-    return 0;
+void usage(void) {
+    fprintf(stderr, "%s: Usage: %s [-d] [-j THREADS] file.osm.pbf > file.osm\n",
+                    name, name);
+    exit(1);
 }
 
-char *name = "osmpbf2osm";
-
 int main(int argc, char **argv) {
-    if (argc == 1 || argv[1][0] == '-') {
-        fprintf(stderr, "%s: Usage: %s file.osm.pbf > file.osm\n",
-                        name, name);
-        exit(1);
+    int c, ret, threads = 1;
+    OSM_Xml_Writer *X;
+
+    while ((c = getopt(argc, argv, "dj:")) != -1) {
+        switch (c) {
+            case 'd':
+                debug = 1;
+                break;
+            case 'j':
+                threads = atoi(optarg);
+                break;
+            default:
+                usage();
+        }
     }
-        
-    char *file = argv[1];
+    if (argc == optind)
+        usage();
+
+    char *file = argv[optind];
     
     osm_init();
     
     OSM_File *F = osm_open(file, OSM_FTYPE_PBF);
     if (F == NULL)
         return 1;
-    osm_xml_write_header(name, stdout);
-    osm_pbf_parse(F, OSMDATA_DUMP, NULL, node2xml, way2xml, rel2xml);
-    osm_xml_write_footer(stdout);
+    F->threads = threads;
+    X = osm_xml_writer_open(stdout);
+    if (X == NULL) {
+        osm_close(F);
+        return 1;
+    }
+    osm_xml_put_header(X, name);
+    ret = osm_xml_put_file(X, F);
     osm_close(F);
+    if (ret == 0)
+        osm_xml_put_footer(X);
+    if (osm_xml_writer_close(X) != 0 || ret != 0)
+        return 1;
     return 0;
 }
 
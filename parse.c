@@ -19,6 +19,8 @@ OSM_Data *osm_parse(OSM_File *F,
               int (*cset_filter)(OSM_Changeset *) */
         )
 {
+    int flags = mode & (OSMDATA_ARENA|OSMDATA_COLUMNS|OSMDATA_LAZY);
+
     if (mode & OSMDATA_DUMP)
         mode = OSMDATA_DUMP;
     else if (mode & OSMDATA_REL)
@@ -29,6 +31,7 @@ OSM_Data *osm_parse(OSM_File *F,
         mode = OSMDATA_NODE;
     else if (mode & OSMDATA_BBOX)
         mode = OSMDATA_BBOX;
+    mode |= flags;
 
     if (F->type == OSM_FTYPE_PBF)
         return osm_pbf_parse(F, mode, bbox, node_filter, way_filter, rel_filter);
@@ -0,0 +1,968 @@
+/*
+ * pbf-decode.c - PrimitiveBlock decoder for .osm.pbf files
+ *
+ * Walks the protobuf wire format of an uncompressed PrimitiveBlock in
+ * place and fills the columns of an OSM_Pbf_Primitive. Packed fields are
+ * decoded (and delta decoded) straight into the columns, which are kept
+ * and only grown for the next block, so once they have reached their size
+ * decoding a block does not allocate any memory. The generated protobuf-c
+ * code is not used here.
+ *
+ * The packed sint64 delta fields (dense node ids and coordinates, way refs,
+ * relation members) and the varint counting run through kernels picked at
+ * runtime: AVX2 + BMI2 on x86 CPUs which have them, plain C otherwise.
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <math.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define PBF_X86_KERNELS 1
+# include <immintrin.h>
+#endif
+
+#include "osm.h"
+
+enum {
+    PBF_WIRE_VARINT = 0,
+    PBF_WIRE_64BIT  = 1,
+    PBF_WIRE_LENGTH = 2,
+    PBF_WIRE_32BIT  = 5
+};
+
+#define PBF_ZIGZAG(v) ((int64_t)((v) >> 1) ^ -(int64_t)((v) & 1))
+
+static inline unsigned char *pbf_varint(unsigned char *p, unsigned char *end, uint64_t *val) {
+    uint64_t v;
+    int shift;
+
+    if (p < end && !(*p & 0x80)) {
+        *val = *p;
+        return p + 1;
+    }
+    v = 0;
+    for (shift = 0; p < end && shift < 64; shift += 7) {
+        v |= (uint64_t)(*p & 0x7f) << shift;
+        if (!(*p++ & 0x80)) {
+            *val = v;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/*
+   reads the key of the next field and its value: varints in *val, length
+   delimited fields in *data and *val (length). Returns the field number,
+   0 at the end and -1 on error, *wire is the wire type.
+*/
+static inline int pbf_next(unsigned char **pos, unsigned char *end, int *wire,
+                           uint64_t *val, unsigned char **data)
+{
+    unsigned char *p = *pos;
+    uint64_t key;
+
+    if (p >= end)
+        return 0;
+    if ((p = pbf_varint(p, end, &key)) == NULL)
+        return -1;
+
+    *val  = 0;
+    *data = NULL;
+    *wire = key & 0x07;
+    switch (*wire) {
+        case PBF_WIRE_VARINT:
+            p = pbf_varint(p, end, val);
+            break;
+        case PBF_WIRE_64BIT:
+            p = end - p < 8 ? NULL : p + 8;
+            break;
+        case PBF_WIRE_LENGTH:
+            p = pbf_varint(p, end, val);
+            if (p != NULL && *val <= (uint64_t)(end - p)) {
+                *data = p;
+                p += *val;
+            }
+            else
+                p = NULL;
+            break;
+        case PBF_WIRE_32BIT:
+            p = end - p < 4 ? NULL : p + 4;
+            break;
+        default:
+            p = NULL;
+            break;
+    }
+    if (p == NULL)
+        return -1;
+    *pos = p;
+    return key >> 3;
+}
+
+int osm_pbf_field(unsigned char **pos, unsigned char *end, uint64_t *val, unsigned char **data) {
+    int wire;
+    return pbf_next(pos, end, &wire, val, data);
+}
+
+/*
+   packed fields: the number of values is the number of bytes without the
+   continuation bit
+*/
+static uint32_t pbf_count_varints_c(unsigned char *p, unsigned char *end) {
+    uint32_t n = 0;
+    while (p < end)
+        n += !(*p++ & 0x80);
+    return n;
+}
+
+static int pbf_unpack_u32(unsigned char *p, unsigned char *end, uint32_t *out, uint32_t max) {
+    uint32_t n = 0;
+    uint64_t v;
+
+    while (p < end && n < max) {
+        if ((p = pbf_varint(p, end, &v)) == NULL)
+            return -1;
+        out[n++] = v;
+    }
+    return n;
+}
+
+static int pbf_unpack_s64_delta_c(unsigned char *p, unsigned char *end, int64_t *out, uint32_t max) {
+    uint32_t n = 0;
+    int64_t acc = 0;
+    uint64_t v;
+
+    while (p < end && n < max) {
+        if ((p = pbf_varint(p, end, &v)) == NULL)
+            return -1;
+        acc += PBF_ZIGZAG(v);
+        out[n++] = acc;
+    }
+    return n;
+}
+
+#ifdef PBF_X86_KERNELS
+__attribute__((target("avx2,popcnt")))
+static uint32_t pbf_count_varints_avx2(unsigned char *p, unsigned char *end) {
+    uint32_t n = 0;
+
+    while (end - p >= 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i *)p);
+        n += 32 - _mm_popcnt_u32(_mm256_movemask_epi8(bytes));
+        p += 32;
+    }
+    return n + pbf_count_varints_c(p, end);
+}
+
+/*
+   The continuation bits of 32 bytes are fetched with one movemask, the
+   inverted mask has a bit set for the last byte of each varint. A run of
+   32 single byte varints (typical for dense node ids) is decoded without
+   any branch, otherwise each varint of up to 8 bytes is extracted from an
+   unaligned 64 bit load with pext. Zigzag and the delta sum are done in
+   the same pass. The last 40 bytes and longer varints go the scalar way.
+*/
+__attribute__((target("avx2,bmi,bmi2")))
+static int pbf_unpack_s64_delta_avx2(unsigned char *p, unsigned char *end, int64_t *out, uint32_t max) {
+    uint32_t n = 0, stops, off, len, j;
+    int64_t acc = 0;
+    uint64_t word, v;
+
+    while (n < max && end - p >= 40) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i *)p);
+        stops = ~(uint32_t)_mm256_movemask_epi8(bytes);
+
+        if (stops == 0xffffffff && max - n >= 32) {
+            for (j = 0; j < 32; j++) {
+                v = p[j];
+                acc += PBF_ZIGZAG(v);
+                out[n + j] = acc;
+            }
+            n += 32;
+            p += 32;
+            continue;
+        }
+
+        off = 0;
+        while (stops != 0 && n < max) {
+            len = _tzcnt_u32(stops) + 1;
+            if (len > 8)
+                break;
+            memcpy(&word, p + off, 8);
+            v = _pext_u64(word, 0x7f7f7f7f7f7f7f7fULL >> (64 - 8 * len));
+            acc += PBF_ZIGZAG(v);
+            out[n++] = acc;
+            off   += len;
+            stops >>= len;
+        }
+        if (off == 0) {
+            /* more than 8 bytes, or broken */
+            if ((p = pbf_varint(p, end, &v)) == NULL)
+                return -1;
+            acc += PBF_ZIGZAG(v);
+            out[n++] = acc;
+        }
+        else
+            p += off;
+    }
+
+    while (p < end && n < max) {
+        if ((p = pbf_varint(p, end, &v)) == NULL)
+            return -1;
+        acc += PBF_ZIGZAG(v);
+        out[n++] = acc;
+    }
+    return n;
+}
+#endif
+
+/*
+   rows [start, end) with the node inside the box b. Each row is stored,
+   but only counted if it matches, so there is no branch on the outcome.
+*/
+static uint32_t pbf_in_box_c(int64_t *lat, int64_t *lon, uint32_t start, uint32_t end,
+                             struct osm_pbf_box *b, uint32_t *rows)
+{
+    uint32_t k, n = 0;
+
+    for (k = start; k < end; k++) {
+        rows[n] = k;
+        n += (lat[k] >= b->min_lat) & (lat[k] <= b->max_lat)
+           & (lon[k] >= b->min_lon) & (lon[k] <= b->max_lon);
+    }
+    return n;
+}
+
+#ifdef PBF_X86_KERNELS
+/* four nodes per step, the outside test is one or of four compares */
+__attribute__((target("avx2")))
+static uint32_t pbf_in_box_avx2(int64_t *lat, int64_t *lon, uint32_t start, uint32_t end,
+                                struct osm_pbf_box *b, uint32_t *rows)
+{
+    __m256i min_lat = _mm256_set1_epi64x(b->min_lat);
+    __m256i max_lat = _mm256_set1_epi64x(b->max_lat);
+    __m256i min_lon = _mm256_set1_epi64x(b->min_lon);
+    __m256i max_lon = _mm256_set1_epi64x(b->max_lon);
+    uint32_t k, n = 0;
+    int mask;
+
+    for (k = start; end - k >= 4; k += 4) {
+        __m256i la = _mm256_loadu_si256((const __m256i *)(lat + k));
+        __m256i lo = _mm256_loadu_si256((const __m256i *)(lon + k));
+        __m256i out = _mm256_or_si256(
+                        _mm256_or_si256(_mm256_cmpgt_epi64(min_lat, la),
+                                        _mm256_cmpgt_epi64(la, max_lat)),
+                        _mm256_or_si256(_mm256_cmpgt_epi64(min_lon, lo),
+                                        _mm256_cmpgt_epi64(lo, max_lon)));
+        mask = ~_mm256_movemask_pd(_mm256_castsi256_pd(out)) & 0x0f;
+        while (mask) {
+            rows[n++] = k + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    return n + pbf_in_box_c(lat, lon, k, end, b, rows + n);
+}
+#endif
+
+static uint32_t (*pbf_count_varints)(unsigned char *p, unsigned char *end)
+                    = pbf_count_varints_c;
+static int (*pbf_unpack_s64_delta)(unsigned char *p, unsigned char *end, int64_t *out, uint32_t max)
+                    = pbf_unpack_s64_delta_c;
+static uint32_t (*pbf_in_box)(int64_t *lat, int64_t *lon, uint32_t start, uint32_t end,
+                              struct osm_pbf_box *b, uint32_t *rows)
+                    = pbf_in_box_c;
+static pthread_once_t pbf_kernels_once = PTHREAD_ONCE_INIT;
+
+static void pbf_kernels_init(void) {
+#ifdef PBF_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        pbf_in_box = pbf_in_box_avx2;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2")
+        && __builtin_cpu_supports("popcnt"))
+    {
+        pbf_count_varints    = pbf_count_varints_avx2;
+        pbf_unpack_s64_delta = pbf_unpack_s64_delta_avx2;
+    }
+#endif
+    if (debug)
+        fprintf(stderr, "%s:%d:%s(): using %s varint kernels\n",
+                        __FILE__, __LINE__, __FUNCTION__,
+                        pbf_unpack_s64_delta == pbf_unpack_s64_delta_c
+                            ? "scalar" : "AVX2/BMI2");
+}
+
+static int pbf_unpack_s32_delta(unsigned char *p, unsigned char *end, int32_t *out, uint32_t max) {
+    uint32_t n = 0;
+    int32_t acc = 0;
+    uint64_t v;
+
+    while (p < end && n < max) {
+        if ((p = pbf_varint(p, end, &v)) == NULL)
+            return -1;
+        acc += (int32_t)PBF_ZIGZAG(v);
+        out[n++] = acc;
+    }
+    return n;
+}
+
+/* grows all columns of E to hold at least n entities */
+static int pbf_entities_reserve(OSM_Pbf_Entities *E, uint32_t n) {
+    uint32_t size = E->size ? E->size : 1024;
+
+    if (n <= E->size)
+        return 0;
+    while (size < n)
+        size *= 2;
+
+#define PBF_GROW_COL(col) { \
+        void *tmp = realloc(E->col, sizeof(*E->col) * size); \
+        if (tmp == NULL) \
+            goto fail; \
+        E->col = tmp; \
+    }
+    PBF_GROW_COL(id);
+    PBF_GROW_COL(lat);
+    PBF_GROW_COL(lon);
+    PBF_GROW_COL(tag_start);
+    PBF_GROW_COL(num_tags);
+    PBF_GROW_COL(ref_start);
+    PBF_GROW_COL(num_refs);
+    PBF_GROW_COL(version);
+    PBF_GROW_COL(timestamp);
+    PBF_GROW_COL(changeset);
+    PBF_GROW_COL(uid);
+    PBF_GROW_COL(user_sid);
+#undef PBF_GROW_COL
+    E->size = size;
+    return 0;
+
+  fail:
+    fprintf(stderr, "failed to grow block columns to %u: %s\n", size, strerror(errno));
+    return -1;
+}
+
+static int pbf_tags_reserve(OSM_Pbf_Primitive *P, uint32_t n) {
+    uint32_t size = P->size_tags ? P->size_tags : 4096;
+    uint32_t *keys, *vals;
+
+    if (n <= P->size_tags)
+        return 0;
+    while (size < n)
+        size *= 2;
+    keys = realloc(P->keys, sizeof(uint32_t) * size);
+    if (keys != NULL)
+        P->keys = keys;
+    vals = realloc(P->vals, sizeof(uint32_t) * size);
+    if (vals != NULL)
+        P->vals = vals;
+    if (keys == NULL || vals == NULL) {
+        fprintf(stderr, "failed to grow tag columns to %u: %s\n", size, strerror(errno));
+        return -1;
+    }
+    P->size_tags = size;
+    return 0;
+}
+
+static int pbf_refs_reserve(OSM_Pbf_Primitive *P, uint32_t n) {
+    uint32_t size = P->size_refs ? P->size_refs : 16384;
+    int64_t *refs;
+    int32_t *roles, *types;
+
+    if (n <= P->size_refs)
+        return 0;
+    while (size < n)
+        size *= 2;
+    refs = realloc(P->refs, sizeof(int64_t) * size);
+    if (refs != NULL)
+        P->refs = refs;
+    roles = realloc(P->roles, sizeof(int32_t) * size);
+    if (roles != NULL)
+        P->roles = roles;
+    types = realloc(P->types, sizeof(int32_t) * size);
+    if (types != NULL)
+        P->types = types;
+    if (refs == NULL || roles == NULL || types == NULL) {
+        fprintf(stderr, "failed to grow ref columns to %u: %s\n", size, strerror(errno));
+        return -1;
+    }
+    P->size_refs = size;
+    return 0;
+}
+
+/* appends n entities with empty tags, refs and metadata at the end of E */
+static int pbf_entities_add(OSM_Pbf_Primitive *P, OSM_Pbf_Entities *E, uint32_t n) {
+    uint32_t i;
+
+    if (pbf_entities_reserve(E, E->num + n) != 0)
+        return -1;
+    for (i = E->num; i < E->num + n; i++) {
+        E->id[i]        = 0;
+        E->lat[i]       = 0;
+        E->lon[i]       = 0;
+        E->tag_start[i] = P->num_tags;
+        E->num_tags[i]  = 0;
+        E->ref_start[i] = P->num_refs;
+        E->num_refs[i]  = 0;
+        E->version[i]   = 0;
+        E->timestamp[i] = 0;
+        E->changeset[i] = 0;
+        E->uid[i]       = 0;
+        E->user_sid[i]  = -1;
+    }
+    E->num += n;
+    return 0;
+}
+
+/*
+   the repeated fields of osmformat.proto are all declared packed, an
+   unpacked one is rejected
+*/
+#define PBF_CHECK_PACKED(wire) \
+    if ((wire) != PBF_WIRE_LENGTH) { \
+        fprintf(stderr, "unpacked repeated field in PrimitiveBlock\n"); \
+        return -1; \
+    }
+
+/* keys (field 2) or vals (field 3) of a Node, Way or Relation */
+static int pbf_decode_tags(OSM_Pbf_Primitive *P, OSM_Pbf_Entities *E, uint32_t i,
+                           int field, int wire, uint64_t val, unsigned char *data)
+{
+    uint32_t n;
+    int ret;
+
+    PBF_CHECK_PACKED(wire);
+    n = pbf_count_varints(data, data + val);
+    if (pbf_tags_reserve(P, E->tag_start[i] + n) != 0)
+        return -1;
+    ret = pbf_unpack_u32(data, data + val,
+                         (field == 2 ? P->keys : P->vals) + E->tag_start[i], n);
+    if (ret < 0)
+        return -1;
+    if (E->num_tags[i] != 0 && ret != E->num_tags[i]) {
+        fprintf(stderr, "number of keys and vals differ\n");
+        return -1;
+    }
+    E->num_tags[i] = ret;
+    P->num_tags = E->tag_start[i] + E->num_tags[i];
+    return 0;
+}
+
+/* Info message of a Node, Way or Relation */
+static int pbf_decode_info(OSM_Pbf_Entities *E, uint32_t i, unsigned char *pos, unsigned char *end) {
+    unsigned char *data;
+    uint64_t val;
+    int field, wire;
+
+    while ((field = pbf_next(&pos, end, &wire, &val, &data)) > 0) {
+        if (wire != PBF_WIRE_VARINT)
+            continue;
+        switch (field) {
+            case 1: E->version[i]   = (int32_t)val;  break;
+            case 2: E->timestamp[i] = (int64_t)val;  break;
+            case 3: E->changeset[i] = (int64_t)val;  break;
+            case 4: E->uid[i]       = (int32_t)val;  break;
+            case 5: E->user_sid[i]  = (int32_t)val;  break;
+        }
+    }
+    return field;
+}
+
+static int pbf_decode_node(OSM_Pbf_Primitive *P, unsigned char *pos, unsigned char *end) {
+    OSM_Pbf_Entities *E = &P->nodes;
+    unsigned char *data;
+    uint64_t val;
+    uint32_t i = E->num;
+    int field, wire;
+
+    if (pbf_entities_add(P, E, 1) != 0)
+        return -1;
+    while ((field = pbf_next(&pos, end, &wire, &val, &data)) > 0) {
+        switch (field) {
+            case 1:
+                E->id[i] = PBF_ZIGZAG(val);
+                break;
+            case 2:
+            case 3:
+                if (pbf_decode_tags(P, E, i, field, wire, val, data) != 0)
+                    return -1;
+                break;
+            case 4:
+                if (wire == PBF_WIRE_LENGTH
+                    && pbf_decode_info(E, i, data, data + val) < 0)
+                    return -1;
+                break;
+            case 8:
+                E->lat[i] = PBF_ZIGZAG(val);
+                break;
+            case 9:
+                E->lon[i] = PBF_ZIGZAG(val);
+                break;
+        }
+    }
+    return field;
+}
+
+static int pbf_decode_denseinfo(OSM_Pbf_Entities *E, uint32_t base, uint32_t num,
+                                unsigned char *pos, unsigned char *end)
+{
+    unsigned char *data, *stop;
+    uint64_t val;
+    int field, wire, ret = 0;
+
+    while ((field = pbf_next(&pos, end, &wire, &val, &data)) > 0) {
+        if (field > 5)  /* visible */
+            continue;
+        PBF_CHECK_PACKED(wire);
+        stop = data + val;
+        switch (field) {
+            case 1:
+                ret = pbf_unpack_u32(data, stop, (uint32_t *)E->version + base, num);
+                break;
+            case 2:
+                ret = pbf_unpack_s64_delta(data, stop, E->timestamp + base, num);
+                break;
+            case 3:
+                ret = pbf_unpack_s64_delta(data, stop, E->changeset + base, num);
+                break;
+            case 4:
+                ret = pbf_unpack_s32_delta(data, stop, E->uid + base, num);
+                break;
+            case 5:
+                ret = pbf_unpack_s32_delta(data, stop, E->user_sid + base, num);
+                break;
+        }
+        if (ret < 0)
+            return -1;
+    }
+    return field;
+}
+
+static int pbf_decode_dense(OSM_Pbf_Primitive *P, unsigned char *pos, unsigned char *end) {
+    OSM_Pbf_Entities *E = &P->nodes;
+    unsigned char *data, *f[11] = { NULL }, *f_end[11] = { NULL };
+    uint32_t base = E->num, num, i;
+    uint64_t val, k, v;
+    int field, wire;
+
+    /* collect id (1), denseinfo (5), lat (8), lon (9) and keys_vals (10) */
+    while ((field = pbf_next(&pos, end, &wire, &val, &data)) > 0) {
+        if (field == 1 || field == 5 || field == 8 || field == 9 || field == 10) {
+            PBF_CHECK_PACKED(wire);
+            f[field]     = data;
+            f_end[field] = data + val;
+        }
+    }
+    if (field < 0 || f[1] == NULL)
+        return -1;
+
+    num = pbf_count_varints(f[1], f_end[1]);
+    if (pbf_entities_add(P, E, num) != 0)
+        return -1;
+    if (pbf_unpack_s64_delta(f[1], f_end[1], E->id + base, num) < 0
+        || (f[8] && pbf_unpack_s64_delta(f[8], f_end[8], E->lat + base, num) < 0)
+        || (f[9] && pbf_unpack_s64_delta(f[9], f_end[9], E->lon + base, num) < 0)
+        || (f[5] && pbf_decode_denseinfo(E, base, num, f[5], f_end[5]) < 0))
+        return -1;
+
+    /* keys_vals: k v k v ... 0 for each node */
+    if (f[10] != NULL) {
+        unsigned char *kv = f[10], *kv_end = f_end[10];
+        if (pbf_tags_reserve(P, P->num_tags + pbf_count_varints(kv, kv_end) / 2) != 0)
+            return -1;
+        i = 0;
+        E->tag_start[base] = P->num_tags;
+        while (kv < kv_end && i < num) {
+            if ((kv = pbf_varint(kv, kv_end, &k)) == NULL)
+                return -1;
+            if (k == 0) {
+                if (++i < num)
+                    E->tag_start[base + i] = P->num_tags;
+                continue;
+            }
+            if ((kv = pbf_varint(kv, kv_end, &v)) == NULL)
+                return -1;
+            P->keys[P->num_tags] = k;
+            P->vals[P->num_tags] = v;
+            P->num_tags += 1;
+            E->num_tags[base + i] += 1;
+        }
+        for (i += 1; i < num; i++)
+            E->tag_start[base + i] = P->num_tags;
+    }
+    return 0;
+}
+
+/*
+   refs of a Way (field 8), roles_sid (8), memids (9) and types (10) of a
+   Relation. The member fields of a relation share the same rows in refs.
+   A field which is missing or shorter than the others leaves its column
+   zero in the rows of the longest one.
+*/
+static int pbf_decode_refs(OSM_Pbf_Primitive *P, OSM_Pbf_Entities *E, uint32_t i,
+                           int is_rel, int field, int wire, uint64_t val, unsigned char *data)
+{
+    unsigned char *end = data + val;
+    uint32_t n, start = E->ref_start[i], old = E->num_refs[i];
+    int ret;
+
+    PBF_CHECK_PACKED(wire);
+    n = pbf_count_varints(data, end);
+    if (pbf_refs_reserve(P, start + n) != 0)
+        return -1;
+    if (n > old) {
+        memset(P->refs  + start + old, 0, sizeof(int64_t) * (n - old));
+        memset(P->roles + start + old, 0, sizeof(int32_t) * (n - old));
+        memset(P->types + start + old, 0, sizeof(int32_t) * (n - old));
+    }
+    if (!is_rel || field == 9)
+        ret = pbf_unpack_s64_delta(data, end, P->refs + start, n);
+    else
+        ret = pbf_unpack_u32(data, end,
+                        (uint32_t *)(field == 8 ? P->roles : P->types) + start, n);
+    if (ret < 0)
+        return -1;
+    if (ret > E->num_refs[i])
+        E->num_refs[i] = ret;
+    P->num_refs = start + E->num_refs[i];
+    return 0;
+}
+
+static int pbf_decode_way_or_rel(OSM_Pbf_Primitive *P, OSM_Pbf_Entities *E, int is_rel,
+                                 unsigned char *pos, unsigned char *end)
+{
+    unsigned char *data;
+    uint64_t val;
+    uint32_t i = E->num;
+    int field, wire, ret;
+
+    if (pbf_entities_add(P, E, 1) != 0)
+        return -1;
+    while ((field = pbf_next(&pos, end, &wire, &val, &data)) > 0) {
+        ret = 0;
+        switch (field) {
+            case 1:
+                E->id[i] = (int64_t)val;
+                break;
+            case 2:
+            case 3:
+                ret = pbf_decode_tags(P, E, i, field, wire, val, data);
+                break;
+            case 4:
+                if (wire == PBF_WIRE_LENGTH)
+                    ret = pbf_decode_info(E, i, data, data + val);
+                break;
+            case 8:
+            case 9:
+            case 10:
+                if (is_rel || field == 8)
+                    ret = pbf_decode_refs(P, E, i, is_rel, field, wire, val, data);
+                break;
+        }
+        if (ret < 0)
+            return -1;
+    }
+    return field;
+}
+
+static int pbf_decode_group(OSM_Pbf_Primitive *P, unsigned char *pos, unsigned char *end) {
+    OSM_Pbf_Group *G;
+    OSM_Pbf_Entities *E = NULL;
+    unsigned char *data;
+    uint64_t val;
+    int field, wire, ret;
+
+    if (P->num_groups == P->size_groups) {
+        uint32_t size = P->size_groups ? P->size_groups * 2 : 16;
+        OSM_Pbf_Group *tmp = realloc(P->groups, sizeof(OSM_Pbf_Group) * size);
+        if (tmp == NULL) {
+            fprintf(stderr, "failed to grow group list: %s\n", strerror(errno));
+            return -1;
+        }
+        P->groups      = tmp;
+        P->size_groups = size;
+    }
+    G = &P->groups[P->num_groups];
+    G->type = 0;
+
+    while ((field = pbf_next(&pos, end, &wire, &val, &data)) > 0) {
+        if (wire != PBF_WIRE_LENGTH)
+            continue;
+        ret = 0;
+        switch (field) {
+            case 1: /* nodes */
+            case 2: /* dense */
+                if (E == NULL) {
+                    G->type  = OSMDATA_NODE;
+                    E        = &P->nodes;
+                    G->start = E->num;
+                }
+                if (field == 1)
+                    ret = pbf_decode_node(P, data, data + val);
+                else
+                    ret = pbf_decode_dense(P, data, data + val);
+                break;
+            case 3: /* ways */
+            case 4: /* relations */
+                if (E == NULL) {
+                    G->type  = field == 3 ? OSMDATA_WAY : OSMDATA_REL;
+                    E        = field == 3 ? &P->ways : &P->relations;
+                    G->start = E->num;
+                }
+                if ((field == 3 && G->type != OSMDATA_WAY)
+                    || (field == 4 && G->type != OSMDATA_REL))
+                {
+                    fprintf(stderr, "PrimitiveGroup with mixed entity types\n");
+                    return -1;
+                }
+                ret = pbf_decode_way_or_rel(P, E, field == 4, data, data + val);
+                break;
+            default: /* changesets */
+                break;
+        }
+        if (ret < 0)
+            return -1;
+    }
+    if (field < 0)
+        return -1;
+    if (E != NULL) {
+        G->end = E->num;
+        P->num_groups += 1;
+    }
+    return 0;
+}
+
+static int pbf_decode_strings(OSM_Pbf_Primitive *P, unsigned char *pos, unsigned char *end) {
+    unsigned char *data;
+    uint64_t val;
+    int field, wire;
+
+    while ((field = pbf_next(&pos, end, &wire, &val, &data)) > 0) {
+        if (field != 1 || wire != PBF_WIRE_LENGTH)
+            continue;
+        if (P->num_strings == P->size_strings) {
+            uint32_t size = P->size_strings ? P->size_strings * 2 : 4096;
+            struct osm_pbf_string *tmp =
+                realloc(P->strings, sizeof(struct osm_pbf_string) * size);
+            if (tmp == NULL) {
+                fprintf(stderr, "failed to grow string table: %s\n", strerror(errno));
+                return -1;
+            }
+            P->strings      = tmp;
+            P->size_strings = size;
+        }
+        P->strings[P->num_strings].data = (const char *)data;
+        P->strings[P->num_strings].len  = val;
+        P->num_strings += 1;
+    }
+    return field;
+}
+
+/*
+   first step of osm_pbf_decode_primitive(): drops the previous content of
+   P and decodes only the string table of the uncompressed PrimitiveBlock
+   in data. The strings are not terminated yet, see the len of each. This
+   is enough to tell if a block can match a filter at all, see
+   osm_filter_pbf_may_match(). Returns 0 on success and -1 on error.
+*/
+int osm_pbf_decode_strings(OSM_Pbf_Primitive *P, unsigned char *data, uint32_t len) {
+    unsigned char *pos = data, *end = data + len, *sub;
+    uint64_t val;
+    int field, wire, ret = 0;
+
+    P->num_strings      = 0;
+    P->num_groups       = 0;
+    P->num_tags         = 0;
+    P->num_refs         = 0;
+    P->nodes.num        = 0;
+    P->ways.num         = 0;
+    P->relations.num    = 0;
+
+    while ((field = pbf_next(&pos, end, &wire, &val, &sub)) > 0) {
+        if (field == 1 && wire == PBF_WIRE_LENGTH) {
+            ret = pbf_decode_strings(P, sub, sub + val);
+            if (ret < 0)
+                break;
+        }
+    }
+    if (field < 0 || ret < 0) {
+        fprintf(stderr, "Error decoding PrimitiveBlock message\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+   second step: decodes the rest of the block into P after
+   osm_pbf_decode_strings(). data must be writable and have one spare byte
+   behind len (as returned by osm_pbf_inflate()): the strings of the string
+   table are terminated in place, after everything else has been decoded.
+*/
+int osm_pbf_decode_groups(OSM_Pbf_Primitive *P, unsigned char *data, uint32_t len) {
+    unsigned char *pos = data, *end = data + len, *sub;
+    uint64_t val;
+    uint32_t i;
+    int field, wire, ret = 0;
+
+    pthread_once(&pbf_kernels_once, pbf_kernels_init);
+
+    P->granularity      = 100;
+    P->date_granularity = 1000;
+    P->lat_offset       = 0;
+    P->lon_offset       = 0;
+
+    while ((field = pbf_next(&pos, end, &wire, &val, &sub)) > 0) {
+        ret = 0;
+        switch (field) {
+            case 2: /* primitivegroup */
+                if (wire == PBF_WIRE_LENGTH)
+                    ret = pbf_decode_group(P, sub, sub + val);
+                break;
+            case 17:
+                P->granularity = (int32_t)val;
+                break;
+            case 18:
+                P->date_granularity = (int32_t)val;
+                break;
+            case 19:
+                P->lat_offset = (int64_t)val;
+                break;
+            case 20:
+                P->lon_offset = (int64_t)val;
+                break;
+        }
+        if (ret < 0)
+            break;
+    }
+    if (field < 0 || ret < 0) {
+        fprintf(stderr, "Error decoding PrimitiveBlock message\n");
+        return -1;
+    }
+
+    /* the byte behind a string is the key of the next field, not needed anymore */
+    for (i = 0; i < P->num_strings; i++)
+        ((char *)P->strings[i].data)[P->strings[i].len] = '\0';
+    return 0;
+}
+
+/*
+   decodes the uncompressed PrimitiveBlock in data into P, the previous
+   content of P is dropped. Returns 0 on success and -1 on error.
+*/
+int osm_pbf_decode_primitive(OSM_Pbf_Primitive *P, unsigned char *data, uint32_t len) {
+    if (osm_pbf_decode_strings(P, data, len) != 0)
+        return -1;
+    return osm_pbf_decode_groups(P, data, len);
+}
+
+/*
+   the smallest (or largest) v with offset + v * granularity inside the
+   bound, i.e. the same double expression the nodes are converted with.
+   The estimate is off by at most one step, which is fixed up.
+*/
+static int64_t pbf_box_min(double offset, double granularity, double min) {
+    int64_t v = (int64_t)ceil((min - offset) / granularity);
+
+    while (offset + ((v - 1) * granularity) >= min)
+        --v;
+    while (offset + (v * granularity) < min)
+        ++v;
+    return v;
+}
+
+static int64_t pbf_box_max(double offset, double granularity, double max) {
+    int64_t v = (int64_t)floor((max - offset) / granularity);
+
+    while (offset + ((v + 1) * granularity) <= max)
+        ++v;
+    while (offset + (v * granularity) > max)
+        --v;
+    return v;
+}
+
+/*
+   osm_pbf_nodes_in_box(): the rows of the nodes of group G inside bbox,
+   returns their number and the rows in *rows (valid until the next call
+   for P), -1 on error. The bbox is converted to the integer coordinates
+   of the block once, the nodes are tested without converting them.
+*/
+int osm_pbf_nodes_in_box(OSM_Pbf_Primitive *P, OSM_Pbf_Group *G, OSM_BBox *bbox, uint32_t **rows) {
+    double lat_offset  = NANO_DEGREE * P->lat_offset;
+    double lon_offset  = NANO_DEGREE * P->lon_offset;
+    double granularity = NANO_DEGREE * P->granularity;
+    struct osm_pbf_box b;
+    uint32_t n = G->end - G->start;
+
+    if (n > P->size_rows) {
+        uint32_t size = P->size_rows ? P->size_rows : 8000;
+        uint32_t *tmp;
+
+        while (size < n)
+            size *= 2;
+        tmp = realloc(P->rows, sizeof(uint32_t) * size);
+        if (tmp == NULL) {
+            fprintf(stderr, "failed to grow row list to %u: %s\n", size, strerror(errno));
+            return -1;
+        }
+        P->rows      = tmp;
+        P->size_rows = size;
+    }
+    *rows = P->rows;
+    if (n == 0 || bbox->bottom_lat > bbox->top_lat || bbox->left_lon > bbox->right_lon)
+        return 0;
+
+    if (P->granularity <= 0) {
+        fprintf(stderr, "invalid granularity %d\n", P->granularity);
+        return -1;
+    }
+
+    b.min_lat = pbf_box_min(lat_offset, granularity, bbox->bottom_lat);
+    b.max_lat = pbf_box_max(lat_offset, granularity, bbox->top_lat);
+    b.min_lon = pbf_box_min(lon_offset, granularity, bbox->left_lon);
+    b.max_lon = pbf_box_max(lon_offset, granularity, bbox->right_lon);
+
+    pthread_once(&pbf_kernels_once, pbf_kernels_init);
+    return pbf_in_box(P->nodes.lat, P->nodes.lon, G->start, G->end, &b, P->rows);
+}
+
+static void pbf_entities_free(OSM_Pbf_Entities *E) {
+    free(E->id);
+    free(E->lat);
+    free(E->lon);
+    free(E->tag_start);
+    free(E->num_tags);
+    free(E->ref_start);
+    free(E->num_refs);
+    free(E->version);
+    free(E->timestamp);
+    free(E->changeset);
+    free(E->uid);
+    free(E->user_sid);
+    memset(E, 0, sizeof(OSM_Pbf_Entities));
+}
+
+void osm_pbf_primitive_free(OSM_Pbf_Primitive *P) {
+    free(P->strings);
+    free(P->groups);
+    pbf_entities_free(&P->nodes);
+    pbf_entities_free(&P->ways);
+    pbf_entities_free(&P->relations);
+    free(P->keys);
+    free(P->vals);
+    free(P->refs);
+    free(P->roles);
+    free(P->types);
+    free(P->rows);
+    free(P->fstrings);
+    memset(P, 0, sizeof(OSM_Pbf_Primitive));
+}
+
+/* END */
@@ -0,0 +1,280 @@
+/*
+ * pbf-index.c - sidecar block index for .osm.pbf files
+ *
+ * For every OSMData block the index records the file offset, the entity
+ * types in the block, the id range and the bbox of the nodes. It is kept
+ * in FILE.osm.pbf.idx and loaded by osm_open() if the file size and
+ * mtime still match the .osm.pbf. osm_pbf_run() then seeks directly to
+ * the blocks the handler wants instead of reading the whole file.
+ *
+ * The index is written in the native byte order, an index with another
+ * byte order is ignored like an outdated one.
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <sys/stat.h>
+
+#include "osm.h"
+
+#define PBF_INDEX_MAGIC "OSMPBFI1"
+#define PBF_INDEX_BYTE_ORDER 0x01020304
+
+struct pbf_index_header {
+    char     magic[8];
+    uint32_t byte_order;
+    uint32_t num;
+    uint64_t file_size;
+    int64_t  file_mtime;
+};
+
+static void pbf_index_id(OSM_Pbf_Index_Entry *e, uint64_t id) {
+    if (e->num == 0 || id < e->min_id)
+        e->min_id = id;
+    if (e->num == 0 || id > e->max_id)
+        e->max_id = id;
+    e->num += 1;
+}
+
+/* lat/lon in nano degrees, rounded outwards to 1e-7 degrees */
+static void pbf_index_pos(OSM_Pbf_Index_Entry *e, int64_t lat, int64_t lon) {
+    int32_t lat_lo = floor(lat / 100.0), lat_hi = ceil(lat / 100.0);
+    int32_t lon_lo = floor(lon / 100.0), lon_hi = ceil(lon / 100.0);
+
+    if (!(e->types & OSMDATA_NODE)) {
+        e->bottom = lat_lo;
+        e->top    = lat_hi;
+        e->left   = lon_lo;
+        e->right  = lon_hi;
+        e->types |= OSMDATA_NODE;
+        return;
+    }
+    if (lat_lo < e->bottom) e->bottom = lat_lo;
+    if (lat_hi > e->top)    e->top    = lat_hi;
+    if (lon_lo < e->left)   e->left   = lon_lo;
+    if (lon_hi > e->right)  e->right  = lon_hi;
+}
+
+static int pbf_index_decode(OSM_Pbf_Block *b, void *ctx) {
+    OSM_Pbf_Index_Entry *e = b->data;
+    unsigned char *uncompressed;
+    uint32_t raw_size;
+    OSM_Pbf_Primitive *P;
+    uint32_t k;
+
+    if (e == NULL) {
+        e = malloc(sizeof(OSM_Pbf_Index_Entry));
+        if (e == NULL) {
+            fprintf(stderr, "failed to malloc index entry: %s\n", strerror(errno));
+            return -1;
+        }
+        b->data = e;
+    }
+    memset(e, 0, sizeof(OSM_Pbf_Index_Entry));
+    e->offset = b->offset;
+    /* empty bbox until the first node */
+    e->bottom = e->left = 1;
+    e->top = e->right = 0;
+
+    uncompressed = osm_pbf_inflate(&b->inflate, b->blob, b->blob_len, &raw_size);
+    if (uncompressed == NULL)
+        return -1;
+    P = &b->primitive;
+    if (osm_pbf_decode_primitive(P, uncompressed, raw_size) != 0)
+        return -1;
+
+    for (k = 0; k < P->nodes.num; k++) {
+        pbf_index_id(e, P->nodes.id[k]);
+        pbf_index_pos(e, P->lat_offset + P->nodes.lat[k] * P->granularity,
+                         P->lon_offset + P->nodes.lon[k] * P->granularity);
+    }
+    for (k = 0; k < P->ways.num; k++)
+        pbf_index_id(e, P->ways.id[k]);
+    if (P->ways.num)
+        e->types |= OSMDATA_WAY;
+    for (k = 0; k < P->relations.num; k++)
+        pbf_index_id(e, P->relations.id[k]);
+    if (P->relations.num)
+        e->types |= OSMDATA_REL;
+    return 0;
+}
+
+static int pbf_index_apply(OSM_Pbf_Block *b, void *ctx) {
+    OSM_Pbf_Index *I = ctx;
+    OSM_Pbf_Index_Entry *tmp;
+
+    if ((float)I->num/(float)I->size > LIST_THRESHOLD) {
+        tmp = realloc(I->data, sizeof(OSM_Pbf_Index_Entry) * I->size * 2);
+        if (tmp == NULL) {
+            fprintf(stderr, "failed to realloc index: %s\n", strerror(errno));
+            return -1;
+        }
+        I->data  = tmp;
+        I->size *= 2;
+    }
+    I->data[I->num] = *(OSM_Pbf_Index_Entry *)b->data;
+    I->num += 1;
+    return 0;
+}
+
+OSM_Pbf_Index *osm_pbf_index_build(OSM_File *F) {
+    OSM_Pbf_Handler handler;
+    OSM_Pbf_Index *I;
+
+    I = malloc(sizeof(OSM_Pbf_Index));
+    if (I == NULL) {
+        fprintf(stderr, "failed to malloc index: %s\n", strerror(errno));
+        return (OSM_Pbf_Index *)NULL;
+    }
+    I->num  = 0;
+    I->size = 1024;
+    I->data = malloc(sizeof(OSM_Pbf_Index_Entry) * I->size);
+    if (I->data == NULL) {
+        fprintf(stderr, "failed to malloc index: %s\n", strerror(errno));
+        free(I);
+        return (OSM_Pbf_Index *)NULL;
+    }
+
+    handler.decode    = pbf_index_decode;
+    handler.apply     = pbf_index_apply;
+    handler.free_data = free;
+    handler.want      = NULL;
+    handler.ctx       = I;
+
+    if (osm_pbf_run(F, &handler) != 0) {
+        osm_pbf_index_free(I);
+        return (OSM_Pbf_Index *)NULL;
+    }
+    if (debug)
+        fprintf(stderr, "%s:%d:%s(): %u blocks indexed\n",
+                        __FILE__, __LINE__, __FUNCTION__, I->num);
+    return I;
+}
+
+int osm_pbf_index_write(OSM_Pbf_Index *I, OSM_File *F, const char *filename) {
+    struct pbf_index_header hdr;
+    struct stat st;
+    FILE *out;
+
+    if (fstat(F->fd, &st) != 0) {
+        fprintf(stderr, "failed to stat file: %s\n", strerror(errno));
+        return -1;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, PBF_INDEX_MAGIC, 8);
+    hdr.byte_order = PBF_INDEX_BYTE_ORDER;
+    hdr.num        = I->num;
+    hdr.file_size  = st.st_size;
+    hdr.file_mtime = st.st_mtime;
+
+    out = fopen(filename, "w");
+    if (out == NULL) {
+        fprintf(stderr, "failed to open %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    if (fwrite(&hdr, sizeof(hdr), 1, out) != 1
+        || fwrite(I->data, sizeof(OSM_Pbf_Index_Entry), I->num, out) != I->num)
+    {
+        fprintf(stderr, "failed to write %s: %s\n", filename, strerror(errno));
+        fclose(out);
+        return -1;
+    }
+    if (fclose(out) != 0) {
+        fprintf(stderr, "failed to write %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* returns NULL if there's no index or it doesn't belong to F */
+OSM_Pbf_Index *osm_pbf_index_read(OSM_File *F, const char *filename) {
+    struct pbf_index_header hdr;
+    struct stat st;
+    OSM_Pbf_Index *I;
+    FILE *in;
+
+    in = fopen(filename, "r");
+    if (in == NULL)
+        return (OSM_Pbf_Index *)NULL;
+
+    if (fread(&hdr, sizeof(hdr), 1, in) != 1
+        || memcmp(hdr.magic, PBF_INDEX_MAGIC, 8) != 0
+        || hdr.byte_order != PBF_INDEX_BYTE_ORDER)
+    {
+        fprintf(stderr, "%s is not a block index, ignored\n", filename);
+        fclose(in);
+        return (OSM_Pbf_Index *)NULL;
+    }
+    if (fstat(F->fd, &st) != 0
+        || hdr.file_size  != st.st_size
+        || hdr.file_mtime != st.st_mtime)
+    {
+        fprintf(stderr, "block index %s is outdated, ignored\n", filename);
+        fclose(in);
+        return (OSM_Pbf_Index *)NULL;
+    }
+
+    I = malloc(sizeof(OSM_Pbf_Index));
+    if (I == NULL) {
+        fprintf(stderr, "failed to malloc index: %s\n", strerror(errno));
+        fclose(in);
+        return (OSM_Pbf_Index *)NULL;
+    }
+    I->num  = hdr.num;
+    I->size = hdr.num ? hdr.num : 1;
+    I->data = malloc(sizeof(OSM_Pbf_Index_Entry) * I->size);
+    if (I->data == NULL
+        || fread(I->data, sizeof(OSM_Pbf_Index_Entry), I->num, in) != I->num)
+    {
+        fprintf(stderr, "failed to read block index %s\n", filename);
+        osm_pbf_index_free(I);
+        fclose(in);
+        return (OSM_Pbf_Index *)NULL;
+    }
+    fclose(in);
+    return I;
+}
+
+/* loads pbf_file + OSM_PBF_INDEX_SUFFIX if present, 1 if an index is used */
+int osm_pbf_index_load(OSM_File *F, const char *pbf_file) {
+    char *filename;
+
+    filename = malloc(strlen(pbf_file) + strlen(OSM_PBF_INDEX_SUFFIX) + 1);
+    if (filename == NULL)
+        return 0;
+    strcpy(filename, pbf_file);
+    strcat(filename, OSM_PBF_INDEX_SUFFIX);
+
+    F->index = osm_pbf_index_read(F, filename);
+    if (debug && F->index != NULL)
+        fprintf(stderr, "%s:%d:%s(): using block index %s, %u blocks\n",
+                        __FILE__, __LINE__, __FUNCTION__, filename, F->index->num);
+    free(filename);
+    return F->index != NULL;
+}
+
+void osm_pbf_index_free(OSM_Pbf_Index *I) {
+    if (I == NULL)
+        return;
+    free(I->data);
+    free(I);
+}
+
+/* the block bbox is widened by one unit to be safe from rounding errors */
+int osm_pbf_index_in_bbox(OSM_Pbf_Index_Entry *e, OSM_BBox *bbox) {
+    if (!(e->types & OSMDATA_NODE))
+        return 0;
+    return (e->bottom - 1) * 1e-7 <= bbox->top_lat
+        && (e->top + 1)    * 1e-7 >= bbox->bottom_lat
+        && (e->left - 1)   * 1e-7 <= bbox->right_lon
+        && (e->right + 1)  * 1e-7 >= bbox->left_lon;
+}
+
+/* END */
@@ -0,0 +1,129 @@
+/*
+ * pbf-read.c - block reader for .osm.pbf files
+ *
+ * The file is mmap()ed if possible, otherwise the frames are pread() into
+ * a buffer which is reused for the next frame. Either way the caller gets
+ * a pointer to the complete frame, no byte is copied around one by one.
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "osm.h"
+
+int osm_pbf_reader_open(OSM_File *F) {
+    struct stat st;
+
+    F->fd     = fileno(F->file);
+    F->map    = NULL;
+    F->pos    = 0;
+    F->buf.size = 0;
+    F->buf.data = NULL;
+    F->blocks     = NULL;
+    F->num_blocks = 0;
+
+    if (fstat(F->fd, &st) != 0) {
+        fprintf(stderr, "failed to stat file: %s\n", strerror(errno));
+        return -1;
+    }
+    F->size = st.st_size;
+
+    if (F->size > 0) {
+        F->map = mmap(NULL, F->size, PROT_READ, MAP_PRIVATE, F->fd, 0);
+        if (F->map == MAP_FAILED) {
+            if (debug)
+                fprintf(stderr, "%s:%d:%s(): mmap failed, using pread: %s\n",
+                        __FILE__, __LINE__, __FUNCTION__, strerror(errno));
+            F->map = NULL;
+        }
+        else
+            madvise(F->map, F->size, MADV_SEQUENTIAL);
+    }
+    F->reader = F->map != NULL ? OSM_READER_MMAP : OSM_READER_PREAD;
+    return 0;
+}
+
+void osm_pbf_reader_close(OSM_File *F) {
+    if (F->map != NULL)
+        munmap(F->map, F->size);
+    F->map = NULL;
+    free(F->buf.data);
+    F->buf.data = NULL;
+    F->buf.size = 0;
+    osm_pbf_free_blocks(F);
+}
+
+int osm_buffer_grow(struct osm_buffer *b, uint32_t len) {
+    if (b->size >= len)
+        return 0;
+
+    unsigned char *tmp = realloc(b->data, len);
+    if (tmp == NULL) {
+        fprintf(stderr, "failed to grow buffer to %u bytes: %s\n",
+                        len, strerror(errno));
+        return -1;
+    }
+    b->data = tmp;
+    b->size = len;
+    return 0;
+}
+
+/*
+   returns a pointer to the next len bytes of the file, NULL on EOF or
+   error. The pointer is valid until the next read into the same buffer
+   (buf == NULL: the one of the OSM_File).
+*/
+unsigned char *osm_pbf_read(OSM_File *F, uint32_t len, struct osm_buffer *buf) {
+    unsigned char *ptr;
+    ssize_t ret;
+    uint32_t done = 0;
+
+    if (F->pos + len > F->size)
+        return NULL;
+
+    if (F->reader == OSM_READER_MMAP) {
+        ptr = F->map + F->pos;
+        F->pos += len;
+        return ptr;
+    }
+
+    if (buf == NULL)
+        buf = &F->buf;
+    if (osm_buffer_grow(buf, len) != 0)
+        return NULL;
+
+    while (done < len) {
+        ret = pread(F->fd, buf->data + done, len - done, F->pos + done);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            if (ret == -1)
+                fprintf(stderr, "error reading .osm.pbf file: %s\n",
+                                strerror(errno));
+            return NULL;
+        }
+        done += ret;
+    }
+    F->pos += len;
+    return buf->data;
+}
+
+void osm_pbf_seek(OSM_File *F, off_t pos) {
+    F->pos = pos;
+}
+
+off_t osm_pbf_tell(OSM_File *F) {
+    return F->pos;
+}
+
+/* END */
@@ -0,0 +1,337 @@
+/*
+ * pbf-run.c - run over all OSMData blocks of a .osm.pbf file
+ *
+ * With F->threads > 1 one reader thread fetches the frames, a pool of
+ * F->threads worker threads runs the decode() callback on them in
+ * parallel and the calling thread runs apply() on the decoded blocks in
+ * the original file order. With F->threads <= 1 everything happens in
+ * the calling thread.
+ *
+ * If the file has a block index (see pbf-index.c) and the handler has a
+ * want() callback, only the blocks selected by want() are read.
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "osm.h"
+
+enum {
+    PBF_BLOCK_FREE,
+    PBF_BLOCK_READ,
+    PBF_BLOCK_BUSY,
+    PBF_BLOCK_DONE,
+    PBF_BLOCK_EOF,
+    PBF_BLOCK_ERROR
+};
+
+struct pbf_pipe {
+    OSM_File        *F;
+    OSM_Pbf_Handler *h;
+    pthread_mutex_t  lock;
+    pthread_cond_t   cond;
+    OSM_Pbf_Block   *blocks;
+    uint32_t         num;
+    uint64_t         next_decode;
+    int              quit;
+    uint64_t        *offsets;       /* selected blocks, NULL: all */
+    uint32_t         num_offsets;
+    uint32_t         next_offset;
+};
+
+/*
+   reads the next OSMData frame into b, other frames (OSMHeader) are
+   skipped. Returns 1 on success, 0 on EOF and -1 on error
+*/
+static int pbf_next_block(OSM_File *F, OSM_Pbf_Block *b) {
+    struct osm_pbf_bh bh;
+    unsigned char *buffer;
+    uint32_t length;
+    off_t offset;
+    int is_data;
+
+    while (1) {
+        offset = osm_pbf_tell(F);
+        length = osm_pbf_bh_length(F);
+        if (length == (uint32_t)-1) /* EOF */
+            return 0;
+
+        if (length == 0 || length > MAX_BLOCK_HEADER_SIZE) {
+            fprintf(stderr, "Block Header isn't present or exceeds "
+                            "minimum/maximum size: %u\n", length);
+            return -1;
+        }
+
+        buffer = osm_pbf_read(F, length, NULL);
+        if (buffer == NULL) {
+            fprintf(stderr, "short read on BlobHeader message\n");
+            return -1;
+        }
+        if (osm_pbf_parse_bh(buffer, length, &bh) != 0)
+            return -1;
+        length  = bh.datasize;
+        is_data = bh.type_len == 7 && memcmp(bh.type, "OSMData", 7) == 0;
+
+        if (length == 0 || length > MAX_BLOB_SIZE) {
+            fprintf(stderr, "Blob isn't present or exceeds "
+                            "minimum/maximum size\n");
+            return -1;
+        }
+
+        if (!is_data) {
+            osm_pbf_seek(F, osm_pbf_tell(F) + length);
+            continue;
+        }
+
+        b->blob = osm_pbf_read(F, length, &b->frame);
+        if (b->blob == NULL) {
+            fprintf(stderr, "short read on Blob message\n");
+            return -1;
+        }
+        b->blob_len = length;
+        b->offset   = offset;
+        return 1;
+    }
+}
+
+/* like pbf_next_block(), but only the blocks selected from the index */
+static int pbf_read_block(struct pbf_pipe *p, OSM_Pbf_Block *b) {
+    if (p->offsets != NULL) {
+        if (p->next_offset == p->num_offsets)
+            return 0;
+        osm_pbf_seek(p->F, p->offsets[p->next_offset]);
+        p->next_offset += 1;
+    }
+    return pbf_next_block(p->F, b);
+}
+
+static int pbf_select_blocks(struct pbf_pipe *p) {
+    OSM_Pbf_Index *I = p->F->index;
+    uint32_t i;
+
+    p->offsets = malloc(sizeof(uint64_t) * (I->num + 1));
+    if (p->offsets == NULL) {
+        fprintf(stderr, "failed to malloc block selection: %s\n", strerror(errno));
+        return -1;
+    }
+    for (i = 0; i < I->num; i++) {
+        if (p->h->want(&I->data[i], p->h->ctx))
+            p->offsets[p->num_offsets++] = I->data[i].offset;
+    }
+    if (debug)
+        fprintf(stderr, "%s:%d:%s(): %u of %u blocks selected\n",
+                        __FILE__, __LINE__, __FUNCTION__, p->num_offsets, I->num);
+    return 0;
+}
+
+static void *pbf_reader(void *arg) {
+    struct pbf_pipe *p = arg;
+    OSM_Pbf_Block *b;
+    uint64_t seq;
+    int ret;
+
+    for (seq = 0; ; seq++) {
+        b = &p->blocks[seq % p->num];
+
+        pthread_mutex_lock(&p->lock);
+        while (b->state != PBF_BLOCK_FREE && !p->quit)
+            pthread_cond_wait(&p->cond, &p->lock);
+        if (p->quit) {
+            pthread_mutex_unlock(&p->lock);
+            break;
+        }
+        pthread_mutex_unlock(&p->lock);
+
+        ret = pbf_read_block(p, b);
+
+        pthread_mutex_lock(&p->lock);
+        if (ret > 0)
+            b->state = PBF_BLOCK_READ;
+        else if (ret == 0)
+            b->state = PBF_BLOCK_EOF;
+        else
+            b->state = PBF_BLOCK_ERROR;
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+
+        if (ret <= 0)
+            break;
+    }
+    return NULL;
+}
+
+static void *pbf_worker(void *arg) {
+    struct pbf_pipe *p = arg;
+    OSM_Pbf_Block *b;
+    int ret;
+
+    pthread_mutex_lock(&p->lock);
+    while (!p->quit) {
+        b = &p->blocks[p->next_decode % p->num];
+        if (b->state == PBF_BLOCK_READ) {
+            b->state = PBF_BLOCK_BUSY;
+            p->next_decode += 1;
+            pthread_mutex_unlock(&p->lock);
+
+            ret = p->h->decode(b, p->h->ctx);
+
+            pthread_mutex_lock(&p->lock);
+            b->state = ret == 0 ? PBF_BLOCK_DONE : PBF_BLOCK_ERROR;
+            pthread_cond_broadcast(&p->cond);
+        }
+        else if (b->state == PBF_BLOCK_EOF || b->state == PBF_BLOCK_ERROR) {
+            /* reader is done, nothing more to decode */
+            break;
+        }
+        else
+            pthread_cond_wait(&p->cond, &p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+static int pbf_run_threaded(struct pbf_pipe *p, int threads) {
+    pthread_t reader;
+    pthread_t *workers;
+    OSM_Pbf_Block *b;
+    uint64_t seq;
+    int i, state, started = 0, ret = 0;
+
+    workers = malloc(sizeof(pthread_t) * threads);
+    if (workers == NULL) {
+        fprintf(stderr, "failed to malloc worker threads: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (pthread_create(&reader, NULL, pbf_reader, p) != 0) {
+        fprintf(stderr, "failed to start reader thread\n");
+        free(workers);
+        return -1;
+    }
+    for (started = 0; started < threads; started++) {
+        if (pthread_create(&workers[started], NULL, pbf_worker, p) != 0) {
+            fprintf(stderr, "failed to start worker thread %d\n", started);
+            ret = -1;
+            break;
+        }
+    }
+
+    for (seq = 0; ret == 0 && started > 0; seq++) {
+        b = &p->blocks[seq % p->num];
+
+        pthread_mutex_lock(&p->lock);
+        while (b->state != PBF_BLOCK_DONE
+               && b->state != PBF_BLOCK_EOF
+               && b->state != PBF_BLOCK_ERROR)
+            pthread_cond_wait(&p->cond, &p->lock);
+        state = b->state;
+        pthread_mutex_unlock(&p->lock);
+
+        if (state == PBF_BLOCK_EOF)
+            break;
+        if (state == PBF_BLOCK_ERROR || p->h->apply(b, p->h->ctx) != 0) {
+            ret = -1;
+            break;
+        }
+
+        pthread_mutex_lock(&p->lock);
+        b->state = PBF_BLOCK_FREE;
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->quit = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+
+    pthread_join(reader, NULL);
+    for (i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+    free(workers);
+    return ret;
+}
+
+void osm_pbf_free_blocks(OSM_File *F) {
+    uint32_t i;
+
+    for (i = 0; i < F->num_blocks; i++) {
+        free(F->blocks[i].frame.data);
+        osm_inflate_free(&F->blocks[i].inflate);
+        osm_pbf_primitive_free(&F->blocks[i].primitive);
+    }
+    free(F->blocks);
+    F->blocks     = NULL;
+    F->num_blocks = 0;
+}
+
+int osm_pbf_run(OSM_File *F, OSM_Pbf_Handler *h) {
+    struct pbf_pipe p;
+    int threads = F->threads;
+    uint32_t i;
+    int ret = 0;
+
+    p.F    = F;
+    p.h    = h;
+    p.quit = 0;
+    p.next_decode = 0;
+    p.offsets     = NULL;
+    p.num_offsets = 0;
+    p.next_offset = 0;
+    p.num  = threads > 1 ? threads * OSM_PBF_BLOCKS_PER_THREAD : 1;
+
+    /* the slots with their read and inflate buffers live as long as F */
+    if (F->num_blocks != p.num) {
+        osm_pbf_free_blocks(F);
+        F->blocks = calloc(p.num, sizeof(OSM_Pbf_Block));
+        if (F->blocks == NULL) {
+            fprintf(stderr, "failed to malloc block list: %s\n", strerror(errno));
+            return -1;
+        }
+        F->num_blocks = p.num;
+    }
+    p.blocks = F->blocks;
+
+    osm_pbf_seek(F, 0);
+    if (F->index != NULL && h->want != NULL && pbf_select_blocks(&p) != 0)
+        return -1;
+
+    if (threads > 1) {
+        pthread_mutex_init(&p.lock, NULL);
+        pthread_cond_init(&p.cond, NULL);
+        ret = pbf_run_threaded(&p, threads);
+        pthread_cond_destroy(&p.cond);
+        pthread_mutex_destroy(&p.lock);
+    }
+    else {
+        OSM_Pbf_Block *b = &p.blocks[0];
+        while ((ret = pbf_read_block(&p, b)) > 0) {
+            if (h->decode(b, h->ctx) != 0 || h->apply(b, h->ctx) != 0) {
+                ret = -1;
+                break;
+            }
+        }
+    }
+
+    for (i = 0; i < p.num; i++) {
+        if (p.blocks[i].data != NULL && h->free_data != NULL)
+            h->free_data(p.blocks[i].data);
+        p.blocks[i].data  = NULL;
+        p.blocks[i].state = PBF_BLOCK_FREE;
+    }
+    free(p.offsets);
+
+    if (debug)
+        fprintf(stderr, "%s:%d:%s(): pass done, threads=%d, ret=%d\n",
+                        __FILE__, __LINE__, __FUNCTION__, threads, ret);
+    return ret < 0 ? -1 : 0;
+}
+
+/* END */
@@ -14,7 +14,6 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
-#include <arpa/inet.h>
 #include <time.h>
 
 #include <zlib.h>
@@ -24,13 +23,11 @@
 
 #include "osm.h"
 
+/* see osm_timestamp_format(), timestamp needs OSM_TIMESTAMP_SIZE bytes */
 void osm_pbf_timestamp(const long int deltatimestamp, char *timestamp) {
-    struct tm *ts = gmtime(&deltatimestamp);
-    if (ts == NULL) {
-        timestamp[0] = '\0';
-    }
+    struct osm_timestamp_cache c = { 0, 0, "" };
 
-    strftime(timestamp, 21, "%Y-%m-%dT%H:%M:%SZ" , ts);
+    osm_timestamp_format(&c, deltatimestamp, timestamp);
 }
 
 unsigned char *osm_pbf_uncompress_blob(Blob *bmsg) {
@@ -82,18 +79,15 @@ unsigned char *osm_pbf_uncompress_blob(Blob *bmsg) {
 }
 
 uint32_t osm_pbf_bh_length(OSM_File *F) {
-    uint32_t length;
-    char lenbuf[4];
-    unsigned int i;
-    unsigned char c;
-
-    for (i=0; i<4 && (c=fgetc(F->file)) != EOF; i++) {
-        lenbuf[i] = c;
-    }
-    // FIXME pbf-util.c:81: warning: dereferencing type-punned pointer
-    //           will break strict-aliasing rules
-    length = ntohl(*((uint32_t *) lenbuf));  // convert the buffer to a value
-    return length;
+    unsigned char *lenbuf;
+
+    lenbuf = osm_pbf_read(F, 4, NULL);
+    if (lenbuf == NULL) /* EOF */
+        return (uint32_t)-1;
+
+    /* network byte order */
+    return   ((uint32_t)lenbuf[0] << 24) | ((uint32_t)lenbuf[1] << 16)
+           | ((uint32_t)lenbuf[2] << 8)  |  (uint32_t)lenbuf[3];
 }
 
 void osm_pbf_free_bh(BlobHeader *bh) {
@@ -102,21 +96,17 @@ void osm_pbf_free_bh(BlobHeader *bh) {
 
 BlobHeader *osm_pbf_get_bh(OSM_File *F, uint32_t len) {
     BlobHeader *bh = NULL;
-    unsigned char *buffer = NULL;
-    unsigned char c;
-    int i = 0;
+    unsigned char *buffer;
 
-    buffer = (unsigned char *) malloc(len * sizeof(char));
-    // FIXME if (buffer == NULL) ... 
-    for (i = 0; i < len && (c=fgetc(F->file)) != EOF; i++) {
-        buffer[i] = c;
+    buffer = osm_pbf_read(F, len, NULL);
+    if (buffer == NULL) {
+        fprintf(stderr, "short read on BlobHeader message\n");
+        return (BlobHeader *)NULL;
     }
 
     bh = blob_header__unpack(NULL, len, buffer);
-    free(buffer);
     if (bh == NULL) {
         fprintf(stderr, "Error unpacking BlobHeader message\n");
-        free(buffer);
         return (BlobHeader *)NULL;
     }
 
@@ -129,32 +119,23 @@ void osm_pbf_free_blob(Blob *B, unsigned char *uncompressed) {
     blob__free_unpacked(B, NULL);
 }
 
-Blob *osm_pbf_get_blob(OSM_File *F, uint32_t len, unsigned char **uncompressed)
+Blob *osm_pbf_unpack_blob(unsigned char *buffer, uint32_t len, unsigned char **uncompressed)
 {
     Blob *B = NULL;
-    unsigned char *buffer;
-    unsigned char c;
-    int i = 0;
-
-    buffer = (unsigned char *) malloc(len * sizeof(char));
-    for (i = 0; i < len && (c=fgetc(F->file)) != EOF; i++) {
-        buffer[i] = c;
-    }
 
     B = blob__unpack(NULL, len, buffer);
     if (B == NULL) {
         fprintf(stderr, "Error unpacking Blob message\n");
-        free(buffer);
         return (Blob *)NULL;
     }
 
-    free(buffer);
     if (B->has_raw)
         *uncompressed = (unsigned char *)B->raw.data;
     else {
         unsigned char *tmp = osm_pbf_uncompress_blob(B);
         if (tmp == NULL) {
             fprintf(stderr, "failed to uncompress Blob\n");
+            blob__free_unpacked(B, NULL);
             return (Blob *)NULL;
         }
         *uncompressed = tmp;
@@ -162,13 +143,28 @@ Blob *osm_pbf_get_blob(OSM_File *F, uint32_t len, unsigned char **uncompressed)
     return B;
 }
 
+Blob *osm_pbf_get_blob(OSM_File *F, uint32_t len, unsigned char **uncompressed)
+{
+    unsigned char *buffer;
+
+    buffer = osm_pbf_read(F, len, NULL);
+    if (buffer == NULL) {
+        fprintf(stderr, "short read on Blob message\n");
+        return (Blob *)NULL;
+    }
+    return osm_pbf_unpack_blob(buffer, len, uncompressed);
+}
+
 void osm_pbf_free_primitive(PrimitiveBlock *P) {
     primitive_block__free_unpacked(P, NULL);
 }
 
 PrimitiveBlock *osm_pbf_unpack_data(Blob *B, unsigned char *uncompressed) {
-    PrimitiveBlock *P = 
-            primitive_block__unpack(NULL, B->raw_size, uncompressed);
+    return osm_pbf_unpack_primitive(uncompressed, B->raw_size);
+}
+
+PrimitiveBlock *osm_pbf_unpack_primitive(unsigned char *data, uint32_t len) {
+    PrimitiveBlock *P = primitive_block__unpack(NULL, len, data);
     if (P == NULL) {
         fprintf(stderr, "Error unpacking PrimitiveBlock message\n");
         return (PrimitiveBlock *)NULL;
@@ -176,3 +172,173 @@ PrimitiveBlock *osm_pbf_unpack_data(Blob *B, unsigned char *uncompressed) {
     return P;
 }
 
+/*
+   The BlobHeader and Blob messages are small and fixed, they are read
+   directly from the wire format (see osm_pbf_field() in pbf-decode.c)
+   instead of going through protobuf-c, so no memory is allocated per
+   frame.
+*/
+int osm_pbf_parse_bh(unsigned char *buffer, uint32_t len, struct osm_pbf_bh *bh) {
+    unsigned char *pos = buffer, *end = buffer + len, *data;
+    uint64_t val;
+    int field;
+
+    bh->type     = NULL;
+    bh->type_len = 0;
+    bh->datasize = 0;
+    while ((field = osm_pbf_field(&pos, end, &val, &data)) > 0) {
+        if (field == 1) {
+            bh->type     = (const char *)data;
+            bh->type_len = val;
+        }
+        else if (field == 3)
+            bh->datasize = val;
+    }
+    if (field < 0 || bh->type == NULL) {
+        fprintf(stderr, "Error unpacking BlobHeader message\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+   returns the uncompressed content of the Blob message in blob, NULL on
+   error. The data is inflated (or for raw data copied) into z->out, which
+   is reused (and only grown) for the next Blob. The buffer is writable and
+   has one spare byte behind the data, so osm_pbf_decode_primitive() can
+   terminate the strings in place.
+*/
+unsigned char *osm_pbf_inflate(struct osm_inflate *z, unsigned char *blob, uint32_t len, uint32_t *raw_size) {
+    unsigned char *pos = blob, *end = blob + len, *data;
+    unsigned char *raw = NULL, *zdata = NULL;
+    uint32_t raw_len = 0, zlen = 0;
+    int other = 0;
+    uint64_t val;
+    int field, ret;
+
+    *raw_size = 0;
+    while ((field = osm_pbf_field(&pos, end, &val, &data)) > 0) {
+        switch (field) {
+            case 1: /* raw */
+                raw     = data;
+                raw_len = val;
+                break;
+            case 2: /* raw_size */
+                *raw_size = val;
+                break;
+            case 3: /* zlib_data */
+                zdata = data;
+                zlen  = val;
+                break;
+            default: /* lzma_data, obsolete_bzip2_data */
+                other = field;
+                break;
+        }
+    }
+    if (field < 0) {
+        fprintf(stderr, "Error unpacking Blob message\n");
+        return NULL;
+    }
+
+    if (raw != NULL) {
+        *raw_size = raw_len;
+        if (osm_buffer_grow(&z->out, raw_len + 1) != 0)
+            return NULL;
+        memcpy(z->out.data, raw, raw_len);
+        return z->out.data;
+    }
+    if (zdata == NULL) {
+        if (other == 4)
+            fprintf(stderr, "LZMA data\n");
+        else if (other == 5)
+            fprintf(stderr, "bzip2 data\n");
+        else
+            fprintf(stderr, "We cannot handle the %d non-raw bytes yet...\n", *raw_size);
+        return NULL;
+    }
+    if (*raw_size > MAX_BLOB_SIZE) {
+        fprintf(stderr, "uncompressed Blob exceeds maximum size: %u\n", *raw_size);
+        return NULL;
+    }
+
+    if (osm_buffer_grow(&z->out, *raw_size + 1) != 0)
+        return NULL;
+
+    if (!z->ready) {
+        memset(&z->strm, 0, sizeof(z_stream));
+        if (inflateInit(&z->strm) != Z_OK) {
+            fprintf(stderr, "Zlib init failed\n");
+            return NULL;
+        }
+        z->ready = 1;
+    }
+    else if (inflateReset(&z->strm) != Z_OK) {
+        fprintf(stderr, "Zlib reset failed\n");
+        return NULL;
+    }
+
+    z->strm.next_in   = zdata;
+    z->strm.avail_in  = zlen;
+    z->strm.next_out  = z->out.data;
+    z->strm.avail_out = *raw_size;
+
+    ret = inflate(&z->strm, Z_FINISH);
+    if (ret != Z_STREAM_END || z->strm.total_out != *raw_size) {
+        fprintf(stderr, "Zlib compression failed\n");
+        return NULL;
+    }
+    return z->out.data;
+}
+
+/*
+   returns the OSMDATA_* types of the primitive groups in an uncompressed
+   PrimitiveBlock by looking at the field tags only. On a broken block all
+   types are returned, the real unpack will complain.
+*/
+uint32_t osm_pbf_block_types(unsigned char *data, uint32_t len) {
+    unsigned char *pos = data, *end = data + len, *group;
+    unsigned char *gpos, *gend, *dummy;
+    uint32_t types = 0;
+    uint64_t val;
+    int field, gfield;
+
+    while ((field = osm_pbf_field(&pos, end, &val, &group)) > 0) {
+        if (field != 2) /* primitivegroup */
+            continue;
+        gpos = group;
+        gend = group + val;
+        /* a group holds only one type, the first field tells which */
+        if ((gfield = osm_pbf_field(&gpos, gend, &val, &dummy)) > 0) {
+            switch (gfield) {
+                case 1: /* nodes */
+                case 2: /* dense */
+                    types |= OSMDATA_NODE;
+                    break;
+                case 3:
+                    types |= OSMDATA_WAY;
+                    break;
+                case 4:
+                    types |= OSMDATA_REL;
+                    break;
+                case 5:
+                    types |= OSMDATA_CSET;
+                    break;
+            }
+        }
+        if (gfield < 0)
+            return OSMDATA_NODE|OSMDATA_WAY|OSMDATA_REL|OSMDATA_CSET;
+    }
+    if (field < 0)
+        return OSMDATA_NODE|OSMDATA_WAY|OSMDATA_REL|OSMDATA_CSET;
+    return types;
+}
+
+void osm_inflate_free(struct osm_inflate *z) {
+    if (z->ready)
+        (void)inflateEnd(&z->strm);
+    z->ready = 0;
+    free(z->out.data);
+    z->out.data = NULL;
+    z->out.size = 0;
+}
+
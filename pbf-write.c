@@ -0,0 +1,975 @@
+/*
+ * pbf-write.c - .osm.pbf writing
+ *
+ * The entities given to osm_pbf_write_node() & co. are copied into the
+ * current block: up to PBF_WRITE_BLOCK_SIZE entities of one type, the
+ * strings (deduplicated) into a buffer of the block. A full block is
+ * encoded - string table sorted by use, dense nodes, delta coded ids,
+ * coordinates, way refs and relation members - and deflated. With
+ * threads > 1 a pool of worker threads encodes the blocks while the
+ * caller fills the next ones, the calling thread writes the finished
+ * blocks in order.
+ *
+ *   W = osm_pbf_write_open("me", outfh, threads);
+ *   osm_pbf_write_node(W, n); ... osm_pbf_write_way(W, w); ...
+ *   osm_pbf_write_close(W);
+ *
+ * The nodes should come before the ways and those before the relations
+ * (as in any .osm file), each type change starts a new block.
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "osm.h"
+
+#define PBF_WRITE_BLOCK_SIZE 8000
+/* a block is also full with this many strings bytes, tags or refs */
+#define PBF_WRITE_BLOCK_BYTES (8*1024*1024)
+#define PBF_WRITE_BLOCK_TAGS  (1024*1024)
+#define PBF_WRITE_BLOCK_REFS  (1024*1024)
+
+#define PBF_WIRE_VARINT 0
+#define PBF_WIRE_LENGTH 2
+
+enum {
+    PBF_WRITE_FREE,
+    PBF_WRITE_FILL,
+    PBF_WRITE_READY,
+    PBF_WRITE_BUSY,
+    PBF_WRITE_DONE,
+    PBF_WRITE_ERROR
+};
+
+/* growing output buffer, failed is set if a realloc() failed */
+struct pbf_buf {
+    unsigned char *data;
+    size_t len;
+    size_t size;
+    int failed;
+};
+
+/* string index and its number of uses, for sorting the string table */
+struct pbf_write_use {
+    uint32_t count;
+    uint32_t idx;
+};
+
+struct pbf_write_block {
+    int      state;
+    uint32_t type;              /* OSMDATA_NODE, OSMDATA_WAY, OSMDATA_REL */
+    uint32_t num;               /* entities */
+    uint32_t size;
+    int64_t  *id;
+    int64_t  *lat;              /* nodes: 1e-7 degrees */
+    int64_t  *lon;
+    int64_t  *version;
+    int64_t  *timestamp;
+    int64_t  *changeset;
+    int64_t  *uid;
+    int64_t  *user;             /* string index */
+    uint32_t *tag_start;        /* into keys / vals */
+    uint32_t *num_tags;
+    uint32_t *ref_start;        /* into refs / roles / types */
+    uint32_t *num_refs;
+    int      has_info;
+    int      has_tags;
+    uint32_t tags;              /* tag pool: string indexes */
+    uint32_t size_tags;
+    uint32_t *keys;
+    uint32_t *vals;
+    uint32_t refs;              /* way nodes and relation members */
+    uint32_t size_refs;
+    int64_t  *ref;
+    uint32_t *role;             /* string index */
+    int64_t  *mtype;            /* Relation.MemberType */
+    uint32_t strings;           /* string i starts at str_off[i] in str */
+    uint32_t size_strings;
+    uint32_t *str_off;
+    struct pbf_buf str;
+    /* encoding scratch */
+    uint32_t *sid;              /* string index -> id in the string table */
+    struct pbf_write_use *use;
+    int64_t  *conv;
+    uint32_t size_conv;
+    struct pbf_buf blk, grp, msg, sub, tmp, zbuf, out;
+};
+
+struct _osm_pbf_writer {
+    FILE *outfh;
+    int   threads;
+    int   failed;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    pthread_t *workers;
+    int   started;
+    int   quit;
+    struct pbf_write_block *blocks;
+    uint32_t num;
+    struct pbf_write_block *cur; /* the block being filled */
+    uint64_t fill;              /* number of blocks handed out */
+    uint64_t next_encode;
+    uint64_t next_write;
+    uint32_t *hash;             /* string dedup of cur, index + 1, 0: free */
+    uint32_t size_hash;
+};
+
+static int pbf_buf_reserve(struct pbf_buf *b, size_t n) {
+    size_t size;
+    unsigned char *tmp;
+
+    if (b->len + n <= b->size)
+        return 0;
+    if (b->failed)
+        return -1;
+    size = b->size ? b->size : 4096;
+    while (size < b->len + n)
+        size *= 2;
+    tmp = realloc(b->data, size);
+    if (tmp == NULL) {
+        fprintf(stderr, "failed to grow PBF write buffer to %zu bytes: %s\n",
+                        size, strerror(errno));
+        b->failed = 1;
+        return -1;
+    }
+    b->data = tmp;
+    b->size = size;
+    return 0;
+}
+
+static void pbf_put_varint(struct pbf_buf *b, uint64_t v) {
+    if (pbf_buf_reserve(b, 10) != 0)
+        return;
+    while (v >= 0x80) {
+        b->data[b->len++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    b->data[b->len++] = v;
+}
+
+static inline uint64_t pbf_zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static void pbf_put_key(struct pbf_buf *b, int field, int wire) {
+    pbf_put_varint(b, (field << 3) | wire);
+}
+
+static void pbf_put_uint(struct pbf_buf *b, int field, uint64_t v) {
+    pbf_put_key(b, field, PBF_WIRE_VARINT);
+    pbf_put_varint(b, v);
+}
+
+static void pbf_put_bytes(struct pbf_buf *b, int field, const void *data, size_t len) {
+    pbf_put_key(b, field, PBF_WIRE_LENGTH);
+    pbf_put_varint(b, len);
+    if (pbf_buf_reserve(b, len) != 0)
+        return;
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+/* the message in sub as field of b, sub is emptied */
+static void pbf_put_message(struct pbf_buf *b, int field, struct pbf_buf *sub) {
+    b->failed |= sub->failed;
+    pbf_put_bytes(b, field, sub->data, sub->len);
+    sub->len = 0;
+}
+
+/* a packed repeated field, plain varints or delta coded sint */
+static void pbf_put_packed(struct pbf_buf *b, struct pbf_buf *tmp, int field,
+                           const int64_t *v, uint32_t n, int delta)
+{
+    int64_t last = 0;
+    uint32_t i;
+
+    if (n == 0)
+        return;
+    tmp->len = 0;
+    for (i = 0; i < n; i++) {
+        if (delta) {
+            pbf_put_varint(tmp, pbf_zigzag(v[i] - last));
+            last = v[i];
+        }
+        else
+            pbf_put_varint(tmp, (uint64_t)v[i]);
+    }
+    pbf_put_message(b, field, tmp);
+}
+
+static int pbf_write_grow(void **data, uint32_t size, size_t elem) {
+    void *tmp = realloc(*data, elem * size);
+    if (tmp == NULL) {
+        fprintf(stderr, "failed to grow PBF write block to %u entries: %s\n",
+                        size, strerror(errno));
+        return -1;
+    }
+    *data = tmp;
+    return 0;
+}
+
+/* room for one more entity in B */
+static int pbf_write_row(struct pbf_write_block *B) {
+    uint32_t size = B->size ? B->size * 2 : 1024;
+
+    if (B->num < B->size)
+        return 0;
+    if (   pbf_write_grow((void **)&B->id,        size, sizeof(int64_t))  != 0
+        || pbf_write_grow((void **)&B->lat,       size, sizeof(int64_t))  != 0
+        || pbf_write_grow((void **)&B->lon,       size, sizeof(int64_t))  != 0
+        || pbf_write_grow((void **)&B->version,   size, sizeof(int64_t))  != 0
+        || pbf_write_grow((void **)&B->timestamp, size, sizeof(int64_t))  != 0
+        || pbf_write_grow((void **)&B->changeset, size, sizeof(int64_t))  != 0
+        || pbf_write_grow((void **)&B->uid,       size, sizeof(int64_t))  != 0
+        || pbf_write_grow((void **)&B->user,      size, sizeof(int64_t))  != 0
+        || pbf_write_grow((void **)&B->tag_start, size, sizeof(uint32_t)) != 0
+        || pbf_write_grow((void **)&B->num_tags,  size, sizeof(uint32_t)) != 0
+        || pbf_write_grow((void **)&B->ref_start, size, sizeof(uint32_t)) != 0
+        || pbf_write_grow((void **)&B->num_refs,  size, sizeof(uint32_t)) != 0)
+        return -1;
+    B->size = size;
+    return 0;
+}
+
+static int pbf_write_reserve_tags(struct pbf_write_block *B, uint32_t n) {
+    uint32_t size = B->size_tags ? B->size_tags : 4096;
+
+    if (B->tags + n <= B->size_tags)
+        return 0;
+    while (size < B->tags + n)
+        size *= 2;
+    if (   pbf_write_grow((void **)&B->keys, size, sizeof(uint32_t)) != 0
+        || pbf_write_grow((void **)&B->vals, size, sizeof(uint32_t)) != 0)
+        return -1;
+    B->size_tags = size;
+    return 0;
+}
+
+static int pbf_write_reserve_refs(struct pbf_write_block *B, uint32_t n) {
+    uint32_t size = B->size_refs ? B->size_refs : 16384;
+
+    if (B->refs + n <= B->size_refs)
+        return 0;
+    while (size < B->refs + n)
+        size *= 2;
+    if (   pbf_write_grow((void **)&B->ref,   size, sizeof(int64_t))  != 0
+        || pbf_write_grow((void **)&B->role,  size, sizeof(uint32_t)) != 0
+        || pbf_write_grow((void **)&B->mtype, size, sizeof(int64_t))  != 0)
+        return -1;
+    B->size_refs = size;
+    return 0;
+}
+
+/* FNV-1a */
+static uint32_t pbf_write_hash(const char *s) {
+    uint32_t h = 2166136261U;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+static int pbf_write_rehash(OSM_Pbf_Writer *W, uint32_t size) {
+    struct pbf_write_block *B = W->cur;
+    uint32_t i, pos;
+
+    free(W->hash);
+    W->hash = calloc(size, sizeof(uint32_t));
+    if (W->hash == NULL) {
+        fprintf(stderr, "failed to malloc PBF string hash: %s\n", strerror(errno));
+        W->size_hash = 0;
+        return -1;
+    }
+    W->size_hash = size;
+    for (i = 1; i < B->strings; i++) {
+        pos = pbf_write_hash((char *)B->str.data + B->str_off[i]) & (size - 1);
+        while (W->hash[pos] != 0)
+            pos = (pos + 1) & (size - 1);
+        W->hash[pos] = i + 1;
+    }
+    return 0;
+}
+
+/*
+   the index of s in the strings of the current block, s is copied if it
+   is new. Index 0 is the empty string. Returns -1 if out of memory.
+*/
+static int64_t pbf_write_string(OSM_Pbf_Writer *W, const char *s) {
+    struct pbf_write_block *B = W->cur;
+    uint32_t pos, idx;
+    size_t len;
+
+    if (s == NULL || *s == '\0')
+        return 0;
+
+    if (2 * B->strings >= W->size_hash
+        && pbf_write_rehash(W, W->size_hash ? W->size_hash * 2 : 8192) != 0)
+        return -1;
+
+    pos = pbf_write_hash(s) & (W->size_hash - 1);
+    while ((idx = W->hash[pos]) != 0) {
+        if (strcmp((char *)B->str.data + B->str_off[idx - 1], s) == 0)
+            return idx - 1;
+        pos = (pos + 1) & (W->size_hash - 1);
+    }
+
+    if (B->strings == B->size_strings) {
+        uint32_t size = B->size_strings * 2;
+        if (pbf_write_grow((void **)&B->str_off, size, sizeof(uint32_t)) != 0)
+            return -1;
+        B->size_strings = size;
+    }
+    len = strlen(s) + 1;
+    if (pbf_buf_reserve(&B->str, len) != 0)
+        return -1;
+    memcpy(B->str.data + B->str.len, s, len);
+    B->str_off[B->strings] = B->str.len;
+    B->str.len += len;
+    W->hash[pos] = B->strings + 1;
+    return B->strings++;
+}
+
+/* string table ids by number of uses, the most used get the short varints */
+static int pbf_write_use_cmp(const void *a, const void *b) {
+    const struct pbf_write_use *x = a;
+    const struct pbf_write_use *y = b;
+    if (x->count != y->count)
+        return x->count > y->count ? -1 : 1;
+    return x->idx < y->idx ? -1 : (x->idx > y->idx);
+}
+
+static int pbf_write_string_table(struct pbf_write_block *B) {
+    uint32_t i;
+
+    if (   pbf_write_grow((void **)&B->sid, B->strings, sizeof(uint32_t)) != 0
+        || pbf_write_grow((void **)&B->use, B->strings, sizeof(struct pbf_write_use)) != 0)
+        return -1;
+    for (i = 0; i < B->strings; i++) {
+        B->use[i].count = 0;
+        B->use[i].idx   = i;
+    }
+    for (i = 0; i < B->tags; i++) {
+        B->use[B->keys[i]].count += 1;
+        B->use[B->vals[i]].count += 1;
+    }
+    for (i = 0; i < B->refs && B->type == OSMDATA_REL; i++)
+        B->use[B->role[i]].count += 1;
+    for (i = 0; i < B->num && B->has_info; i++)
+        B->use[B->user[i]].count += 1;
+
+    /* the empty string stays at 0, it ends the tags of a dense node */
+    qsort(B->use + 1, B->strings - 1, sizeof(struct pbf_write_use), pbf_write_use_cmp);
+    B->sid[0] = 0;
+    pbf_put_bytes(&B->sub, 1, "", 0);
+    for (i = 1; i < B->strings; i++) {
+        const char *s = (char *)B->str.data + B->str_off[B->use[i].idx];
+        B->sid[B->use[i].idx] = i;
+        pbf_put_bytes(&B->sub, 1, s, strlen(s));
+    }
+    pbf_put_message(&B->blk, 1, &B->sub);
+    return 0;
+}
+
+/* B->conv with n values */
+static int64_t *pbf_write_conv(struct pbf_write_block *B, uint32_t n) {
+    if (n > B->size_conv) {
+        if (pbf_write_grow((void **)&B->conv, n, sizeof(int64_t)) != 0)
+            return NULL;
+        B->size_conv = n;
+    }
+    return B->conv;
+}
+
+static int pbf_write_dense(struct pbf_write_block *B) {
+    int64_t *v;
+    uint32_t i, j, n;
+
+    pbf_put_packed(&B->msg, &B->tmp, 1, B->id, B->num, 1);
+    if (B->has_info) {
+        if ((v = pbf_write_conv(B, B->num)) == NULL)
+            return -1;
+        pbf_put_packed(&B->sub, &B->tmp, 1, B->version,   B->num, 0);
+        pbf_put_packed(&B->sub, &B->tmp, 2, B->timestamp, B->num, 1);
+        pbf_put_packed(&B->sub, &B->tmp, 3, B->changeset, B->num, 1);
+        pbf_put_packed(&B->sub, &B->tmp, 4, B->uid,       B->num, 1);
+        for (i = 0; i < B->num; i++)
+            v[i] = B->sid[B->user[i]];
+        pbf_put_packed(&B->sub, &B->tmp, 5, v, B->num, 1);
+        pbf_put_message(&B->msg, 5, &B->sub);
+    }
+    pbf_put_packed(&B->msg, &B->tmp, 8, B->lat, B->num, 1);
+    pbf_put_packed(&B->msg, &B->tmp, 9, B->lon, B->num, 1);
+    if (B->has_tags) {
+        /* key, val, ... 0 for each node */
+        if ((v = pbf_write_conv(B, 2 * B->tags + B->num)) == NULL)
+            return -1;
+        for (i = 0, n = 0; i < B->num; i++) {
+            for (j = B->tag_start[i]; j < B->tag_start[i] + B->num_tags[i]; j++) {
+                v[n++] = B->sid[B->keys[j]];
+                v[n++] = B->sid[B->vals[j]];
+            }
+            v[n++] = 0;
+        }
+        pbf_put_packed(&B->msg, &B->tmp, 10, v, n, 0);
+    }
+    pbf_put_message(&B->grp, 2, &B->msg);
+    return 0;
+}
+
+/* keys, vals and info of Way and Relation, the same field numbers */
+static int pbf_write_common(struct pbf_write_block *B, uint32_t i) {
+    uint32_t j, n = B->num_tags[i], start = B->tag_start[i];
+    int64_t *v;
+
+    pbf_put_uint(&B->msg, 1, B->id[i]);
+    if (n) {
+        if ((v = pbf_write_conv(B, n)) == NULL)
+            return -1;
+        for (j = 0; j < n; j++)
+            v[j] = B->sid[B->keys[start + j]];
+        pbf_put_packed(&B->msg, &B->tmp, 2, v, n, 0);
+        for (j = 0; j < n; j++)
+            v[j] = B->sid[B->vals[start + j]];
+        pbf_put_packed(&B->msg, &B->tmp, 3, v, n, 0);
+    }
+    if (B->version[i] || B->timestamp[i] || B->changeset[i] || B->uid[i] || B->user[i]) {
+        pbf_put_uint(&B->sub, 1, B->version[i]);
+        pbf_put_uint(&B->sub, 2, B->timestamp[i]);
+        pbf_put_uint(&B->sub, 3, B->changeset[i]);
+        pbf_put_uint(&B->sub, 4, B->uid[i]);
+        pbf_put_uint(&B->sub, 5, B->sid[B->user[i]]);
+        pbf_put_message(&B->msg, 4, &B->sub);
+    }
+    return 0;
+}
+
+static int pbf_write_ways(struct pbf_write_block *B) {
+    uint32_t i;
+
+    for (i = 0; i < B->num; i++) {
+        if (pbf_write_common(B, i) != 0)
+            return -1;
+        pbf_put_packed(&B->msg, &B->tmp, 8, B->ref + B->ref_start[i], B->num_refs[i], 1);
+        pbf_put_message(&B->grp, 3, &B->msg);
+    }
+    return 0;
+}
+
+static int pbf_write_relations(struct pbf_write_block *B) {
+    uint32_t i, j, n, start;
+    int64_t *v;
+
+    for (i = 0; i < B->num; i++) {
+        if (pbf_write_common(B, i) != 0)
+            return -1;
+        n     = B->num_refs[i];
+        start = B->ref_start[i];
+        if (n) {
+            if ((v = pbf_write_conv(B, n)) == NULL)
+                return -1;
+            for (j = 0; j < n; j++)
+                v[j] = B->sid[B->role[start + j]];
+            pbf_put_packed(&B->msg, &B->tmp, 8, v, n, 0);
+            pbf_put_packed(&B->msg, &B->tmp, 9, B->ref + start, n, 1);
+            pbf_put_packed(&B->msg, &B->tmp, 10, B->mtype + start, n, 0);
+        }
+        pbf_put_message(&B->grp, 4, &B->msg);
+    }
+    return 0;
+}
+
+/* the frame of a blob: length, BlobHeader, Blob */
+static void pbf_write_frame(struct pbf_buf *out, struct pbf_buf *hdr, const char *type,
+                            struct pbf_buf *blob)
+{
+    uint32_t len;
+
+    hdr->len = 0;
+    pbf_put_bytes(hdr, 1, type, strlen(type));
+    pbf_put_uint(hdr, 3, blob->len);
+    len = hdr->len;
+
+    out->len = 0;
+    if (pbf_buf_reserve(out, 4 + hdr->len + blob->len) != 0)
+        return;
+    out->data[0] = len >> 24;
+    out->data[1] = len >> 16;
+    out->data[2] = len >> 8;
+    out->data[3] = len;
+    memcpy(out->data + 4, hdr->data, hdr->len);
+    memcpy(out->data + 4 + hdr->len, blob->data, blob->len);
+    out->len = 4 + hdr->len + blob->len;
+    out->failed |= hdr->failed | blob->failed;
+}
+
+/* a zlib compressed Blob of the message in raw */
+static int pbf_write_deflate(struct pbf_buf *raw, struct pbf_buf *zbuf, struct pbf_buf *blob) {
+    uLongf zlen = compressBound(raw->len);
+
+    zbuf->len = 0;
+    if (pbf_buf_reserve(zbuf, zlen) != 0)
+        return -1;
+    if (compress(zbuf->data, &zlen, raw->data, raw->len) != Z_OK) {
+        fprintf(stderr, "Zlib compression failed\n");
+        return -1;
+    }
+    zbuf->len = zlen;
+
+    blob->len = 0;
+    pbf_put_uint(blob, 2, raw->len);
+    pbf_put_bytes(blob, 3, zbuf->data, zbuf->len);
+    return blob->failed ? -1 : 0;
+}
+
+/* encodes and deflates B into B->out, runs in the worker threads */
+static int pbf_write_encode(struct pbf_write_block *B) {
+    int ret = 0;
+
+    B->blk.len = B->grp.len = B->msg.len = B->sub.len = 0;
+    if (pbf_write_string_table(B) != 0)
+        return -1;
+
+    switch (B->type) {
+        case OSMDATA_NODE:
+            ret = pbf_write_dense(B);
+            break;
+        case OSMDATA_WAY:
+            ret = pbf_write_ways(B);
+            break;
+        case OSMDATA_REL:
+            ret = pbf_write_relations(B);
+            break;
+    }
+    if (ret != 0)
+        return -1;
+    pbf_put_message(&B->blk, 2, &B->grp);
+    if (B->blk.failed || B->blk.len > MAX_BLOB_SIZE) {
+        fprintf(stderr, "failed to encode PBF block of %u entities\n", B->num);
+        return -1;
+    }
+
+    /* msg is free again, it takes the Blob */
+    if (pbf_write_deflate(&B->blk, &B->zbuf, &B->msg) != 0)
+        return -1;
+    pbf_write_frame(&B->out, &B->sub, "OSMData", &B->msg);
+    return B->out.failed ? -1 : 0;
+}
+
+static void *pbf_write_worker(void *arg) {
+    OSM_Pbf_Writer *W = arg;
+    struct pbf_write_block *B;
+    int ret;
+
+    pthread_mutex_lock(&W->lock);
+    while (1) {
+        B = &W->blocks[W->next_encode % W->num];
+        if (B->state == PBF_WRITE_READY) {
+            B->state = PBF_WRITE_BUSY;
+            W->next_encode += 1;
+            pthread_mutex_unlock(&W->lock);
+
+            ret = pbf_write_encode(B);
+
+            pthread_mutex_lock(&W->lock);
+            B->state = ret == 0 ? PBF_WRITE_DONE : PBF_WRITE_ERROR;
+            pthread_cond_broadcast(&W->cond);
+        }
+        else if (W->quit)
+            break;
+        else
+            pthread_cond_wait(&W->cond, &W->lock);
+    }
+    pthread_mutex_unlock(&W->lock);
+    return NULL;
+}
+
+/* waits for the oldest block, writes it and frees its slot */
+static int pbf_write_out(OSM_Pbf_Writer *W) {
+    struct pbf_write_block *B = &W->blocks[W->next_write % W->num];
+    int state;
+
+    pthread_mutex_lock(&W->lock);
+    while (B->state != PBF_WRITE_DONE && B->state != PBF_WRITE_ERROR)
+        pthread_cond_wait(&W->cond, &W->lock);
+    state = B->state;
+    pthread_mutex_unlock(&W->lock);
+
+    if (state == PBF_WRITE_ERROR)
+        W->failed = 1;
+    else if (fwrite(B->out.data, 1, B->out.len, W->outfh) != B->out.len) {
+        fprintf(stderr, "failed to write PBF block: %s\n", strerror(errno));
+        W->failed = 1;
+    }
+    W->next_write += 1;
+
+    pthread_mutex_lock(&W->lock);
+    B->state = PBF_WRITE_FREE;
+    pthread_mutex_unlock(&W->lock);
+    return W->failed ? -1 : 0;
+}
+
+/* hands the current block to the workers (or encodes it right here) */
+static int pbf_write_submit(OSM_Pbf_Writer *W) {
+    struct pbf_write_block *B = W->cur;
+
+    W->cur = NULL;
+    if (B == NULL || B->num == 0) {
+        if (B != NULL) { /* nothing in it, the slot can be reused */
+            W->fill -= 1;
+            pthread_mutex_lock(&W->lock);
+            B->state = PBF_WRITE_FREE;
+            pthread_mutex_unlock(&W->lock);
+        }
+        return 0;
+    }
+    if (W->threads <= 1) {
+        B->state = pbf_write_encode(B) == 0 ? PBF_WRITE_DONE : PBF_WRITE_ERROR;
+        return pbf_write_out(W);
+    }
+    pthread_mutex_lock(&W->lock);
+    B->state = PBF_WRITE_READY;
+    pthread_cond_broadcast(&W->cond);
+    pthread_mutex_unlock(&W->lock);
+    return 0;
+}
+
+/* the block for the next entity of type, a full one is submitted first */
+static struct pbf_write_block *pbf_write_block_for(OSM_Pbf_Writer *W, uint32_t type) {
+    struct pbf_write_block *B = W->cur;
+
+    if (W->failed)
+        return NULL;
+    if (B != NULL && (B->type != type
+                      || B->num  == PBF_WRITE_BLOCK_SIZE
+                      || B->str.len > PBF_WRITE_BLOCK_BYTES
+                      || B->tags > PBF_WRITE_BLOCK_TAGS
+                      || B->refs > PBF_WRITE_BLOCK_REFS))
+    {
+        if (pbf_write_submit(W) != 0)
+            return NULL;
+    }
+    if (W->cur != NULL)
+        return W->cur;
+
+    /* the slot is reused after num blocks, write what's still in there */
+    while (W->fill - W->next_write >= W->num)
+        if (pbf_write_out(W) != 0)
+            return NULL;
+
+    B = &W->blocks[W->fill % W->num];
+    W->fill += 1;
+    pthread_mutex_lock(&W->lock);
+    B->state    = PBF_WRITE_FILL;
+    pthread_mutex_unlock(&W->lock);
+    B->type     = type;
+    B->num      = 0;
+    B->has_info = 0;
+    B->has_tags = 0;
+    B->tags     = 0;
+    B->refs     = 0;
+    B->str.len  = 0;
+    B->strings  = 1; /* the empty string */
+    if (B->size_strings == 0) {
+        if (pbf_write_grow((void **)&B->str_off, 1024, sizeof(uint32_t)) != 0) {
+            W->failed = 1;
+            return NULL;
+        }
+        B->size_strings = 1024;
+    }
+    B->str_off[0] = 0;
+    W->cur = B;
+    if (W->size_hash)
+        memset(W->hash, 0, sizeof(uint32_t) * W->size_hash);
+    return B;
+}
+
+/* the fields all entity types have, tags must have been reserved */
+#define PBF_WRITE_ENTITY(W, B, o, row) { \
+        int64_t user = pbf_write_string(W, (o)->user); \
+        uint32_t t; \
+        if (user < 0) \
+            return -1; \
+        (B)->id[row]        = (o)->id; \
+        (B)->version[row]   = (o)->version; \
+        (B)->timestamp[row] = (o)->timestamp; \
+        (B)->changeset[row] = (o)->changeset; \
+        (B)->uid[row]       = (o)->uid; \
+        (B)->user[row]      = user; \
+        if ((o)->version || (o)->timestamp || (o)->changeset || (o)->uid || user) \
+            (B)->has_info = 1; \
+        (B)->tag_start[row] = (B)->tags; \
+        (B)->num_tags[row]  = 0; \
+        for (t = 0; (o)->tags != NULL && t < (o)->tags->num; t++) { \
+            int64_t k = pbf_write_string(W, (o)->tags->data[t].key); \
+            int64_t v = pbf_write_string(W, (o)->tags->data[t].val); \
+            if (k < 0 || v < 0) \
+                return -1; \
+            (B)->keys[(B)->tags] = k; \
+            (B)->vals[(B)->tags] = v; \
+            (B)->tags += 1; \
+            (B)->num_tags[row] += 1; \
+            (B)->has_tags = 1; \
+        } \
+    }
+
+int osm_pbf_write_node(OSM_Pbf_Writer *W, OSM_Node *n) {
+    struct pbf_write_block *B = pbf_write_block_for(W, OSMDATA_NODE);
+    uint32_t row;
+
+    if (B == NULL || pbf_write_row(B) != 0
+        || pbf_write_reserve_tags(B, n->tags != NULL ? n->tags->num : 0) != 0)
+        return -1;
+    osm_node_fields(n, OSM_FIELD_ALL);
+    row = B->num;
+    PBF_WRITE_ENTITY(W, B, n, row);
+    B->lat[row] = lround(n->lat * 1e7);
+    B->lon[row] = lround(n->lon * 1e7);
+    B->ref_start[row] = 0;
+    B->num_refs[row]  = 0;
+    B->num += 1;
+    return 0;
+}
+
+int osm_pbf_write_way(OSM_Pbf_Writer *W, OSM_Way *w) {
+    struct pbf_write_block *B = pbf_write_block_for(W, OSMDATA_WAY);
+    uint32_t row, n_refs = 0;
+
+    while (w->nodes != NULL && w->nodes[n_refs])
+        ++n_refs;
+    if (B == NULL || pbf_write_row(B) != 0
+        || pbf_write_reserve_tags(B, w->tags != NULL ? w->tags->num : 0) != 0
+        || pbf_write_reserve_refs(B, n_refs) != 0)
+        return -1;
+    osm_way_fields(w, OSM_FIELD_ALL);
+    row = B->num;
+    PBF_WRITE_ENTITY(W, B, w, row);
+    B->ref_start[row] = B->refs;
+    B->num_refs[row]  = n_refs;
+    for (n_refs = 0; n_refs < B->num_refs[row]; n_refs++)
+        B->ref[B->refs++] = w->nodes[n_refs];
+    B->num += 1;
+    return 0;
+}
+
+int osm_pbf_write_relation(OSM_Pbf_Writer *W, OSM_Relation *r) {
+    struct pbf_write_block *B = pbf_write_block_for(W, OSMDATA_REL);
+    uint32_t row, i, num = r->member != NULL ? r->member->num : 0;
+    OSM_Rel_Member *m;
+    int64_t role;
+
+    if (B == NULL || pbf_write_row(B) != 0
+        || pbf_write_reserve_tags(B, r->tags != NULL ? r->tags->num : 0) != 0
+        || pbf_write_reserve_refs(B, num) != 0)
+        return -1;
+    osm_relation_fields(r, OSM_FIELD_ALL);
+    row = B->num;
+    PBF_WRITE_ENTITY(W, B, r, row);
+    B->ref_start[row] = B->refs;
+    B->num_refs[row]  = 0;
+    for (i = 0; i < num; i++) {
+        m = &r->member->data[i];
+        switch (m->type) {
+            case OSM_REL_MEMBER_TYPE_NODE:
+                B->mtype[B->refs] = RELATION__MEMBER_TYPE__NODE;
+                break;
+            case OSM_REL_MEMBER_TYPE_WAY:
+                B->mtype[B->refs] = RELATION__MEMBER_TYPE__WAY;
+                break;
+            case OSM_REL_MEMBER_TYPE_RELATION:
+                B->mtype[B->refs] = RELATION__MEMBER_TYPE__RELATION;
+                break;
+            default:
+                fprintf(stderr, "relation %lu: skipping member %lu of unknown type\n",
+                                r->id, m->ref);
+                continue;
+        }
+        role = pbf_write_string(W, m->role);
+        if (role < 0)
+            return -1;
+        B->ref[B->refs]  = m->ref;
+        B->role[B->refs] = role;
+        B->refs += 1;
+        B->num_refs[row] += 1;
+    }
+    B->num += 1;
+    return 0;
+}
+
+/* all nodes of the columns, in the order they were added */
+int osm_pbf_write_node_columns(OSM_Pbf_Writer *W, OSM_Node_Columns *C) {
+    OSM_Node n;
+    uint32_t i;
+
+    for (i = 0; i < C->num; i++) {
+        osm_node_columns_get(C, i, &n);
+        if (osm_pbf_write_node(W, &n) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* the OSMHeader block, written right away */
+static int pbf_write_header(OSM_Pbf_Writer *W, char *who) {
+    struct pbf_buf hb = { NULL, 0, 0, 0 }, blob = { NULL, 0, 0, 0 };
+    struct pbf_buf hdr = { NULL, 0, 0, 0 }, out = { NULL, 0, 0, 0 };
+    char program[256];
+    int ret = 0;
+
+    snprintf(program, sizeof(program), "%s (libosm v" LIBOSM_VERSION ")", who);
+    pbf_put_bytes(&hb, 4, "OsmSchema-V0.6", 14);
+    pbf_put_bytes(&hb, 4, "DenseNodes", 10);
+    pbf_put_bytes(&hb, 16, program, strlen(program));
+
+    pbf_put_bytes(&blob, 1, hb.data, hb.len); /* raw */
+    pbf_put_uint(&blob, 2, hb.len);
+    blob.failed |= hb.failed;
+    pbf_write_frame(&out, &hdr, "OSMHeader", &blob);
+
+    if (out.failed)
+        ret = -1;
+    else if (fwrite(out.data, 1, out.len, W->outfh) != out.len) {
+        fprintf(stderr, "failed to write PBF header: %s\n", strerror(errno));
+        ret = -1;
+    }
+    free(hb.data);
+    free(blob.data);
+    free(hdr.data);
+    free(out.data);
+    return ret;
+}
+
+static void pbf_write_free(OSM_Pbf_Writer *W) {
+    struct pbf_write_block *B;
+    uint32_t i;
+
+    for (i = 0; W->blocks != NULL && i < W->num; i++) {
+        B = &W->blocks[i];
+        free(B->id);
+        free(B->lat);
+        free(B->lon);
+        free(B->version);
+        free(B->timestamp);
+        free(B->changeset);
+        free(B->uid);
+        free(B->user);
+        free(B->tag_start);
+        free(B->num_tags);
+        free(B->ref_start);
+        free(B->num_refs);
+        free(B->keys);
+        free(B->vals);
+        free(B->ref);
+        free(B->role);
+        free(B->mtype);
+        free(B->str_off);
+        free(B->str.data);
+        free(B->sid);
+        free(B->use);
+        free(B->conv);
+        free(B->blk.data);
+        free(B->grp.data);
+        free(B->msg.data);
+        free(B->sub.data);
+        free(B->tmp.data);
+        free(B->zbuf.data);
+        free(B->out.data);
+    }
+    free(W->blocks);
+    free(W->workers);
+    free(W->hash);
+    free(W);
+}
+
+/*
+   starts a .osm.pbf file on outfh: writes the OSMHeader and, with threads
+   > 1, starts the encoder threads. Returns NULL on error.
+*/
+OSM_Pbf_Writer *osm_pbf_write_open(char *who, FILE *outfh, int threads) {
+    OSM_Pbf_Writer *W = calloc(1, sizeof(OSM_Pbf_Writer));
+
+    if (W == NULL) {
+        fprintf(stderr, "failed to malloc PBF writer: %s\n", strerror(errno));
+        return (OSM_Pbf_Writer *)NULL;
+    }
+    W->outfh   = outfh;
+    W->threads = threads;
+    W->num     = threads > 1 ? threads * OSM_PBF_BLOCKS_PER_THREAD : 1;
+    W->blocks  = calloc(W->num, sizeof(struct pbf_write_block));
+    if (W->blocks == NULL) {
+        fprintf(stderr, "failed to malloc PBF write blocks: %s\n", strerror(errno));
+        pbf_write_free(W);
+        return (OSM_Pbf_Writer *)NULL;
+    }
+    if (pbf_write_header(W, who) != 0) {
+        pbf_write_free(W);
+        return (OSM_Pbf_Writer *)NULL;
+    }
+
+    pthread_mutex_init(&W->lock, NULL);
+    pthread_cond_init(&W->cond, NULL);
+    if (threads > 1) {
+        W->workers = malloc(sizeof(pthread_t) * threads);
+        if (W->workers == NULL) {
+            fprintf(stderr, "failed to malloc encoder threads: %s\n", strerror(errno));
+            osm_pbf_write_close(W);
+            return (OSM_Pbf_Writer *)NULL;
+        }
+        for (W->started = 0; W->started < threads; W->started++) {
+            if (pthread_create(&W->workers[W->started], NULL, pbf_write_worker, W) != 0) {
+                fprintf(stderr, "failed to start encoder thread %d\n", W->started);
+                osm_pbf_write_close(W);
+                return (OSM_Pbf_Writer *)NULL;
+            }
+        }
+    }
+    if (debug)
+        fprintf(stderr, "%s:%d:%s(): %u block slots, %d threads\n",
+                        __FILE__, __LINE__, __FUNCTION__, W->num, threads);
+    return W;
+}
+
+/*
+   writes the remaining blocks, stops the threads and frees W. Returns 0,
+   or -1 if anything failed since osm_pbf_write_open().
+*/
+int osm_pbf_write_close(OSM_Pbf_Writer *W) {
+    int i, ret;
+
+    if (W->started == W->threads || W->threads <= 1) {
+        if (!W->failed)
+            pbf_write_submit(W);
+        while (!W->failed && W->next_write < W->fill)
+            pbf_write_out(W);
+    }
+    else
+        W->failed = 1;
+
+    pthread_mutex_lock(&W->lock);
+    W->quit = 1;
+    pthread_cond_broadcast(&W->cond);
+    pthread_mutex_unlock(&W->lock);
+    for (i = 0; i < W->started; i++)
+        pthread_join(W->workers[i], NULL);
+    pthread_cond_destroy(&W->cond);
+    pthread_mutex_destroy(&W->lock);
+
+    if (!W->failed && fflush(W->outfh) != 0) {
+        fprintf(stderr, "failed to write PBF file: %s\n", strerror(errno));
+        W->failed = 1;
+    }
+    ret = W->failed ? -1 : 0;
+    pbf_write_free(W);
+    return ret;
+}
+
+/* END */
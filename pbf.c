@@ -24,8 +24,820 @@
 
 #define LIST_THRESHOLD 0.9
 
-OSM_Data *osm_pbf_parse(OSM_File *F, 
-              uint32_t mode, 
+enum {
+    bbox_no_bbox,
+    bbox_nodes_in_box,
+    bbox_rel_find,
+    bbox_way_find,
+    bbox_nodes_find
+};
+
+/*
+   one decoded entity of a block, type is OSMDATA_NODE, _WAY, _REL or
+   OSMDATA_BBOX for the id of a node inside the bbox
+*/
+struct pbf_entity {
+    uint32_t type;
+    union {
+        OSM_Node     *node;
+        OSM_Way      *way;
+        OSM_Relation *rel;
+        uint64_t      id;
+    } u;
+};
+
+struct pbf_entity_list {
+    uint32_t size;
+    uint32_t num;
+    struct pbf_entity *data;
+};
+
+/* state of one osm_pbf_parse() run */
+struct pbf_parse {
+    uint32_t mode;
+    int bbox_state;
+    OSM_BBox *bbox;
+    int (*node_filter)(OSM_Node *);
+    int (*way_filter)(OSM_Way *);
+    int (*rel_filter)(OSM_Relation *);
+    OSM_Filter *filter;         /* OSM_File.filter */
+    int node_fstate;            /* pbf_filter_* for each entity type */
+    int way_fstate;
+    int rel_fstate;
+    OSM_Id_Bitmap *mem_nodes;
+    OSM_Id_Set *mem_ways;
+    OSM_Id_Bitmap *bbn;
+    OSM_Data *data;
+    OSM_Arena *arena;
+    OSM_Node_Columns *cols;
+    int lazy;                   /* OSMDATA_LAZY: filters fetch the fields */
+};
+
+/* an entity with OSM_FLAG_LAZY and the source of its fields, one malloc() */
+struct pbf_lazy_node {
+    OSM_Node n;
+    struct osm_lazy lazy;
+};
+
+struct pbf_lazy_way {
+    OSM_Way w;
+    struct osm_lazy lazy;
+};
+
+struct pbf_lazy_rel {
+    OSM_Relation r;
+    struct osm_lazy lazy;
+};
+
+/* a new entry at the end of E, NULL if growing the list failed */
+static struct pbf_entity *pbf_add_entity(struct pbf_entity_list *E, uint32_t type) {
+    struct pbf_entity *tmp;
+
+    if ((float)E->num/(float)E->size > LIST_THRESHOLD) {
+        tmp = realloc(E->data, sizeof(struct pbf_entity) * E->size * 2);
+        if (tmp == NULL) {
+            fprintf(stderr, "failed to realloc entity list: %s\n", strerror(errno));
+            return NULL;
+        }
+        E->size *= 2;
+        E->data  = tmp;
+    }
+    E->data[E->num].type = type;
+    E->num += 1;
+    return &E->data[E->num - 1];
+}
+
+/*
+   frees the entities from E->data[from] on, which were decoded but not
+   applied (the arena owned ones are skipped by osm_free_*())
+*/
+static void pbf_drop_entities(struct pbf_entity_list *E, uint32_t from) {
+    uint32_t i;
+
+    for (i = from; i < E->num; i++) {
+        switch (E->data[i].type) {
+            case OSMDATA_NODE:
+                osm_free_node(E->data[i].u.node);
+                break;
+            case OSMDATA_WAY:
+                osm_free_way(E->data[i].u.way);
+                break;
+            case OSMDATA_REL:
+                osm_free_relation(E->data[i].u.rel);
+                break;
+        }
+    }
+    E->num = 0;
+}
+
+static void pbf_free_entities(void *data) {
+    struct pbf_entity_list *E = data;
+    pbf_drop_entities(E, 0);
+    free(E->data);
+    free(E);
+}
+
+/* a string of the string table, not copied (see OSM_FLAG_VIEW) */
+static char *pbf_string(OSM_Pbf_Primitive *P, int32_t sid) {
+    if (sid < 0 || sid >= P->num_strings)
+        return "";
+    return (char *)P->strings[sid].data;
+}
+
+/* the tags of row i into tl, tl->data must have room for them */
+static void pbf_fill_tags(OSM_Pbf_Primitive *P, OSM_Pbf_Entities *E, uint32_t i,
+                          OSM_Tag_List *tl)
+{
+    uint32_t x, num = E->num_tags[i], start = E->tag_start[i];
+
+    tl->num = num;
+    for (x=0; x<num; x++) {
+        tl->data[x].key = pbf_string(P, P->keys[start + x]);
+        tl->data[x].val = pbf_string(P, P->vals[start + x]);
+    }
+}
+
+static OSM_Tag_List *pbf_tags(OSM_Pbf_Primitive *P, OSM_Pbf_Entities *E, uint32_t i) {
+    OSM_Tag_List *tl;
+    uint32_t num = E->num_tags[i];
+
+    if (num == 0)
+        return NULL;
+
+    tl       = malloc(sizeof(OSM_Tag_List));
+    tl->size = num;
+    tl->data = malloc(sizeof(OSM_Tag) * num);
+    pbf_fill_tags(P, E, i, tl);
+    return tl;
+}
+
+/* entry j of the member pool (refs, roles, types) */
+static void pbf_fill_member(OSM_Pbf_Primitive *P, uint32_t j, OSM_Rel_Member *m) {
+    m->ref = P->refs[j];
+    switch (P->types[j]) {
+        case RELATION__MEMBER_TYPE__NODE:
+            m->type = OSM_REL_MEMBER_TYPE_NODE;
+            break;
+        case RELATION__MEMBER_TYPE__WAY:
+            m->type = OSM_REL_MEMBER_TYPE_WAY;
+            break;
+        case RELATION__MEMBER_TYPE__RELATION:
+            m->type = OSM_REL_MEMBER_TYPE_RELATION;
+            // FIXME - relations in relations
+            break;
+        default:
+            m->type = OSM_REL_MEMBER_TYPE_UNKNOWN;
+            fprintf(stderr, "unknown relation member type %d\n", P->types[j]);
+            break;
+    }
+    m->role = pbf_string(P, P->roles[j]);
+}
+
+/* fills the metadata of row i */
+#define PBF_INFO(o, P, E, i) { \
+        (o)->version   = (E)->version[i]; \
+        (o)->changeset = (E)->changeset[i]; \
+        (o)->uid       = (E)->uid[i]; \
+        (o)->timestamp = (E)->timestamp[i] * ((P)->date_granularity / 1000); \
+        if ((E)->user_sid[i] >= 0) \
+            (o)->user = pbf_string(P, (E)->user_sid[i]); \
+        else (o)->user = ""; \
+    }
+
+/* no metadata, no tags: filled by PBF_FIELDS() if asked for */
+#define PBF_LAZY(o, l, blk, ent, i) { \
+        (o)->user      = ""; \
+        (o)->uid       = 0; \
+        (o)->version   = 0; \
+        (o)->changeset = 0; \
+        (o)->timestamp = 0; \
+        (o)->tags      = NULL; \
+        (o)->flags     = OSM_FLAG_VIEW|OSM_FLAG_LAZY; \
+        (o)->lazy      = (l); \
+        (l)->P         = (blk); \
+        (l)->E         = (ent); \
+        (l)->row       = (i); \
+        (l)->missing   = OSM_FIELD_ALL; \
+    }
+
+#define PBF_FIELDS(o, fields) { \
+        struct osm_lazy *l = (o)->lazy; \
+        int f; \
+        if (!((o)->flags & OSM_FLAG_LAZY)) \
+            return; \
+        f = (fields) & l->missing; \
+        if (f & OSM_FIELD_INFO) \
+            PBF_INFO(o, l->P, l->E, l->row); \
+        if (f & OSM_FIELD_TAGS) \
+            (o)->tags = pbf_tags(l->P, l->E, l->row); \
+        l->missing &= ~f; \
+        if (l->missing == 0) \
+            (o)->flags &= ~OSM_FLAG_LAZY; \
+    }
+
+/*
+   osm_node_fields() & co.: decode the fields of an OSM_FLAG_LAZY entity,
+   fields is a combination of OSM_FIELD_*. Does nothing for an entity
+   which isn't lazy (any more). Only valid in the filter callback.
+*/
+void osm_node_fields(OSM_Node *n, int fields) {
+    PBF_FIELDS(n, fields);
+}
+
+void osm_way_fields(OSM_Way *w, int fields) {
+    PBF_FIELDS(w, fields);
+}
+
+void osm_relation_fields(OSM_Relation *r, int fields) {
+    PBF_FIELDS(r, fields);
+}
+
+/*
+   pbf_filter_never: there is only a compiled filter and it can't match the
+   type (e.g. "@way & highway"), the entities are rejected without looking
+   at them, like a filter callback which always returns 0
+*/
+enum {
+    pbf_filter_none = 0,
+    pbf_filter_never,
+    pbf_filter_maybe
+};
+
+static int pbf_filter_state(OSM_Filter *f, int has_callback, uint32_t type) {
+    if (has_callback)
+        return pbf_filter_maybe;
+    if (f == NULL)
+        return pbf_filter_none;
+    return (f->types & type) ? pbf_filter_maybe : pbf_filter_never;
+}
+
+/*
+   in the passes where the id alone decides (no filter is called for the
+   entities which aren't members), the others are not even created. The
+   member sets are only read in these passes.
+*/
+static int pbf_node_needed(struct pbf_parse *S, uint64_t id) {
+    if (S->mode == OSMDATA_NODE && S->node_fstate != pbf_filter_maybe)
+        return osm_id_bitmap_has(S->mem_nodes, id);
+    if (S->mode == OSMDATA_BBOX && S->bbox_state == bbox_nodes_find)
+        return osm_id_bitmap_has(S->mem_nodes, id)
+            || (S->node_fstate != pbf_filter_never && osm_id_bitmap_has(S->bbn, id));
+    return S->node_fstate != pbf_filter_never;
+}
+
+static int pbf_way_needed(struct pbf_parse *S, uint64_t id) {
+    if (S->mode == OSMDATA_WAY && S->way_fstate != pbf_filter_maybe)
+        return osm_id_set_has(S->mem_ways, id);
+    if (S->mode == OSMDATA_BBOX && S->way_fstate == pbf_filter_never)
+        return osm_id_set_has(S->mem_ways, id);
+    return S->way_fstate != pbf_filter_never;
+}
+
+/*
+   the compiled filter on the undecoded row, 0 if the entity can be
+   dropped right away: the filter doesn't take it and it's not a member
+   which is kept anyway. The callbacks can't take it either, they're
+   and'ed with the filter.
+*/
+static int pbf_filter_row(struct pbf_parse *S, OSM_Pbf_Primitive *P,
+                          OSM_Pbf_Entities *E, uint32_t type, uint32_t k)
+{
+    if (S->filter == NULL || osm_filter_pbf_row(S->filter, P, E, type, k))
+        return 1;
+    if (type == OSMDATA_NODE)
+        return S->mem_nodes != NULL && osm_id_bitmap_has(S->mem_nodes, E->id[k]);
+    if (type == OSMDATA_WAY)
+        return S->mem_ways != NULL && osm_id_set_has(S->mem_ways, E->id[k]);
+    return 0;
+}
+
+static int pbf_decode_nodes(struct pbf_parse *S, OSM_Pbf_Primitive *P,
+                            OSM_Pbf_Group *G, struct pbf_entity_list *E)
+{
+    OSM_Pbf_Entities *N = &P->nodes;
+    double lat_offset  = NANO_DEGREE * P->lat_offset;
+    double lon_offset  = NANO_DEGREE * P->lon_offset;
+    double granularity = NANO_DEGREE * P->granularity;
+    uint32_t k, *rows;
+    int num;
+
+    /* only the ids of the nodes inside are needed */
+    if (S->bbox_state == bbox_nodes_in_box) {
+        num = osm_pbf_nodes_in_box(P, G, S->bbox, &rows);
+        if (num < 0)
+            return -1;
+        for (k = 0; k < num; k++) {
+            struct pbf_entity *e = pbf_add_entity(E, OSMDATA_BBOX);
+            if (e == NULL)
+                return -1;
+            e->u.id = N->id[rows[k]];
+            if (debug)
+                fprintf(stderr, "NODE %lu (%.7f, %.7f) is in bbox\n", N->id[rows[k]],
+                                lon_offset + (N->lon[rows[k]] * granularity),
+                                lat_offset + (N->lat[rows[k]] * granularity));
+        }
+        return 0;
+    }
+
+    /*
+       the cheap checks first, the metadata and tags are decoded only for
+       the nodes which are created: here in the worker thread, or with
+       OSMDATA_LAZY when the filter or pbf_apply_node() asks for them
+    */
+    for (k = G->start; k < G->end; k++) {
+        struct pbf_lazy_node *ln;
+        struct pbf_entity *e;
+        OSM_Node *n;
+
+        if (!pbf_node_needed(S, N->id[k])
+            || !pbf_filter_row(S, P, N, OSMDATA_NODE, k))
+            continue;
+
+        ln = malloc(sizeof(struct pbf_lazy_node));
+        n  = &ln->n;
+        n->id  = N->id[k];
+        n->lat = lat_offset + (N->lat[k] * granularity);
+        n->lon = lon_offset + (N->lon[k] * granularity);
+        PBF_LAZY(n, &ln->lazy, P, N, k);
+        if (!S->lazy)
+            osm_node_fields(n, OSM_FIELD_ALL);
+        if ((e = pbf_add_entity(E, OSMDATA_NODE)) == NULL) {
+            osm_free_node(n);
+            return -1;
+        }
+        e->u.node = n;
+    }
+    return 0;
+}
+
+static int pbf_decode_ways(struct pbf_parse *S, OSM_Pbf_Primitive *P,
+                            OSM_Pbf_Group *G, struct pbf_entity_list *E)
+{
+    OSM_Pbf_Entities *W = &P->ways;
+    uint32_t k, l;
+
+    for (k = G->start; k < G->end; k++) {
+        struct pbf_lazy_way *lw;
+        struct pbf_entity *e;
+        OSM_Way *way;
+        uint32_t n_refs = W->num_refs[k];
+        int64_t *refs   = P->refs + W->ref_start[k];
+
+        if (!pbf_way_needed(S, W->id[k])
+            || !pbf_filter_row(S, P, W, OSMDATA_WAY, k))
+            continue;
+
+        lw  = malloc(sizeof(struct pbf_lazy_way));
+        way = &lw->w;
+        way->id = W->id[k];
+
+        way->nodes = malloc(sizeof(uint64_t)*(n_refs+1));
+        way->nodes[n_refs] = 0;
+        for (l = 0; l < n_refs; l++)
+            way->nodes[l] = refs[l];
+
+        PBF_LAZY(way, &lw->lazy, P, W, k);
+        if (!S->lazy)
+            osm_way_fields(way, OSM_FIELD_ALL);
+        if ((e = pbf_add_entity(E, OSMDATA_WAY)) == NULL) {
+            osm_free_way(way);
+            return -1;
+        }
+        e->u.way = way;
+    }
+    return 0;
+}
+
+static int pbf_decode_relations(struct pbf_parse *S, OSM_Pbf_Primitive *P,
+                                 OSM_Pbf_Group *G, struct pbf_entity_list *E)
+{
+    OSM_Pbf_Entities *R = &P->relations;
+    uint32_t k, l;
+
+    /* no relation can pass the filter, in any mode */
+    if (S->rel_fstate == pbf_filter_never)
+        return 0;
+
+    for (k = G->start; k < G->end; k++) {
+        struct pbf_lazy_rel *lr;
+        struct pbf_entity *e;
+        OSM_Relation *rel;
+        uint32_t n_memids = R->num_refs[k];
+        uint32_t start    = R->ref_start[k];
+
+        if (!pbf_filter_row(S, P, R, OSMDATA_REL, k))
+            continue;
+
+        lr  = malloc(sizeof(struct pbf_lazy_rel));
+        rel = &lr->r;
+        rel->id = R->id[k];
+
+        if (n_memids == 0) {
+            rel->member = NULL;
+        }
+        else {
+            rel->member = malloc(sizeof(OSM_Rel_Member_List));
+            rel->member->num = n_memids;
+            rel->member->size = n_memids;
+            rel->member->data = malloc(sizeof(OSM_Rel_Member) * n_memids);
+            for (l=0; l<n_memids; l++)
+                pbf_fill_member(P, start + l, &rel->member->data[l]);
+        }
+        PBF_LAZY(rel, &lr->lazy, P, R, k);
+        if (!S->lazy)
+            osm_relation_fields(rel, OSM_FIELD_ALL);
+        if ((e = pbf_add_entity(E, OSMDATA_REL)) == NULL) {
+            osm_free_relation(rel);
+            return -1;
+        }
+        e->u.rel = rel;
+    }
+    return 0;
+}
+
+/* the entity types needed in the current pass */
+static uint32_t pbf_pass_types(struct pbf_parse *S) {
+    if (S->mode & OSMDATA_DUMP)
+        return OSMDATA_NODE|OSMDATA_WAY|OSMDATA_REL;
+    if (S->mode == OSMDATA_BBOX) {
+        switch (S->bbox_state) {
+            case bbox_nodes_in_box:
+            case bbox_nodes_find:
+                return OSMDATA_NODE;
+            case bbox_way_find:
+                return OSMDATA_WAY;
+            case bbox_rel_find:
+                return OSMDATA_REL;
+        }
+        return 0;
+    }
+    return S->mode & (OSMDATA_NODE|OSMDATA_WAY|OSMDATA_REL);
+}
+
+/*
+   0 if the compiled filter can't take any entity of types in the block
+   (see osm_filter_pbf_may_match()) and no members are kept without the
+   filter in this pass, i.e. the groups don't need to be decoded. The
+   member sets are only read in the passes they're not written in.
+*/
+static int pbf_block_wanted(struct pbf_parse *S, OSM_Pbf_Primitive *P, uint32_t types) {
+    if (S->bbox_state == bbox_nodes_in_box)
+        return 1;
+    if (osm_filter_pbf_may_match(S->filter, P, types))
+        return 1;
+    if ((types & OSMDATA_NODE) && S->mem_nodes != NULL && S->mem_nodes->num)
+        return 1;
+    if ((types & OSMDATA_WAY) && S->mem_ways != NULL && S->mem_ways->num)
+        return 1;
+    return 0;
+}
+
+/*
+   runs in the worker threads: uncompress and decode the block and convert
+   the entities needed in this pass. No filter callbacks are called here,
+   the compiled filter only drops the entities it can't take.
+*/
+static int pbf_decode(OSM_Pbf_Block *b, void *ctx) {
+    struct pbf_parse *S = ctx;
+    struct pbf_entity_list *E = b->data;
+    unsigned char *uncompressed;
+    uint32_t raw_size;
+    OSM_Pbf_Primitive *P;
+    unsigned int j;
+    uint32_t types = pbf_pass_types(S);
+
+    if (E == NULL) {
+        E = malloc(sizeof(struct pbf_entity_list));
+        if (E == NULL) {
+            fprintf(stderr, "failed to malloc entity list: %s\n", strerror(errno));
+            return -1;
+        }
+        E->size = 8192;
+        E->data = malloc(sizeof(struct pbf_entity) * E->size);
+        if (E->data == NULL) {
+            fprintf(stderr, "failed to malloc entity list: %s\n", strerror(errno));
+            free(E);
+            return -1;
+        }
+        b->data = E;
+    }
+    E->num = 0;
+
+    uncompressed = osm_pbf_inflate(&b->inflate, b->blob, b->blob_len, &raw_size);
+    if (uncompressed == NULL)
+        return -1;
+
+    /* nothing for this pass in here, don't bother unpacking it */
+    if (!(osm_pbf_block_types(uncompressed, raw_size) & types))
+        return 0;
+
+    /* the string table first, it may tell that nothing in here matches */
+    P = &b->primitive;
+    if (osm_pbf_decode_strings(P, uncompressed, raw_size) != 0)
+        return -1;
+    if (S->filter != NULL) {
+        if (osm_filter_pbf_strings(S->filter, P) != 0)
+            return -1;
+        if (!pbf_block_wanted(S, P, types))
+            return 0;
+    }
+    if (osm_pbf_decode_groups(P, uncompressed, raw_size) != 0)
+        return -1;
+
+    for (j = 0; j < P->num_groups; j++) {
+        OSM_Pbf_Group *G = &P->groups[j];
+
+        if (G->type & types) {
+            switch (G->type) {
+                case OSMDATA_NODE:
+                    if (pbf_decode_nodes(S, P, G, E) != 0)
+                        return -1;
+                    break;
+                case OSMDATA_WAY:
+                    if (pbf_decode_ways(S, P, G, E) != 0)
+                        return -1;
+                    break;
+                case OSMDATA_REL:
+                    if (pbf_decode_relations(S, P, G, E) != 0)
+                        return -1;
+                    break;
+            }
+        }
+    }
+    return 0;
+}
+
+static int pbf_apply_node(struct pbf_parse *S, OSM_Node *n) {
+    uint32_t mode = S->mode;
+
+    if (mode == OSMDATA_BBOX) {
+        if (S->bbox_state == bbox_nodes_find) {
+            if (!osm_id_bitmap_has(S->mem_nodes, n->id)) {
+                if (!osm_id_bitmap_has(S->bbn, n->id)) {
+                    osm_free_node(n);
+                    return 0;
+                }
+                else {
+                    if (!osm_filter_take_node(S->node_filter, S->filter, n)) {
+                        osm_free_node(n);
+                        return 0;
+                    }
+                }
+            }
+
+            if (debug)
+                fprintf(stderr, "NODE %lu (%.7f, %.7f) is needed\n", n->id, n->lon, n->lat);
+        }
+    }
+    else {
+        if (mode == OSMDATA_NODE && S->node_fstate != pbf_filter_none) {
+            if (!osm_id_bitmap_has(S->mem_nodes, n->id)
+                &&
+                !osm_filter_take_node(S->node_filter, S->filter, n))
+                {
+                    osm_free_node(n);
+                    return 0;
+                }
+        }
+        else if (mode == OSMDATA_NODE
+                    &&
+                 !osm_id_bitmap_has(S->mem_nodes, n->id))
+        {
+                osm_free_node(n);
+                return 0;
+        }
+        else if (!osm_filter_take_node(S->node_filter, S->filter, n))
+        {
+            osm_free_node(n);
+            return 0;
+        }
+    }
+    osm_node_fields(n, OSM_FIELD_ALL);
+    if (S->cols != NULL) {
+        int ret = osm_node_columns_add(S->cols, n);
+        osm_free_node(n);
+        return ret;
+    }
+    if (S->arena != NULL)
+        n = osm_arena_node(S->arena, n);
+    else
+        osm_keep_node(n);
+    osm_realloc_node_list(S->data->nodes);
+    S->data->nodes->data[ S->data->nodes->num ] = n;
+    S->data->nodes->num += 1;
+    return 0;
+}
+
+static int pbf_apply_way(struct pbf_parse *S, OSM_Way *way) {
+    uint32_t mode = S->mode;
+    uint32_t n_refs = 0;
+
+    while (way->nodes[n_refs])
+        ++n_refs;
+
+    if (S->bbox_state == bbox_way_find) {
+        int b = 0;
+        int bbox_member = 0;
+        for (b=0; b<n_refs; b++) {
+            if (osm_id_bitmap_has(S->bbn, way->nodes[b])) {
+                if (osm_filter_take_way(S->way_filter, S->filter, way)) {
+                    if (debug)
+                        fprintf(stderr, "way %lu: member %lu is in bbox\n",
+                                        way->id, way->nodes[b]);
+                    bbox_member = 1;
+                    break;
+                }
+            }
+        }
+        if (bbox_member == 0 && !osm_id_set_has(S->mem_ways, way->id)) {
+            osm_free_way(way);
+            return 0;
+        }
+    }
+    else {
+        if (mode == OSMDATA_WAY && S->way_fstate != pbf_filter_none) {
+            if (!osm_id_set_has(S->mem_ways, way->id)
+                &&
+                !osm_filter_take_way(S->way_filter, S->filter, way))
+                {
+                    osm_free_way(way);
+                    return 0;
+                }
+        }
+        else if (mode == OSMDATA_WAY
+                    &&
+                 !osm_id_set_has(S->mem_ways, way->id))
+        {
+                osm_free_way(way);
+                return 0;
+        }
+        else if (!osm_filter_take_way(S->way_filter, S->filter, way))
+        {
+            osm_free_way(way);
+            return 0;
+        }
+    }
+    if (S->mem_nodes != NULL) {
+        int b;
+        for (b=0; b<n_refs; b++) {
+            if (osm_id_bitmap_add(S->mem_nodes, way->nodes[b]) < 0) {
+                osm_free_way(way);
+                return -1;
+            }
+        }
+    }
+    if (debug)
+        fprintf(stderr, "adding % 6d members to way=%lu list\n", (int)n_refs, way->id);
+    osm_way_fields(way, OSM_FIELD_ALL);
+    if (S->arena != NULL)
+        way = osm_arena_way(S->arena, way);
+    else
+        osm_keep_way(way);
+    osm_realloc_way_list(S->data->ways);
+    S->data->ways->data[ S->data->ways->num ] = way;
+    S->data->ways->num += 1;
+    return 0;
+}
+
+static int pbf_apply_relation(struct pbf_parse *S, OSM_Relation *rel) {
+    int num = rel->member != NULL ? rel->member->num : 0;
+    OSM_Rel_Member *m;
+    int l;
+
+    if (S->bbox_state == bbox_rel_find) {
+        int bbox_member = 0;
+        for (l=0; l<num; l++) {
+            m = &rel->member->data[l];
+            if (m->type == OSM_REL_MEMBER_TYPE_NODE && osm_id_bitmap_has(S->bbn, m->ref)) {
+                if (osm_filter_take_relation(S->rel_filter, S->filter, rel)) {
+                    if (debug)
+                        fprintf(stderr, "rel %lu: member %lu is in bbox\n",
+                                            rel->id, m->ref);
+                    bbox_member = 1;
+                    break;
+                }
+            }
+        }
+        if (bbox_member == 0) {
+            osm_free_relation(rel);
+            return 0;
+        }
+    }
+    else {
+        if (!osm_filter_take_relation(S->rel_filter, S->filter, rel)) {
+            osm_free_relation(rel);
+            return 0;
+        }
+    }
+
+    for (l=0; l<num; l++) {
+        int ret = 0;
+        m = &rel->member->data[l];
+        if (m->type == OSM_REL_MEMBER_TYPE_NODE && S->mem_nodes != NULL)
+            ret = osm_id_bitmap_add(S->mem_nodes, m->ref);
+        else if (m->type == OSM_REL_MEMBER_TYPE_WAY && S->mem_ways != NULL)
+            ret = osm_id_set_add(S->mem_ways, m->ref);
+        if (ret < 0) {
+            osm_free_relation(rel);
+            return -1;
+        }
+    }
+
+    osm_relation_fields(rel, OSM_FIELD_ALL);
+    if (S->arena != NULL)
+        rel = osm_arena_relation(S->arena, rel);
+    else
+        osm_keep_relation(rel);
+    osm_realloc_rel_list(S->data->relations);
+    S->data->relations->data[ S->data->relations->num ] = rel;
+    S->data->relations->num += 1;
+    return 0;
+}
+
+/* runs in the calling thread, in file order: filters and member lists */
+static int pbf_apply(OSM_Pbf_Block *b, void *ctx) {
+    struct pbf_parse *S = ctx;
+    struct pbf_entity_list *E = b->data;
+    uint32_t i;
+
+    for (i = 0; i < E->num; i++) {
+        switch (E->data[i].type) {
+            case OSMDATA_NODE:
+                if (pbf_apply_node(S, E->data[i].u.node) != 0) {
+                    pbf_drop_entities(E, i + 1);
+                    return -1;
+                }
+                break;
+            case OSMDATA_WAY:
+                if (pbf_apply_way(S, E->data[i].u.way) != 0) {
+                    pbf_drop_entities(E, i + 1);
+                    return -1;
+                }
+                break;
+            case OSMDATA_REL:
+                if (pbf_apply_relation(S, E->data[i].u.rel) != 0) {
+                    pbf_drop_entities(E, i + 1);
+                    return -1;
+                }
+                break;
+            case OSMDATA_BBOX:
+                if (osm_id_bitmap_add(S->bbn, E->data[i].u.id) < 0) {
+                    pbf_drop_entities(E, i + 1);
+                    return -1;
+                }
+                break;
+        }
+    }
+    E->num = 0;
+    return 0;
+}
+
+/*
+   with a block index: skip the blocks that can't contain anything for this
+   pass. Node and way passes after a relation / way pass without a filter
+   only need the blocks with one of the collected ids.
+*/
+static int pbf_want(OSM_Pbf_Index_Entry *e, void *ctx) {
+    struct pbf_parse *S = ctx;
+
+    if (S->mode & OSMDATA_DUMP)
+        return 1;
+
+    if (S->mode == OSMDATA_BBOX) {
+        switch (S->bbox_state) {
+            case bbox_nodes_in_box:
+                return osm_pbf_index_in_bbox(e, S->bbox);
+            case bbox_rel_find:
+                return e->types & OSMDATA_REL;
+            case bbox_way_find:
+                return e->types & OSMDATA_WAY;
+            case bbox_nodes_find:
+                return osm_pbf_index_in_bbox(e, S->bbox)
+                    || ((e->types & OSMDATA_NODE)
+                        && osm_id_bitmap_has_range(S->mem_nodes, e->min_id, e->max_id));
+        }
+        return 1;
+    }
+
+    if (S->mode == OSMDATA_NODE) {
+        if (!(e->types & OSMDATA_NODE))
+            return 0;
+        return S->node_fstate == pbf_filter_maybe
+            || osm_id_bitmap_has_range(S->mem_nodes, e->min_id, e->max_id);
+    }
+    if (S->mode == OSMDATA_WAY) {
+        if (!(e->types & OSMDATA_WAY))
+            return 0;
+        return S->way_fstate == pbf_filter_maybe
+            || osm_id_set_has_range(S->mem_ways, e->min_id, e->max_id);
+    }
+    if (S->mode == OSMDATA_REL)
+        return (e->types & OSMDATA_REL) && S->rel_fstate != pbf_filter_never;
+    return 1;
+}
+
+OSM_Data *osm_pbf_parse(OSM_File *F,
+              uint32_t mode,
               OSM_BBox *bbox,
               int (*node_filter)(OSM_Node *),
               int (*way_filter)(OSM_Way *),
@@ -33,26 +845,20 @@ OSM_Data *osm_pbf_parse(OSM_File *F,
               int (*cset_filter)(OSM_Changeset *) */
         )
 {
-    uint32_t length;
-    BlobHeader *bh = NULL;
-    Blob      *blob = NULL;
-    struct osm_members *mem_nodes = NULL;
-    struct osm_members *mem_ways  = NULL;
-    struct osm_members *bbn = NULL;
-    enum {
-        osm_pbf_initializer,
-        osm_pbf_header,
-        osm_pbf_data
-    } state = osm_pbf_initializer;
-
-    enum {
-        bbox_no_bbox,
-        bbox_nodes_in_box,
-        bbox_rel_find,
-        bbox_way_find,
-        bbox_nodes_find
-    } bbox_state = bbox_no_bbox;
-   
+    struct pbf_parse S;
+    OSM_Pbf_Handler handler;
+    OSM_Id_Bitmap *mem_nodes = NULL;
+    OSM_Id_Set *mem_ways  = NULL;
+    OSM_Id_Bitmap *bbn = NULL;
+    OSM_Arena *arena = NULL;
+    int use_arena = mode & OSMDATA_ARENA;
+    int use_cols  = mode & OSMDATA_COLUMNS;
+    int use_lazy  = mode & OSMDATA_LAZY;
+    int bbox_state = bbox_no_bbox;
+    int done = 0;
+
+    mode &= ~(OSMDATA_ARENA|OSMDATA_COLUMNS|OSMDATA_LAZY);
+
     if (mode == 0) {
         fprintf(stderr, "mode cannot be 0...\n");
         return (OSM_Data *)NULL;
@@ -81,676 +887,383 @@ OSM_Data *osm_pbf_parse(OSM_File *F,
     data->ways->num = 0;
     data->ways->size = 65536;
     data->ways->data = malloc(sizeof(OSM_Way) * 65536);
-   
+
     data->relations = malloc(sizeof(OSM_Relation_List));
     data->relations->num = 0;
     data->relations->size = 65536;
     data->relations->data = malloc(sizeof(OSM_Relation) * 65536);
 
+    if (use_arena)
+        arena = osm_arena_new(0);
+    data->arena = arena;
+    data->node_cols = use_cols ? osm_node_columns_new() : NULL;
+
     if (mode != OSMDATA_DUMP) {
-        mem_nodes = malloc(sizeof(struct osm_members));
-        mem_nodes->data = malloc(sizeof(uint64_t) * 65536);
-        mem_nodes->num  = 0;
-        mem_nodes->size = 65536;
-        mem_ways = malloc(sizeof(struct osm_members));
-        mem_ways->data = malloc(sizeof(uint64_t) * 65536);
-        mem_ways->num  = 0;
-        mem_ways->size = 65536;
-    }
-
-    bbn = malloc(sizeof(struct osm_members));
-    bbn->data = malloc(sizeof(uint64_t) * 65536);    
-    bbn->size = 65536;
-    bbn->num  = 0;
-
-  restart:
-    while (1) {
-        length = osm_pbf_bh_length(F);
-        if (length <= 0 || length > MAX_BLOCK_HEADER_SIZE) {
-            if (length == -1) { /* @EOF */
-                if (mode & (OSMDATA_DUMP|OSMDATA_NODE)) {
-                    if (debug)
-                        fprintf(stderr, "all parsing done.\n");
-                    return data;
-                }
+        mem_nodes = osm_id_bitmap_new();
+        mem_ways  = osm_id_set_new();
+    }
+    if (mode == OSMDATA_BBOX)
+        bbn = osm_id_bitmap_new();
 
-                if (mode & (OSMDATA_WAY|OSMDATA_REL)) {
-                    fseek(F->file, 0, SEEK_SET);
-                    osm_sort_member(mem_ways);
-                    osm_sort_member(mem_nodes);
-                    if (mode == OSMDATA_REL) {
-                        if (debug) 
-                            fprintf(stderr, "parsing relations done: %u, %u, %u.\n",
-                                             data->relations->num, mem_ways->num, mem_nodes->num);
-                        
-                        mode = OSMDATA_WAY;
-                    }
-                    else if (mode == OSMDATA_WAY) {
-                        if (debug) 
-                            fprintf(stderr, "parsing ways done: %u, n=%u\n",
-                                            data->ways->num, mem_nodes->num);
-                        mode = OSMDATA_NODE;
-                    }
-                    goto restart;
-                }
-                else if (mode == OSMDATA_BBOX) {
-                    fseek(F->file, 0, SEEK_SET);
-                    switch (bbox_state) {
-                        case bbox_nodes_find:
-                            if (debug)
-                                fprintf(stderr, "nodes: %d\n", data->nodes->num);
-                            return data;
-                            break;
-                        case bbox_way_find:
-                            if (debug)
-                                fprintf(stderr, "way members: %u\n", mem_ways->num);
-                            bbox_state = bbox_nodes_find;
-                            break;            
-                        case bbox_rel_find:
-                            if (debug)
-                                fprintf(stderr, "rel members: ways=%u, nodes=%u\n", mem_ways->num, mem_nodes->num);
-                            bbox_state = bbox_way_find;
-                            break;            
-                        case bbox_nodes_in_box:
-                            bbox_state = bbox_rel_find;
-                            osm_sort_member(bbn);
-                            if (debug)
-                                fprintf(stderr, "Nodes in BBOX: %d\n", bbn->num);
-                            break;
-                        default:
-                            fprintf(stderr, "mode = OSMDATA_BBOX, but state "
-                                            "is bbox_no_bbox\n");
-                            exit(1);
-                            break;
-                    }
-                    goto restart;
-                } 
-            }
+    S.mode        = mode;
+    S.bbox_state  = bbox_state;
+    S.bbox        = bbox;
+    S.node_filter = node_filter;
+    S.way_filter  = way_filter;
+    S.rel_filter  = rel_filter;
+    S.filter      = F->filter;
+    S.node_fstate = pbf_filter_state(F->filter, node_filter != NULL, OSMDATA_NODE);
+    S.way_fstate  = pbf_filter_state(F->filter, way_filter  != NULL, OSMDATA_WAY);
+    S.rel_fstate  = pbf_filter_state(F->filter, rel_filter  != NULL, OSMDATA_REL);
+    S.mem_nodes   = mem_nodes;
+    S.mem_ways    = mem_ways;
+    S.bbn         = bbn;
+    S.data        = data;
+    S.arena       = arena;
+    S.cols        = data->node_cols;
+    S.lazy        = use_lazy;
 
-            fprintf(stderr, "Block Header isn't present or exceeds "
-                            "minimum/maximum size: %u\n", length);
-            return (OSM_Data *)NULL;
+    handler.decode    = pbf_decode;
+    handler.apply     = pbf_apply;
+    handler.free_data = pbf_free_entities;
+    handler.want      = pbf_want;
+    handler.ctx       = &S;
+
+    while (!done) {
+        if (osm_pbf_run(F, &handler) != 0) {
+            osm_free_data(data);
+            data = NULL;
+            break;
         }
 
-        bh = osm_pbf_get_bh(F, length);
-        length = bh->datasize;
-        if (length <= 0 || length > MAX_BLOB_SIZE) {
-            fprintf(stderr, "Blob isn't present or exceeds "
-                            "minimum/maximum size\n");
-            return (OSM_Data *)NULL;
+        /* @EOF */
+        if (S.mode & (OSMDATA_DUMP|OSMDATA_NODE)) {
+            if (debug)
+                fprintf(stderr, "all parsing done.\n");
+            done = 1;
+        }
+        else if (S.mode & (OSMDATA_WAY|OSMDATA_REL)) {
+            if (S.mode == OSMDATA_REL) {
+                if (debug)
+                    fprintf(stderr, "parsing relations done: %u, %lu, %lu.\n",
+                                     data->relations->num, mem_ways->num, mem_nodes->num);
+
+                S.mode = OSMDATA_WAY;
+            }
+            else if (S.mode == OSMDATA_WAY) {
+                if (debug)
+                    fprintf(stderr, "parsing ways done: %u, n=%lu\n",
+                                    data->ways->num, mem_nodes->num);
+                S.mode = OSMDATA_NODE;
+            }
         }
+        else if (S.mode == OSMDATA_BBOX) {
+            switch (S.bbox_state) {
+                case bbox_nodes_find:
+                    if (debug)
+                        fprintf(stderr, "nodes: %d\n", data->nodes->num);
+                    done = 1;
+                    break;
+                case bbox_way_find:
+                    if (debug)
+                        fprintf(stderr, "way members: %lu\n", mem_ways->num);
+                    S.bbox_state = bbox_nodes_find;
+                    break;
+                case bbox_rel_find:
+                    if (debug)
+                        fprintf(stderr, "rel members: ways=%lu, nodes=%lu\n", mem_ways->num, mem_nodes->num);
+                    S.bbox_state = bbox_way_find;
+                    break;
+                case bbox_nodes_in_box:
+                    S.bbox_state = bbox_rel_find;
+                    if (debug)
+                        fprintf(stderr, "Nodes in BBOX: %lu\n", bbn->num);
+                    break;
+                default:
+                    fprintf(stderr, "mode = OSMDATA_BBOX, but state "
+                                    "is bbox_no_bbox\n");
+                    exit(1);
+                    break;
+            }
+        }
+    }
+    osm_id_bitmap_free(mem_nodes);
+    osm_id_set_free(mem_ways);
+    osm_id_bitmap_free(bbn);
+    return data;
+}
+
+/*
+   osm_pbf_stream(): the workers only decode the blocks, the entities are
+   filled into the scratch structs below in the calling thread and handed
+   to the callbacks one by one, nothing is allocated per entity
+*/
+struct pbf_stream {
+    OSM_Stream_Handler *h;
+    uint32_t types;
+    int ret;                    /* of the callback which stopped us */
+    OSM_Node node;
+    OSM_Way way;
+    OSM_Relation rel;
+    OSM_Tag_List tags;
+    uint32_t size_nodes;
+    uint64_t *nodes;
+    OSM_Rel_Member_List member;
+};
+
+static OSM_Tag_List *pbf_stream_tags(struct pbf_stream *S, OSM_Pbf_Primitive *P,
+                                     OSM_Pbf_Entities *E, uint32_t i)
+{
+    uint32_t num = E->num_tags[i];
+
+    if (num == 0)
+        return NULL;
+    if (num > S->tags.size) {
+        S->tags.size = num * 2;
+        S->tags.data = realloc(S->tags.data, sizeof(OSM_Tag) * S->tags.size);
+    }
+    pbf_fill_tags(P, E, i, &S->tags);
+    return &S->tags;
+}
+
+static int pbf_stream_nodes(struct pbf_stream *S, OSM_Pbf_Primitive *P, OSM_Pbf_Group *G) {
+    OSM_Pbf_Entities *N = &P->nodes;
+    double lat_offset  = NANO_DEGREE * P->lat_offset;
+    double lon_offset  = NANO_DEGREE * P->lon_offset;
+    double granularity = NANO_DEGREE * P->granularity;
+    OSM_Node *n = &S->node;
+    uint32_t k;
 
-        if (strcmp(bh->type, "OSMHeader") == 0) {
-            state = osm_pbf_header;
+    for (k = G->start; k < G->end; k++) {
+        n->id  = N->id[k];
+        n->lat = lat_offset + (N->lat[k] * granularity);
+        n->lon = lon_offset + (N->lon[k] * granularity);
+        PBF_INFO(n, P, N, k);
+        n->tags  = pbf_stream_tags(S, P, N, k);
+        n->flags = OSM_FLAG_VIEW;
+        if ((S->ret = S->h->node(n, S->h->ctx)) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int pbf_stream_ways(struct pbf_stream *S, OSM_Pbf_Primitive *P, OSM_Pbf_Group *G) {
+    OSM_Pbf_Entities *W = &P->ways;
+    OSM_Way *way = &S->way;
+    uint32_t k, l;
+
+    for (k = G->start; k < G->end; k++) {
+        uint32_t n_refs = W->num_refs[k];
+        int64_t *refs   = P->refs + W->ref_start[k];
+
+        if (n_refs + 1 > S->size_nodes) {
+            S->size_nodes = (n_refs + 1) * 2;
+            S->nodes = realloc(S->nodes, sizeof(uint64_t) * S->size_nodes);
+        }
+        for (l = 0; l < n_refs; l++)
+            S->nodes[l] = refs[l];
+        S->nodes[n_refs] = 0;
+
+        way->id = W->id[k];
+        PBF_INFO(way, P, W, k);
+        way->nodes = S->nodes;
+        way->tags  = pbf_stream_tags(S, P, W, k);
+        way->flags = OSM_FLAG_VIEW;
+        if ((S->ret = S->h->way(way, S->h->ctx)) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int pbf_stream_relations(struct pbf_stream *S, OSM_Pbf_Primitive *P, OSM_Pbf_Group *G) {
+    OSM_Pbf_Entities *R = &P->relations;
+    OSM_Relation *rel = &S->rel;
+    uint32_t k, l;
+
+    for (k = G->start; k < G->end; k++) {
+        uint32_t n_memids = R->num_refs[k];
+        uint32_t start    = R->ref_start[k];
+
+        rel->id = R->id[k];
+        PBF_INFO(rel, P, R, k);
+
+        if (n_memids == 0) {
+            rel->member = NULL;
         }
-        else if (strcmp(bh->type, "OSMData") == 0) {
-            state = osm_pbf_data;
+        else {
+            if (n_memids > S->member.size) {
+                S->member.size = n_memids * 2;
+                S->member.data = realloc(S->member.data,
+                                         sizeof(OSM_Rel_Member) * S->member.size);
+            }
+            S->member.num = n_memids;
+            for (l=0; l<n_memids; l++)
+                pbf_fill_member(P, start + l, &S->member.data[l]);
+            rel->member = &S->member;
         }
-        osm_pbf_free_bh(bh);
+        rel->tags  = pbf_stream_tags(S, P, R, k);
+        rel->flags = OSM_FLAG_VIEW;
+        if ((S->ret = S->h->relation(rel, S->h->ctx)) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* runs in any thread, a block without wanted entities is left empty */
+static int pbf_stream_decode(OSM_Pbf_Block *b, void *ctx) {
+    struct pbf_stream *S = ctx;
+    unsigned char *uncompressed;
+    uint32_t raw_size;
 
-        unsigned char *uncompressed;
-        blob = osm_pbf_get_blob(F, length, &uncompressed);
+    b->primitive.num_groups = 0;
+    uncompressed = osm_pbf_inflate(&b->inflate, b->blob, b->blob_len, &raw_size);
+    if (uncompressed == NULL)
+        return -1;
+    if (!(osm_pbf_block_types(uncompressed, raw_size) & S->types))
+        return 0;
+    return osm_pbf_decode_primitive(&b->primitive, uncompressed, raw_size);
+}
+
+static int pbf_stream_apply(OSM_Pbf_Block *b, void *ctx) {
+    struct pbf_stream *S = ctx;
+    OSM_Pbf_Primitive *P = &b->primitive;
+    unsigned int j;
+    int ret = 0;
 
-        if (state == osm_pbf_header) {
+    for (j = 0; ret == 0 && j < P->num_groups; j++) {
+        OSM_Pbf_Group *G = &P->groups[j];
 
+        if (G->type & S->types) {
+            switch (G->type) {
+                case OSMDATA_NODE:
+                    ret = pbf_stream_nodes(S, P, G);
+                    break;
+                case OSMDATA_WAY:
+                    ret = pbf_stream_ways(S, P, G);
+                    break;
+                case OSMDATA_REL:
+                    ret = pbf_stream_relations(S, P, G);
+                    break;
+            }
         }
-        else if (state == osm_pbf_data) {
-            PrimitiveBlock *P = osm_pbf_unpack_data(blob, uncompressed);
-            double lat_offset  = NANO_DEGREE * P->lat_offset;
-            double lon_offset  = NANO_DEGREE * P->lon_offset;
-            double granularity = NANO_DEGREE * P->granularity;
+    }
+    if (ret == 0 && P->num_groups > 0 && S->h->block != NULL
+        && (S->ret = S->h->block(S->h->ctx)) != 0)
+        ret = -1;
+    return ret;
+}
 
-            unsigned int j;
-            for (j = 0; j < P->n_primitivegroup; j++) {
-                /* fprintf(stderr,"\t\t""Nodes: %li""\n"\
-                   "\t\t""Ways: %li""\n"\
-                   "\t\t""Relations: %li""\n",
-                   (P->primitivegroup[j]->dense ?
-                    P->primitivegroup[j]->dense->n_id :
-                           P->primitivegroup[j]->n_nodes),
-                   P->primitivegroup[j]->n_ways,
-                   P->primitivegroup[j]->n_relations); */
-                int k;
-                if (mode & (OSMDATA_DUMP|OSMDATA_NODE) 
-                    || (mode == OSMDATA_BBOX 
-                        && (bbox_state == bbox_nodes_in_box 
-                            || bbox_state == bbox_nodes_find)))
-                {
-                    if (P->primitivegroup[j]->n_nodes > 0) {
-                        for (k = 0; k < P->primitivegroup[j]->n_nodes; k++) {
-                            Node *node = P->primitivegroup[j]->nodes[k];
-
-                            OSM_Node *n = malloc(sizeof(OSM_Node));
-                            n->id = node->id;
-                            n->lat = lat_offset + (node->lat * granularity);
-                            n->lon = lon_offset + (node->lon * granularity);
-                            if (bbox_state == bbox_nodes_in_box) {
-                                if (n->lon    >= bbox->left_lon
-                                    && n->lon <= bbox->right_lon
-                                    && n->lat >= bbox->bottom_lat
-                                    && n->lat <= bbox->top_lat)
-                                {
-                                    uint64_t *mid = malloc(sizeof(uint64_t));
-                                    *mid = n->id;
-                                    osm_add_members(bbn, 1, mid, 0);
-                                    /* 
-                                    osm_realloc_bbox_nodes(bbn);
-                                    bbn->id[ bbn->num ] = n->id;
-                                    bbn->num += 1;
-                                    */
-                                    if (debug) 
-                                        fprintf(stderr, "NODE %lu (%.7f, %.7f) is in bbox\n", n->id, n->lon, n->lat);
-                                    free(n);
-                                    continue;
-                                }
-                            }
-                            if (node->info) {
-                                Info *I = node->info;
-                                if (I->has_version) 
-                                    n->version = I->version;
-                                else n->version = 0;
-                                if (I->has_changeset)
-                                    n->changeset = I->changeset;
-                                else n->changeset = 0;
-
-                                if (I->has_user_sid) {
-                        
-                                    ProtobufCBinaryData user = 
-                                        P->stringtable->s[I->user_sid];
-                                    n->user = strndup((const char *)user.data, user.len);
-                                }
-                                else n->user = strdup("");
-                                if (I->has_uid)
-                                    n->uid = I->uid;
-                                else n->uid = 0;
-                                if (I->has_timestamp) {
-                                    n->timestamp = I->timestamp * (P->date_granularity / 1000);
-                                } else n->timestamp = 0;
-                                
-                            } /* node->has_info */
-                            OSM_Tag_List *tl = NULL;
-                            if (node->n_keys && node->n_vals) {
-                                tl       = malloc(sizeof(OSM_Tag_List));
-                                tl->num  = node->n_keys;
-                                tl->size = node->n_keys;
-                                tl->data = malloc(sizeof(OSM_Tag) * node->n_keys);
-                                int x;
-                                for (x=0; x<node->n_keys; x++) {
-                                    ProtobufCBinaryData key = 
-                                        P->stringtable->s[node->keys[x]];
-                                    ProtobufCBinaryData val = 
-                                        P->stringtable->s[node->vals[x]];
-                                    tl->data[x].key = 
-                                                strndup((const char *)key.data, key.len);
-                                    tl->data[x].val =
-                                                strndup((const char *)val.data, val.len);
-                                }
-                            }
-                            n->tags = tl;
-                            if (mode == OSMDATA_BBOX) {
-                                if (bbox_state == bbox_nodes_find) {
-                                    if (osm_is_member(mem_nodes, n->id) == -1) {
-                                        if (osm_is_member(bbn, n->id) == -1) {
-                                            osm_free_node(n);
-                                            continue;
-                                        }
-                                        else {
-                                            if (node_filter != NULL && !node_filter(n)) {
-                                                osm_free_node(n);
-                                                continue;
-                                            }
-                                        }
-                                    }
- 
-                                    if (debug) 
-                                        fprintf(stderr, "NODE %lu (%.7f, %.7f) is needed\n", n->id, n->lon, n->lat);
-                                        
-                                }
-                            }
-                            else {
-                                if (mode == OSMDATA_NODE && node_filter != NULL) {
-                                    if ((osm_is_member(mem_nodes, n->id) == -1) 
-                                        && 
-                                        !node_filter(n))
-                                        {
-                                            osm_free_node(n);
-                                            continue;
-                                        }
-                                }
-                                else if (mode == OSMDATA_NODE
-                                            &&
-                                         osm_is_member(mem_nodes, n->id) == -1) 
-                                {
-                                        osm_free_node(n);
-                                        continue;
-                                }
-                                else if (node_filter != NULL && !node_filter(n))
-                                {
-                                    osm_free_node(n);
-                                    continue;
-                                }
-                            }
-                            osm_realloc_node_list(data->nodes);
-                            data->nodes->data[ data->nodes->num ] = n;
-                            data->nodes->num += 1;
-                            // osm_pbf_add_node(node_list, n);
-                        }
-                    } /* P->primitivegroup[j]->n_nodes > 0 */
-                    if (P->primitivegroup[j]->dense) {
-                        int l = 0;
-                        unsigned long int deltaid = 0;
-                        long int deltalat = 0;
-                        long int deltalon = 0;
-                        long int deltatimestamp = 0;
-                        long int deltachangeset = 0;
-                        long int deltauid = 0;
-                        long int deltauser_sid = 0;
-                        int k;
-                        DenseNodes *D = P->primitivegroup[j]->dense;
-
-                        for (k=0; k<D->n_id; k++) {
-                            deltaid  += D->id[k];
-                            deltalat += D->lat[k];
-                            deltalon += D->lon[k];
-
-                            OSM_Node *n = malloc(sizeof(OSM_Node));
-                            n->tags = NULL;
-                            n->id  = deltaid;
-                            n->lat = lat_offset + (deltalat * granularity);
-                            n->lon = lon_offset + (deltalon * granularity);
-                            n->user = "";
-                            n->timestamp = 0;
-                            n->version   = 0;
-                            n->uid       = 0;
-                            n->changeset = 0;
-                            if (D->denseinfo) {
-                                DenseInfo *I = D->denseinfo;
-                                deltatimestamp += I->timestamp[k];
-                                deltachangeset += I->changeset[k];
-                                deltauid       += I->uid[k];
-                                deltauser_sid  += I->user_sid[k];
-                                n->version   = I->version[k];
-                                n->changeset = deltachangeset;
-                                n->user = strndup((const char *)P->stringtable->s[deltauser_sid].data, P->stringtable->s[deltauser_sid].len);
-                                n->uid       = deltauid;
-                                n->timestamp = deltatimestamp * (P->date_granularity / 1000);
-                            }
-
-                            OSM_Tag_List *tl = NULL;
-                            if (l < D->n_keys_vals) {
-                                while (D->keys_vals[l] != 0 && l < D->n_keys_vals) {
-                                    if (tl == NULL) {
-                                        tl       = malloc(sizeof(OSM_Tag_List));
-                                        tl->num  = 0;
-                                        tl->size = 16;
-                                        tl->data = malloc(sizeof(OSM_Tag) * 16);
-                                    } 
-                                    else {
-                                        osm_realloc_tag_list(tl);
-                                    }
-                                    int o = D->keys_vals[l];
-                                    int p = D->keys_vals[l+1];
-                                    tl->data[tl->num].key = 
-                                        strndup((const char *)P->stringtable->s[o].data, P->stringtable->s[o].len);
-                                    tl->data[tl->num].val = 
-                                        strndup((const char *)P->stringtable->s[p].data, P->stringtable->s[p].len);
-                                    tl->num += 1;
-                                    l += 2;
-                                }
-                                l += 1;
-                            }
-                            n->tags = tl;
-
-                            if (mode == OSMDATA_BBOX) {
-                                if (bbox_state == bbox_nodes_in_box) {
-                                    if (   n->lat >= bbox->bottom_lat
-                                        && n->lat <= bbox->top_lat
-                                        && n->lon >= bbox->left_lon 
-                                        && n->lon <= bbox->right_lon) 
-                                    {
-
-                                        // if (node_filter == NULL
-                                        //     || node_filter(N))
-                                        {
-                                            uint64_t *mid
-                                                = malloc(sizeof(uint64_t));
-                                            *mid = n->id;
-                                            osm_add_members(bbn, 1, mid, 0);
-                                            if (debug) 
-                                                fprintf(stderr, "NODE %lu (%.7f, %.7f) is in bbox\n", n->id, n->lon, n->lat);
-                                        }
-                                    }
-                                    osm_free_node(n);
-                                    continue;
-                                }
-                                else if (bbox_state == bbox_nodes_find) {
-                                    if (osm_is_member(mem_nodes, n->id) == -1) {
-                                        if (osm_is_member(bbn, n->id) == -1) {
-                                            osm_free_node(n);
-                                            continue;
-                                        }
-                                        else {
-                                            if (node_filter != NULL && !node_filter(n)) {
-                                                osm_free_node(n);
-                                                continue;
-                                            }
-                                        }
-                                    }
-                                    
-                                    if (debug) 
-                                        fprintf(stderr, "NODE %lu (%.7f, %.7f) is needed\n", n->id, n->lon, n->lat);
-                                        
-                                }
-                            }
-                            else {
-                                if (mode == OSMDATA_NODE && node_filter != NULL)
-                                {
-                                    if ((osm_is_member(mem_nodes, n->id) == -1) 
-                                        && 
-                                        !node_filter(n))
-                                    {
-                                        osm_free_node(n);
-                                        continue;
-                                    }
-                                }
-                                else if (mode == OSMDATA_NODE
-                                            &&
-                                         osm_is_member(mem_nodes, n->id) == -1) 
-                                {
-                                        osm_free_node(n);
-                                        continue;
-                                }
-                                else if (node_filter != NULL && !node_filter(n))
-                                {
-                                    osm_free_node(n);
-                                    continue;
-                                }
-                            }
-                            osm_realloc_node_list(data->nodes);
-                            data->nodes->data[ data->nodes->num ] = n;
-                            data->nodes->num += 1;
-                        }
-                    } /* P->primitivegroup[j]->dense */
-                } /* mode == OSMDATA_DUMP || OSMDATA_NODE */
-
-                if (mode & (OSMDATA_DUMP|OSMDATA_WAY) 
-                    || (mode == OSMDATA_BBOX && bbox_state == bbox_way_find)) {
-                    if (P->primitivegroup[j]->n_ways > 0) {
-                        int k = 0;
-                        for (k = 0; k < P->primitivegroup[j]->n_ways; k++) {
-                            Way *W = P->primitivegroup[j]->ways[k];
-
-                            OSM_Way *way = malloc(sizeof(OSM_Way));
-                            uint64_t *ref = NULL;
-                            int l;
-                            way->id = W->id;
-                            if (W->info) {
-                                Info *I = W->info;
-                                if (I->has_version)
-                                    way->version = I->version;
-                                else way->version = 0;
-
-                                if (I->has_changeset)
-                                    way->changeset = I->changeset;
-                                else way->changeset = 0;
-
-                                if (I->has_user_sid) {
-                                    ProtobufCBinaryData user = 
-                                        P->stringtable->s[I->user_sid];
-                                    way->user = strndup((const char *)user.data, user.len);
-                                } else way->user = strdup("");
-
-                                if (I->has_uid)
-                                    way->uid = I->uid;
-                                else 
-                                    way->uid = 0;
-            
-                                if (I->has_timestamp)
-                                    way->timestamp = I->timestamp * (P->date_granularity / 1000);
-                                else way->timestamp = 0;
-                            }
-
-                            if (W->n_refs == 0) {
-                                way->nodes = malloc(sizeof(uint64_t));
-                                way->nodes[0] = 0;
-                            }
-                            else {
-                                ref = malloc(sizeof(uint64_t) * W->n_refs);
-                                long int deltaref = 0;
-                                way->nodes = malloc(sizeof(uint64_t)*(W->n_refs+1));
-                                way->nodes[W->n_refs] = 0;
-                                for (l = 0; l < W->n_refs; l++) {
-                                    deltaref += W->refs[l];
-                                    way->nodes[l] = deltaref;
-                                    ref[l] = deltaref;
-                                }
-                            }
-
-                            OSM_Tag_List *tl = NULL;
-                            if (W->n_keys > 0) {
-                                tl       = malloc(sizeof(OSM_Tag_List));
-                                tl->num  = W->n_keys;
-                                tl->size = W->n_keys;
-                                tl->data = malloc(sizeof(OSM_Tag) * W->n_keys);
-                            }
-                            for (l=0; l<W->n_keys; l++) {
-                                ProtobufCBinaryData key = 
-                                    P->stringtable->s[W->keys[l]];
-                                ProtobufCBinaryData val = 
-                                    P->stringtable->s[W->vals[l]];
-                                tl->data[l].key = 
-                                            strndup((const char *)key.data, key.len);
-                                tl->data[l].val =
-                                            strndup((const char *)val.data, val.len);
-                                // fprintf(stderr, "WAY=%lu, k='%s', v='%s'\n", W->id, tl->data[l].key, tl->data[l].val);
-                            }
-                            way->tags = tl;
-
-                            if (bbox_state == bbox_way_find) {
-                                int b = 0;
-                                int bbox_member = 0;
-                                for (b=0; b<W->n_refs; b++) {
-                                    if (osm_is_member(bbn, ref[b]) != -1) {
-                                        if (way_filter == NULL || way_filter(way)) {
-                                            if (debug) 
-                                                fprintf(stderr, "way %lu: member %lu is in bbox\n",
-                                                                W->id, ref[b]);
-                                            bbox_member = 1;
-                                            break;
-                                        }
-                                    }
-                                }
-                                if (bbox_member == 0 && osm_is_member(mem_ways, W->id) == -1) { 
-                                    osm_free_way(way);
-                                    free(ref);
-                                    continue;
-                                }
-                            }
-                            else {
-                                if (mode == OSMDATA_WAY && way_filter != NULL) {
-                                    if ((osm_is_member(mem_ways, W->id) == -1) 
-                                        && 
-                                        !way_filter(way))
-                                        {
-                                            osm_free_way(way);
-                                            free(ref);
-                                            continue;
-                                        }
-                                }
-                                else if (mode == OSMDATA_WAY
-                                            &&
-                                         osm_is_member(mem_ways, W->id) == -1) 
-                                {
-                                        osm_free_way(way);
-                                        free(ref);
-                                        continue;
-                                }
-                                else if (way_filter != NULL && !way_filter(way))
-                                {
-                                    osm_free_way(way);
-                                    free(ref);
-                                    continue;
-                                }
-                            }
-                            if (W->n_refs) 
-                                osm_add_members(mem_nodes, W->n_refs, ref, 0);
-                            if (debug)
-                                fprintf(stderr, "adding % 6d members to way=%lu list\n", (int)W->n_refs, W->id);
-                            osm_realloc_way_list(data->ways);
-                            data->ways->data[ data->ways->num ] = way;
-                            data->ways->num += 1;
-                        }
-                    } /* P->primitivegroup[j]->n_ways > 0 */
-                } /* mode == OSMDATA_DUMP || OSMDATA_WAY */
-
-                if (mode & (OSMDATA_DUMP|OSMDATA_REL) 
-                    || (mode == OSMDATA_BBOX && bbox_state == bbox_rel_find))
-                {
-                    if (P->primitivegroup[j]->n_relations > 0) {
-                        int k;
-                        for (k=0; k<P->primitivegroup[j]->n_relations; k++) {
-                            Relation *R = P->primitivegroup[j]->relations[k];
-                            OSM_Relation *rel = malloc(sizeof(OSM_Relation));
-                            
-                            rel->id = R->id;
-                            if (R->info) {
-                                Info *I = R->info;
-        
-                                if (I->has_version)
-                                    rel->version = I->version;
-                                else rel->version = 0;
-
-                                if (I->has_changeset)
-                                    rel->changeset = I->changeset;
-                                else rel->changeset = 0;
-
-                                if (I->has_user_sid) {
-                                    ProtobufCBinaryData user = 
-                                        P->stringtable->s[I->user_sid];
-                                    rel->user = strndup((const char *)user.data, user.len);
-                                } else rel->user = strdup("");
-
-                                if (I->has_uid)
-                                    rel->uid = I->uid;
-                                else 
-                                    rel->uid = 0;
-            
-                                if (I->has_timestamp)
-                                    rel->timestamp = I->timestamp * (P->date_granularity / 1000);
-                                else rel->timestamp = 0;
-                            }
-
-                            uint64_t *wref = NULL;
-                            uint64_t *nref = NULL;
-                            int num_wref = 0;
-                            int num_nref = 0;
-                            if (R->n_memids == 0) {
-                                rel->member = NULL;
-                            }
-                            else {
-                                long int deltamemids = 0;
-                                rel->member = malloc(sizeof(OSM_Rel_Member_List)); 
-                                rel->member->num = R->n_memids;
-                                rel->member->size = R->n_memids;
-                                rel->member->data = malloc(sizeof(OSM_Rel_Member) * R->n_memids); 
-                                wref = malloc(sizeof(uint64_t) * R->n_memids);
-                                nref = malloc(sizeof(uint64_t) * R->n_memids);
-                                int l;
-                                for (l=0; l<R->n_memids; l++) {
-                                    ProtobufCBinaryData role = 
-                                        P->stringtable->s[R->roles_sid[l]];
-                                    deltamemids += R->memids[l];
-                                    rel->member->data[l].ref = deltamemids;
-                                    // ref[l] = deltamemids;
-                                    switch (R->types[l]) {
-                                        case RELATION__MEMBER_TYPE__NODE:
-                                            rel->member->data[l].type = OSM_REL_MEMBER_TYPE_NODE;
-                                            nref[num_nref] = deltamemids;
-                                            ++num_nref; 
-                                            break;
-                                        case RELATION__MEMBER_TYPE__WAY:
-                                            rel->member->data[l].type = OSM_REL_MEMBER_TYPE_WAY;
-                                            wref[num_wref] = deltamemids;
-                                            ++num_wref; 
-                                            break;
-                                        case RELATION__MEMBER_TYPE__RELATION:
-                                            rel->member->data[l].type = OSM_REL_MEMBER_TYPE_RELATION;
-                                            // ref[l] = deltamemids; FIXME - relations in relations
-                                            break;
-                                        default:
-                                            fprintf(stderr, "unknown relation member type %d\n", R->types[l]);
-                                            break;
-                                    }
-                                    rel->member->data[l].role = strndup((const char *)role.data, role.len);
-                                }
-                            }
-                            OSM_Tag_List *tl = NULL;
-                            if (R->n_keys != 0) {
-                                tl       = malloc(sizeof(OSM_Tag_List));
-                                tl->num  = R->n_keys;
-                                tl->size = R->n_keys;
-                                tl->data = malloc(sizeof(OSM_Tag) * R->n_keys);
-                                int l;
-                                for (l=0; l<R->n_keys; l++) {
-                                    ProtobufCBinaryData key = 
-                                        P->stringtable->s[R->keys[l]];
-                                    ProtobufCBinaryData val = 
-                                        P->stringtable->s[R->vals[l]];
-                                    tl->data[l].key = 
-                                                strndup((const char *)key.data, key.len);
-                                    tl->data[l].val =
-                                                strndup((const char *)val.data, val.len);
-                                }
-                            }
-                            rel->tags = tl;
-                            
-                            if (bbox_state == bbox_rel_find) {
-                                int b = 0;
-                                int bbox_member = 0;
-                                for (b=0; b<num_nref; b++) {
-                                    if (osm_is_member(bbn, nref[b]) != -1) {
-                                        if (rel_filter == NULL || rel_filter(rel)) {
-                                            if (debug) 
-                                                fprintf(stderr, "rel %lu: member %lu is in bbox\n",
-                                                                    rel->id, nref[b]);
-                                            bbox_member = 1;
-                                            break;
-                                        }
-                                    }
-                                }
-                                if (bbox_member == 0) {
-                                    osm_free_relation(rel);
-                                    free(wref);
-                                    free(nref);
-                                    continue;
-                                }
-                            }
-                            else {
-                                if (rel_filter != NULL) {
-                                    if (!rel_filter(rel)) {
-                                        osm_free_relation(rel);
-                                        free(wref);
-                                        free(nref);
-                                        continue;
-                                    }
-                                }
-                            }
-
-                            if (num_nref)
-                                osm_add_members(mem_nodes, num_nref, nref, 1);
-                            if (num_wref)
-                                osm_add_members(mem_ways, num_wref, wref, 1);
-
-                            osm_realloc_rel_list(data->relations);
-                            data->relations->data[ data->relations->num ] = rel;
-                            data->relations->num += 1;
-                        }
-                    }
-                } /* mode == OSMDATA_DUMP || OSMDATA_REL */
-            } /* for (j = 0; j < P->n_primitivegroup; j++) */ 
-            osm_pbf_free_primitive(P);
+static int pbf_stream_want(OSM_Pbf_Index_Entry *e, void *ctx) {
+    struct pbf_stream *S = ctx;
+    return (e->types & S->types) != 0;
+}
+
+int osm_pbf_stream(OSM_File *F, OSM_Stream_Handler *h) {
+    struct pbf_stream S;
+    OSM_Pbf_Handler handler;
+    int ret;
+
+    memset(&S, 0, sizeof(S));
+    S.h = h;
+    if (h->node != NULL)
+        S.types |= OSMDATA_NODE;
+    if (h->way != NULL)
+        S.types |= OSMDATA_WAY;
+    if (h->relation != NULL)
+        S.types |= OSMDATA_REL;
+
+    handler.decode    = pbf_stream_decode;
+    handler.apply     = pbf_stream_apply;
+    handler.free_data = NULL;
+    handler.want      = pbf_stream_want;
+    handler.ctx       = &S;
+
+    ret = osm_pbf_run(F, &handler);
+    if (S.ret != 0)
+        ret = S.ret;
+
+    free(S.tags.data);
+    free(S.nodes);
+    free(S.member.data);
+    return ret;
+}
+
+/*
+   osm_pbf_xml(): the workers format their block into a buffer of the
+   slot, with the osm_pbf_stream() functions above, the calling thread
+   writes the buffers in file order
+*/
+struct pbf_xml_block {
+    struct pbf_stream  S;
+    OSM_Stream_Handler h;
+    OSM_Xml_Writer     X;       /* without outfh */
+};
+
+static int pbf_xml_node(OSM_Node *n, void *ctx) {
+    osm_xml_put_node((OSM_Xml_Writer *)ctx, n);
+    return ((OSM_Xml_Writer *)ctx)->failed ? -1 : 0;
+}
+
+static int pbf_xml_way(OSM_Way *w, void *ctx) {
+    osm_xml_put_way((OSM_Xml_Writer *)ctx, w);
+    return ((OSM_Xml_Writer *)ctx)->failed ? -1 : 0;
+}
+
+static int pbf_xml_relation(OSM_Relation *r, void *ctx) {
+    osm_xml_put_relation((OSM_Xml_Writer *)ctx, r);
+    return ((OSM_Xml_Writer *)ctx)->failed ? -1 : 0;
+}
+
+static void pbf_xml_free(void *data) {
+    struct pbf_xml_block *B = data;
+
+    free(B->S.tags.data);
+    free(B->S.nodes);
+    free(B->S.member.data);
+    free(B->X.data);
+    free(B);
+}
+
+/* runs in any thread */
+static int pbf_xml_decode(OSM_Pbf_Block *b, void *ctx) {
+    struct pbf_xml_block *B = b->data;
+
+    if (B == NULL) {
+        B = calloc(1, sizeof(struct pbf_xml_block));
+        if (B == NULL) {
+            fprintf(stderr, "failed to malloc XML block: %s\n", strerror(errno));
+            return -1;
         }
-        osm_pbf_free_blob(blob, uncompressed);
+        B->h.node     = pbf_xml_node;
+        B->h.way      = pbf_xml_way;
+        B->h.relation = pbf_xml_relation;
+        B->h.ctx      = &B->X;
+        B->S.h     = &B->h;
+        B->S.types = OSMDATA_NODE|OSMDATA_WAY|OSMDATA_REL;
+        b->data = B;
     }
-    return data;
+    B->X.len = 0;
+    if (pbf_stream_decode(b, &B->S) != 0 || pbf_stream_apply(b, &B->S) != 0)
+        return -1;
+    return 0;
+}
+
+static int pbf_xml_apply(OSM_Pbf_Block *b, void *ctx) {
+    struct pbf_xml_block *B = b->data;
+    OSM_Xml_Writer *X = ctx;
+
+    osm_xml_put_chunk(X, &B->X);
+    return X->failed ? -1 : 0;
+}
+
+/* all entities of F as XML to X, without header and footer */
+int osm_pbf_xml(OSM_File *F, OSM_Xml_Writer *X) {
+    OSM_Pbf_Handler handler;
+
+    handler.decode    = pbf_xml_decode;
+    handler.apply     = pbf_xml_apply;
+    handler.free_data = pbf_xml_free;
+    handler.want      = NULL;
+    handler.ctx       = X;
+    return osm_pbf_run(F, &handler);
 }
@@ -49,11 +49,10 @@ void osm_realloc_node_list(OSM_Node_List *n) {
     }
 }
 
-void osm_realloc_nodes(uint64_t *n, int num, int *size) {
-    int s = *size;
-    if ((float)num/(float)s > LIST_THRESHOLD) {
+void osm_realloc_nodes(uint64_t **n, int num, int *size) {
+    if ((float)num/(float)*size > LIST_THRESHOLD) {
         *size *= 2;
-        n = realloc(n, sizeof(uint64_t) * s);
+        *n = realloc(*n, sizeof(uint64_t) * *size);
     }
 }
 
@@ -0,0 +1,35 @@
+/*
+ * stream.c - hand every entity of a file to callbacks
+ *
+ * Unlike osm_parse() nothing is collected: osm_stream() calls the node(),
+ * way() and relation() callbacks of the handler for each entity in file
+ * order and the block() callback after each block (for .osm files after
+ * every OSM_STREAM_XML_BLOCK entities), so the memory use doesn't depend
+ * on the file size. Entity types with a NULL callback are skipped without
+ * decoding them.
+ *
+ * The entities and everything they point to are only valid inside the
+ * callback, copy what you need to keep. A callback
+ * returns 0 to go on, anything else stops the stream and is returned by
+ * osm_stream(). On errors -1 is returned.
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+
+#include <stdio.h>
+
+#include "osm.h"
+
+int osm_stream(OSM_File *F, OSM_Stream_Handler *h) {
+    if (F->type == OSM_FTYPE_PBF)
+        return osm_pbf_stream(F, h);
+    else if (F->type == OSM_FTYPE_XML)
+        return osm_xml_stream(F, h);
+
+    fprintf(stderr, "cannot stream unknown file type\n");
+    return -1;
+}
+
+/* END */
@@ -14,6 +14,11 @@
 # define _XOPEN_SOURCE
 #endif
 #include <time.h>
+#include <pthread.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define XML_X86_KERNELS 1
+# include <immintrin.h>
+#endif
 
 #include "osm.h"
 
@@ -40,54 +45,211 @@ char *osm_relmember_type(int id) {
     }
 }
 
-char *osm_encode_xml(char *src) {
-    char buffer[LINE_SIZE];
-    char *dest = buffer;
-    char *source = src;
-    memset(dest, '\0', LINE_SIZE);
-    while (*source) {
-        switch (*source) {
+/* the rest of osm_xml_plain_len() from i on, a byte at a time */
+static size_t xml_plain_len_c(const char *s, size_t i, size_t len) {
+    for (; i < len; i++) {
+        switch (s[i]) {
             case '&':
-                *dest = '&'; dest++;
-                *dest = 'a'; dest++;
-                *dest = 'm'; dest++;
-                *dest = 'p'; dest++;
-                *dest = ';'; dest++;
-                break;
-            case '"': 
-                *dest = '&'; dest++;
-                *dest = 'q'; dest++;
-                *dest = 'u'; dest++;
-                *dest = 'o'; dest++;
-                *dest = 't'; dest++;
-                *dest = ';'; dest++;
-                break;
+            case '"':
             case '<':
-                *dest = '&'; dest++;
-                *dest = 'l'; dest++;
-                *dest = 't'; dest++;
-                *dest = ';'; dest++;
-                break;
             case '>':
-                *dest = '&'; dest++;
-                *dest = 'g'; dest++;
-                *dest = 't'; dest++;
-                *dest = ';'; dest++;
-                break;
-            default:
-                *dest = *source; dest++;
-                break;
+                return i;
         }
-        source++;     
     }
-    *dest = '\0';
-    if (debug)
-        fprintf(stderr, "%s:%d:%s(): SRC='%s', DEST='%s'\n", 
-                         __FILE__, __LINE__, __FUNCTION__, src, buffer);
-    dest = buffer;
+    return len;
+}
+
+/*
+   the vector versions look at 16 (SSE2) or 32 (AVX2) bytes at a time:
+   x | 4 is '&' only for '&' and '"', x | 2 is '>' only for '<' and '>'
+*/
+static size_t xml_plain_len_sse2(const char *s, size_t len) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i amp4 = _mm_set1_epi8('&'), four = _mm_set1_epi8(4);
+    const __m128i gt2  = _mm_set1_epi8('>'), two  = _mm_set1_epi8(2);
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i m = _mm_or_si128(_mm_cmpeq_epi8(_mm_or_si128(v, four), amp4),
+                                 _mm_cmpeq_epi8(_mm_or_si128(v, two), gt2));
+        uint32_t bits = _mm_movemask_epi8(m);
+        if (bits)
+            return i + __builtin_ctz(bits);
+    }
+#endif
+    return xml_plain_len_c(s, i, len);
+}
+
+#ifdef XML_X86_KERNELS
+__attribute__((target("avx2")))
+static size_t xml_plain_len_avx2(const char *s, size_t len) {
+    const __m256i amp4 = _mm256_set1_epi8('&'), four = _mm256_set1_epi8(4);
+    const __m256i gt2  = _mm256_set1_epi8('>'), two  = _mm256_set1_epi8(2);
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i m = _mm256_or_si256(
+                        _mm256_cmpeq_epi8(_mm256_or_si256(v, four), amp4),
+                        _mm256_cmpeq_epi8(_mm256_or_si256(v, two), gt2));
+        uint32_t bits = _mm256_movemask_epi8(m);
+        if (bits)
+            return i + __builtin_ctz(bits);
+    }
+    return xml_plain_len_c(s, i, len);
+}
+#endif
+
+/* NULL until xml_kernels_init() ran, read atomically: called per string */
+static size_t (*xml_plain_len)(const char *s, size_t len) = NULL;
+static pthread_once_t xml_kernels_once = PTHREAD_ONCE_INIT;
+
+static void xml_kernels_init(void) {
+    size_t (*f)(const char *s, size_t len) = xml_plain_len_sse2;
+#ifdef XML_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        f = xml_plain_len_avx2;
+#endif
+    __atomic_store_n(&xml_plain_len, f, __ATOMIC_RELEASE);
+}
+
+/*
+   the length of the start of s (len bytes) without any of &"<>, len if
+   nothing needs to be escaped. AVX2 is picked at run time if the CPU has it.
+*/
+size_t osm_xml_plain_len(const char *s, size_t len) {
+    size_t (*f)(const char *s, size_t len) = __atomic_load_n(&xml_plain_len, __ATOMIC_ACQUIRE);
+
+    if (f == NULL) {
+        pthread_once(&xml_kernels_once, xml_kernels_init);
+        f = __atomic_load_n(&xml_plain_len, __ATOMIC_ACQUIRE);
+    }
+    return f(s, len);
+}
+
+/* the entity for one of &"<> */
+const char *osm_xml_entity(char c) {
+    switch (c) {
+        case '&':
+            return "&amp;";
+        case '"':
+            return "&quot;";
+        case '<':
+            return "&lt;";
+        default:
+            return "&gt;";
+    }
+}
+
+/*
+   src with &"<> as entities: src itself if there is nothing to escape,
+   else a malloc()ed copy, which the caller frees. NULL if out of memory.
+*/
+char *osm_encode_xml(char *src) {
+    size_t len = strlen(src), n = osm_xml_plain_len(src, len), extra = 0, i;
+    char *dest, *d;
+
+    if (n == len)
+        return src;
+    for (i = n; i < len; i++)
+        if (src[i] == '&' || src[i] == '"' || src[i] == '<' || src[i] == '>')
+            extra += strlen(osm_xml_entity(src[i])) - 1;
+    dest = malloc(len + extra + 1);
+    if (dest == NULL) {
+        fprintf(stderr, "failed to malloc escaped XML string\n");
+        return NULL;
+    }
+    d = dest;
+    while (len) {
+        memcpy(d, src, n);
+        d += n;
+        if (n == len)
+            break;
+        d += strlen(strcpy(d, osm_xml_entity(src[n])));
+        src += n + 1;
+        len -= n + 1;
+        n = osm_xml_plain_len(src, len);
+    }
+    *d = '\0';
     return dest;
 }
 
+/* "YYYY-MM-DDT" of days since 1970-01-01, -1 if the year isn't 4 digits */
+static int timestamp_date(int64_t days, char *date) {
+    int64_t z   = days + 719468; /* days since 0000-03-01 */
+    int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    int64_t doe = z - era * 146097;
+    int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    int64_t mp  = (5 * doy + 2) / 153;
+    int64_t d   = doy - (153 * mp + 2) / 5 + 1;
+    int64_t m   = mp < 10 ? mp + 3 : mp - 9;
+    int64_t y   = yoe + era * 400 + (m <= 2);
+
+    if (y < 1000 || y > 9999)
+        return -1;
+    date[0]  = '0' + y / 1000;
+    date[1]  = '0' + y / 100 % 10;
+    date[2]  = '0' + y / 10 % 10;
+    date[3]  = '0' + y % 10;
+    date[4]  = '-';
+    date[5]  = '0' + m / 10;
+    date[6]  = '0' + m % 10;
+    date[7]  = '-';
+    date[8]  = '0' + d / 10;
+    date[9]  = '0' + d % 10;
+    date[10] = 'T';
+    return 0;
+}
+
+/*
+   t as "%Y-%m-%dT%H:%M:%SZ" (UTC) to buf (OSM_TIMESTAMP_SIZE bytes, a
+   year outside 1000..9999 makes it longer than 20), returns the length,
+   0 and an empty buf if t can't be formatted.
+   The date of the last day is kept in c (zeroed before the first use),
+   the time of day is just a few divisions. Timestamps are clustered, so
+   the date is rarely formatted. Each thread needs its own c.
+*/
+int osm_timestamp_format(struct osm_timestamp_cache *c, int64_t t, char *buf) {
+    int64_t day = (t >= 0 ? t : t - 86399) / 86400;
+    int64_t sec = t - day * 86400;
+    struct tm tm;
+    time_t tt = t;
+    char tmp[64];
+    size_t len;
+
+    if (!c->valid || c->day != day) {
+        if (timestamp_date(day, c->date) != 0) {
+            /* strftime() doesn't pad %Y */
+            len = 0;
+            if (gmtime_r(&tt, &tm) != NULL)
+                len = strftime(tmp, sizeof(tmp), "%Y-%m-%dT%H:%M:%SZ", &tm);
+            if (len == 0 || len >= OSM_TIMESTAMP_SIZE) {
+                buf[0] = '\0';
+                return 0;
+            }
+            memcpy(buf, tmp, len + 1);
+            return len;
+        }
+        c->day   = day;
+        c->valid = 1;
+    }
+    memcpy(buf, c->date, 11);
+    buf[11] = '0' + sec / 36000;
+    buf[12] = '0' + sec / 3600 % 10;
+    buf[13] = ':';
+    buf[14] = '0' + sec % 3600 / 600;
+    buf[15] = '0' + sec % 600 / 60;
+    buf[16] = ':';
+    buf[17] = '0' + sec % 60 / 10;
+    buf[18] = '0' + sec % 10;
+    buf[19] = 'Z';
+    buf[20] = '\0';
+    return 20;
+}
+
 int osm_cmp_member(const void *a, const void *b) {
     if (*(uint64_t *)a > *(uint64_t *)b)
         return 1;
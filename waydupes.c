@@ -61,9 +61,15 @@ double auto_bbox(double area, long int num_ways, long int num_nodes) {
     return sqrt( sqrt(2 * area * area * log(num_nodes) / num_ways) );
 }
 
-void write_gpx(OSM_Data *D, char *gpx_file) {
+/*
+   each way as a track, the points from the location store L. Only the
+   few tagged nodes are looked up in a (sorted) list for their tags.
+*/
+void write_gpx(OSM_Data *D, OSM_Locations *L, char *gpx_file) {
     int i, k, pos;
+    double lat, lon;
     FILE *outfh;
+    OSM_Node_List tagged;
 
     outfh = fopen(gpx_file, "w");
     if (outfh == NULL) {
@@ -72,6 +78,16 @@ void write_gpx(OSM_Data *D, char *gpx_file) {
         exit(1);
     }
 
+    tagged.num  = 0;
+    tagged.size = D->nodes->num;
+    tagged.data = malloc(sizeof(OSM_Node *) * (tagged.size + 1));
+    for (i=0; i<D->nodes->num; i++) {
+        OSM_Node *n = D->nodes->data[i];
+        if (n->tags != NULL && n->tags->num)
+            tagged.data[tagged.num++] = n;
+    }
+    osm_node_list_sort(&tagged);
+
     osm_gpx_write_header("waydupes", outfh);
     if (D->ways->num) {
         for (i=0; i<D->ways->num; i++) {
@@ -80,9 +96,11 @@ void write_gpx(OSM_Data *D, char *gpx_file) {
             fprintf(outfh, " <trk>\n");
             fprintf(outfh, "  <trkseg>\n");
             while (w->nodes[k]) {
-                pos = osm_node_pos(D->nodes, w->nodes[k]);
+                pos = tagged.num ? osm_node_pos(&tagged, w->nodes[k]) : -1;
                 if (pos >= 0)
-                    osm_gpx_write_node(D->nodes->data[pos], outfh, 1);
+                    osm_gpx_write_node(tagged.data[pos], outfh, 1);
+                else if (osm_locations_get(L, w->nodes[k], &lat, &lon))
+                    osm_gpx_write_point(w->nodes[k], lat, lon, outfh, 1);
                 k++;
             }
             fprintf(outfh, "  </trkseg>\n");
@@ -92,6 +110,7 @@ void write_gpx(OSM_Data *D, char *gpx_file) {
     osm_gpx_write_footer(outfh);
     fflush(outfh);
     fclose(outfh);
+    free(tagged.data);
 }
 
 int file_type;
@@ -100,12 +119,14 @@ char *gpx_file = NULL;
 double bbsize = 0.0;
 int debug = 0;
 int by_location = 0;
+int threads = 1;
+char *locations = "sparse";
 
 
 void parse_args(int argc, char **argv) {
     char c;
     //opterr = 0;
-    while ((c = getopt(argc, argv, "bdlPXg:")) != -1) {
+    while ((c = getopt(argc, argv, "bdj:lL:PXg:")) != -1) {
         switch (c) {
             case 'b':
                 bbsize = atof(optarg);
@@ -113,9 +134,15 @@ void parse_args(int argc, char **argv) {
             case 'd':
                 debug = 1;
                 break;
+            case 'j':
+                threads = atoi(optarg);
+                break;
             case 'l':
                 by_location = 1;
                 break;
+            case 'L':
+                locations = optarg;
+                break;
             case 'P':
                 file_type = OSM_FTYPE_PBF;
                 break;
@@ -145,6 +172,7 @@ int main(int argc, char **argv) {
     OSM_Data *O;
     OSM_Way_List *ways, *dupes;
     OSM_Node_List *G;
+    OSM_Locations *L;
     time_t start = time(NULL);
 
   
@@ -154,10 +182,21 @@ int main(int argc, char **argv) {
     F = osm_open(file, file_type);
     if (F == NULL)
         return 1;
+    F->threads = threads;
 
     O = osm_parse(F, OSMDATA_WAY, NULL, skip_nodes, use_highways, NULL);
     osm_close(F);
     fprintf(stderr, "parsing file done after %d\n", (int)(time(NULL)-start));
+
+    /* -L sparse, -L dense or -L /path/to/file for a file backed store */
+    if (strcmp(locations, "sparse") == 0)
+        L = osm_locations_new(OSM_LOCATIONS_SPARSE, NULL);
+    else if (strcmp(locations, "dense") == 0)
+        L = osm_locations_new(OSM_LOCATIONS_DENSE, NULL);
+    else
+        L = osm_locations_new(OSM_LOCATIONS_MMAP, locations);
+    if (L == NULL || osm_locations_add_nodes(L, O->nodes) != 0)
+        return 1;
     
 
     ways = malloc(sizeof(OSM_Way_List));
@@ -173,18 +212,17 @@ int main(int argc, char **argv) {
     G = malloc(sizeof(OSM_Node_List));
 
     OSM_BBox *box = osm_bbox_from_nodes(O->nodes);
+    /* the locations are rounded to 1e-7 degrees, so is the box */
+    box->left_lon   = lround(box->left_lon   * 1e7) / 1e7;
+    box->right_lon  = lround(box->right_lon  * 1e7) / 1e7;
+    box->bottom_lat = lround(box->bottom_lat * 1e7) / 1e7;
+    box->top_lat    = lround(box->top_lat    * 1e7) / 1e7;
     if (bbsize == 0.0)
         bbsize = auto_bbox(bbox_area(box), O->ways->num, O->nodes->num);
 
     if (debug)
         fprintf(stderr, "BBOX Size=%f\n", bbsize);
 
-    osm_node_list_sort(O->nodes);
-    if (debug)
-        fprintf(stderr, "nodes sorted after %d\n", (int)(time(NULL)-start));
-    // for (i=0; i<O->nodes->num; i++)
-    //     fprintf(stderr, "NODE=% 16lu pos=% 10d\n", O->nodes->data[i]->id, i);
-
     double left, right, top, bottom;
     for (left=box->left_lon; left <= box->right_lon; left += bbsize) {
         for (bottom=box->bottom_lat; bottom <= box->top_lat; bottom += bbsize) {
@@ -194,19 +232,19 @@ int main(int argc, char **argv) {
             int k, l;
             for (k=0; k<O->ways->num; k++) {
                 uint64_t *nodes = O->ways->data[k]->nodes;
+                double lat, lon;
                 l=0; 
                 while (nodes[l]) {
-                    long int pos = osm_node_pos(O->nodes, nodes[l]);
-                    if (pos == -1) {
+                    if (!osm_locations_get(L, nodes[l], &lat, &lon)) {
                         fprintf(stderr, "node %lu missing, referenced by way %lu\n", 
                                         nodes[l],  O->ways->data[k]->id);
                         ++l;
                         continue;
                     }
-                    if (O->nodes->data[pos]->lon >= left   &&
-                        O->nodes->data[pos]->lon <= right  &&
-                        O->nodes->data[pos]->lat >= bottom &&
-                        O->nodes->data[pos]->lat <= top)
+                    if (lon >= left   &&
+                        lon <= right  &&
+                        lat >= bottom &&
+                        lat <= top)
                     {
                         osm_realloc_way_list(ways);
                         ways->data[ways->num] = O->ways->data[k];
@@ -266,9 +304,13 @@ int main(int argc, char **argv) {
     D->nodes    = O->nodes;
     D->ways     = dupes;
     D->relations = NULL;
+    D->arena    = NULL;
+    D->node_cols = NULL;
 
     if (gpx_file != NULL)
-        write_gpx(D, gpx_file);
+        write_gpx(D, L, gpx_file);
+
+    osm_locations_free(L);
 
     return 0;
 }
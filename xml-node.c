@@ -6,7 +6,6 @@
  * Hanno Hecker <vetinari+osm at ankh-morp dot org>
  */
 
-#define _GNU_SOURCE /* strndup ... */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,188 +13,114 @@
 
 #include "osm.h"
 
-OSM_Node *osm_xml_get_node(FILE *file, char *buffer, char *param) {
+OSM_Node *osm_xml_get_node(OSM_File *F) {
+    struct osm_xml_tag T;
+    struct osm_xml_attr *a;
     OSM_Node *N = NULL;
-    char *line, *str;
+    int have_lat = 0, have_lon = 0;
+    uint32_t i;
 
-    buffer = fgets(buffer, LINE_SIZE, file);
-    if (buffer == NULL) {
-        if (!feof(file))
-            perror("error reading .osm file");
-        else if (debug)
-                fprintf(stderr, "%s:%d:%s(): EOF\n",
-                            __FILE__, __LINE__, __FUNCTION__);
-
-        return (OSM_Node *)NULL;
-    }
-
-    line = buffer;
-    trim_left(line);
-
-    if (strncmp(line, "<node ", 5) != 0) {
-        if (debug)
-            fprintf(stderr, "%s:%d:%s(): not a <node line: %s\n",
-                        __FILE__, __LINE__, __FUNCTION__, line);
-        return (OSM_Node *)NULL;
-    }
-
-    str = osm_xml_fetch_param(line, "id", param);
-    if (str == NULL) {
+    if (osm_xml_next(F, &T) != 1) {
         if (debug)
-            fprintf(stderr, "%s:%d:%s(): no node id\n",
+            fprintf(stderr, "%s:%d:%s(): EOF\n",
                         __FILE__, __LINE__, __FUNCTION__);
         return (OSM_Node *)NULL;
     }
-
-    N = malloc(sizeof(OSM_Node));
-    N->tags = NULL;
-    N->id   = atol(str);
-    if (N->id == 0) {
-        free(N);
+    if (T.type == OSM_XML_CLOSE || !OSM_XML_IS(&T, "node")) {
         if (debug)
-            fprintf(stderr, "%s:%d:%s(): no node id: atol() failed\n",
-                        __FILE__, __LINE__, __FUNCTION__);
+            fprintf(stderr, "%s:%d:%s(): not a <node: %.*s\n",
+                        __FILE__, __LINE__, __FUNCTION__,
+                        (int)T.name_len, T.name);
         return (OSM_Node *)NULL;
     }
 
-    str = osm_xml_fetch_param(line, "lon", param);
-    if (str == NULL) {
-        if (debug)
-            fprintf(stderr, "%s:%d:%s(): node=%lu: no node 'lon='\n",
-                        __FILE__, __LINE__, __FUNCTION__, N->id);
-        free(N);
-        return (OSM_Node *)NULL;
+    N = malloc(sizeof(OSM_Node));
+    N->flags     = 0;
+    N->tags      = NULL;
+    N->id        = 0;
+    N->user      = "";
+    N->uid       = 0;
+    N->version   = 0;
+    N->changeset = 0;
+    N->timestamp = 0;
+    for (i = 0; i < T.num_attrs; i++) {
+        a = &T.attrs[i];
+        if (OSM_XML_ATTR_IS(a, "id"))
+            N->id = osm_xml_int(a->val, a->val_len);
+        else if (OSM_XML_ATTR_IS(a, "lat")) {
+            N->lat = osm_xml_double(a->val, a->val_len);
+            have_lat = a->val_len > 0;
+        }
+        else if (OSM_XML_ATTR_IS(a, "lon")) {
+            N->lon = osm_xml_double(a->val, a->val_len);
+            have_lon = a->val_len > 0;
+        }
+        else
+            osm_xml_node_attr(N, a);
     }
-    N->lon = atof(str); // FIXME parsing errors?
-
-    str = osm_xml_fetch_param(line, "lat", param);
-    if (str == NULL) {
+    if (N->id == 0 || !have_lat || !have_lon) {
         if (debug)
-            fprintf(stderr, "%s:%d:%s(): node=%lu: no node 'lat='\n",
+            fprintf(stderr, "%s:%d:%s(): node=%lu: no id, 'lat=' or 'lon='\n",
                         __FILE__, __LINE__, __FUNCTION__, N->id);
-        free(N);
+        osm_free_node(N);
         return (OSM_Node *)NULL;
     }
-    N->lat = atof(str); // FIXME parsing errors?
-
-    N->tags = malloc(sizeof(OSM_Tag_List));
-    N->tags->data = malloc(sizeof(OSM_Tag) * 16);
-    N->tags->size = 16;
-    N->tags->num  = 0;
-
-    str = osm_xml_fetch_param(line, "user", param);
-    if (str == NULL) 
-        N->user = strdup("");
-    else
-        N->user = strdup(str);
-
-    str = osm_xml_fetch_param(line, "uid", param);
-    if (str == NULL) 
-        N->uid = 0;
-    else
-        N->uid = atoi(str);
 
-    str = osm_xml_fetch_param(line, "version", param);
-    if (str == NULL) 
-        N->version = 0;
-    else
-        N->version = atoi(str);
-    
-    str = osm_xml_fetch_param(line, "changeset", param);
-    if (str == NULL) 
-        N->changeset = 0;
-    else
-        N->changeset = atol(str);
-    
-    str = osm_xml_fetch_param(line, "timestamp", param);
-    if (str == NULL) 
-        N->timestamp = 0;
-    else
-        N->timestamp = osm_timestamp2epoch(str);
-
-    str = line + strlen(line);
-    while (*str != '>') {
-        // *str = '\0';
-        --str;
-    }
-    --str;
-    if (*str == '/') {
+    if (T.type == OSM_XML_EMPTY) {
         if (debug)
             fprintf(stderr, "%s:%d:%s(): node=%lu: no tags...\n",
                         __FILE__, __LINE__, __FUNCTION__, N->id);
         return N;
     }
 
-    while (1) {
-        buffer = fgets(buffer, LINE_SIZE, file);
-        if (buffer == NULL) {
-            if (!feof(file))
-                perror("error reading .osm file");
-            else 
+    while (osm_xml_next(F, &T) == 1) {
+        if (T.type == OSM_XML_CLOSE) {
+            if (OSM_XML_IS(&T, "node")) {
                 if (debug)
-                    fprintf(stderr, "%s:%d:%s(): node=%lu: EOF\n",
+                    fprintf(stderr, "%s:%d:%s(): node=%lu: </node>\n",
                                 __FILE__, __LINE__, __FUNCTION__, N->id);
-            osm_free_node(N); 
-            return (OSM_Node *)NULL;
+                return N;
+            }
         }
-        line = buffer;
-        trim_left(line);
-
-        if (strncmp(line, "<tag ", 5) == 0) {
-            /* osm_realloc_tag_list(N->tags);
-            */
-            int pos = N->tags->num;
-            FETCH_TAG(N->tags, pos);
-            /*
-            str = osm_xml_fetch_param(line, "k", param);
-            if (str == NULL)
-                continue;
-            N->tags->data[pos].key = strdup(str);
-
-            str = osm_xml_fetch_param(line, "v", param);
-            if (str == NULL)
-                N->tags->data[pos].val = "";
-            else
-                N->tags->data[pos].val = strdup(str);
-            N->tags->num += 1;
-            */
-            if (debug)
+        else if (OSM_XML_IS(&T, "tag")) {
+            osm_xml_add_tag(&N->tags, &T);
+            if (debug && N->tags != NULL)
                 fprintf(stderr, "%s:%d:%s(): node=%lu: tag: k=%s, v=%s\n",
                                 __FILE__, __LINE__, __FUNCTION__, N->id,
-                                N->tags->data[pos].key, N->tags->data[pos].val);
-        }
-        else if (strncmp(line, "</node>", 6) == 0) {
-            if (debug)
-                fprintf(stderr, "%s:%d:%s(): node=%lu: </node>\n",
-                                __FILE__, __LINE__, __FUNCTION__, N->id);
-            return N;
+                                N->tags->data[N->tags->num - 1].key,
+                                N->tags->data[N->tags->num - 1].val);
         }
     }
+    if (debug)
+        fprintf(stderr, "%s:%d:%s(): node=%lu: EOF\n",
+                    __FILE__, __LINE__, __FUNCTION__, N->id);
+    osm_free_node(N);
+    return (OSM_Node *)NULL;
 }
 
-OSM_Node_List *osm_xml_parse_nodes(long int start,
-                                    FILE *file,
+OSM_Node_List *osm_xml_parse_nodes(off_t start,
+                                    OSM_File *F,
                                     int mode,
                                     int(*filter)(OSM_Node *n),
-                                    struct osm_members *wanted)
+                                    OSM_Filter *cfilter,
+                                    OSM_Id_Bitmap *wanted,
+                                    OSM_Arena *arena,
+                                    OSM_Node_Columns *cols)
 {
     OSM_Node_List *nl = NULL;
     OSM_Node       *N = NULL;
-    char *buffer, *param;
 
-    buffer = malloc(LINE_SIZE);
-    param  = malloc(LINE_SIZE);
     nl     = malloc(sizeof(OSM_Node_List));
     nl->data = malloc(sizeof(OSM_Node) * 32);
     nl->size = 32;
     nl->num  = 0;
 
-    fseek(file, start, SEEK_SET);
+    F->pos = start;
 
-//    N = osm_xml_get_node(file, buffer, param);
-    for (N = osm_xml_get_node(file, buffer, param); N != NULL; N = osm_xml_get_node(file, buffer, param)) {
-        if (mode == OSMDATA_NODE && filter != NULL) {
-            if ((osm_is_member(wanted, N->id) == -1) && !filter(N)) {
+    for (N = osm_xml_get_node(F); N != NULL; N = osm_xml_get_node(F)) {
+        if (mode == OSMDATA_NODE && (filter != NULL || cfilter != NULL)) {
+            if (!osm_id_bitmap_has(wanted, N->id)
+                && !osm_filter_take_node(filter, cfilter, N)) {
                 if (debug)
                     fprintf(stderr, "%s:%d:%s(): node=%lu: not a member and filtered\n",
                                 __FILE__, __LINE__, __FUNCTION__, N->id);
@@ -203,27 +128,32 @@ OSM_Node_List *osm_xml_parse_nodes(long int start,
                 continue; 
             }
         }
-        else if (mode == OSMDATA_NODE && osm_is_member(wanted, N->id) == -1) {
+        else if (mode == OSMDATA_NODE && !osm_id_bitmap_has(wanted, N->id)) {
             if (debug)
                 fprintf(stderr, "%s:%d:%s(): node=%lu: not a member\n",
                             __FILE__, __LINE__, __FUNCTION__, N->id);
             osm_free_node(N);
             continue; 
         }
-        else if (filter != NULL && !filter(N)) {
+        else if (!osm_filter_take_node(filter, cfilter, N)) {
             if (debug)
                 fprintf(stderr, "%s:%d:%s(): node=%lu: filtered\n",
                             __FILE__, __LINE__, __FUNCTION__, N->id);
             osm_free_node(N);
             continue; 
         }
+        if (cols != NULL) {
+            osm_node_columns_add(cols, N);
+            osm_free_node(N);
+            continue;
+        }
+        if (arena != NULL)
+            N = osm_arena_node(arena, N);
         osm_realloc_node_list(nl);
         nl->data[nl->num] = N;
         nl->num += 1;
     }
 
-    free(buffer);
-    free(param);
     if (debug)
         fprintf(stderr, "%s:%d:%s(): returning %d nodes\n",
                     __FILE__, __LINE__, __FUNCTION__, nl->num);
@@ -0,0 +1,494 @@
+/*
+ * xml-read.c - tokenizer for .osm XML files
+ *
+ * The file is mmap()ed (or, if that fails, read into memory once) and
+ * osm_xml_next() returns one element after the other: its name and its
+ * attributes as pointers into the file, found in one left to right scan
+ * with memchr(). Nothing is copied until a value is wanted, see
+ * osm_xml_string(). Line breaks don't matter, an element may be spread
+ * over several lines or several elements may share one.
+ *
+ *   struct osm_xml_tag T;
+ *   while (osm_xml_next(F, &T) == 1)
+ *       if (T.type != OSM_XML_CLOSE && OSM_XML_IS(&T, "node")) ...
+ *
+ * This file is licenced licenced under the General Public License 3.
+ *
+ * Hanno Hecker <vetinari+osm at ankh-morp dot org>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "osm.h"
+
+/* the whole file into memory, for files which can't be mapped */
+static int xml_read_all(OSM_File *F) {
+    size_t size = 1024*1024, len = 0, n;
+    unsigned char *data = NULL, *tmp;
+
+    fseek(F->file, 0, SEEK_SET);
+    do {
+        if (data == NULL || len == size) {
+            size = data == NULL ? size : size * 2;
+            tmp  = realloc(data, size);
+            if (tmp == NULL) {
+                fprintf(stderr, "failed to malloc %zu bytes for .osm file: %s\n",
+                                size, strerror(errno));
+                free(data);
+                return -1;
+            }
+            data = tmp;
+        }
+        n = fread(data + len, 1, size - len, F->file);
+        len += n;
+    } while (n > 0);
+    if (ferror(F->file)) {
+        perror("error reading .osm file");
+        free(data);
+        return -1;
+    }
+    F->map  = data;
+    F->size = len;
+    return 0;
+}
+
+int osm_xml_reader_open(OSM_File *F) {
+    struct stat st;
+
+    F->fd     = fileno(F->file);
+    F->map    = NULL;
+    F->pos    = 0;
+    F->buf.size   = 0;
+    F->buf.data   = NULL;
+    F->blocks     = NULL;
+    F->num_blocks = 0;
+
+    if (fstat(F->fd, &st) != 0) {
+        fprintf(stderr, "failed to stat file: %s\n", strerror(errno));
+        return -1;
+    }
+    F->size = st.st_size;
+
+    if (F->size > 0) {
+        F->map = mmap(NULL, F->size, PROT_READ, MAP_PRIVATE, F->fd, 0);
+        if (F->map == MAP_FAILED) {
+            if (debug)
+                fprintf(stderr, "%s:%d:%s(): mmap failed, reading the file: %s\n",
+                        __FILE__, __LINE__, __FUNCTION__, strerror(errno));
+            F->map = NULL;
+        }
+        else
+            madvise(F->map, F->size, MADV_SEQUENTIAL);
+    }
+    if (F->map != NULL) {
+        F->reader = OSM_READER_MMAP;
+        return 0;
+    }
+    F->reader = OSM_READER_PREAD;
+    return xml_read_all(F);
+}
+
+void osm_xml_reader_close(OSM_File *F) {
+    if (F->map != NULL) {
+        if (F->reader == OSM_READER_MMAP)
+            munmap(F->map, F->size);
+        else
+            free(F->map);
+    }
+    F->map = NULL;
+}
+
+static inline int xml_space(unsigned char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+/* the end of the first "s" after p, NULL if there is none */
+static const char *xml_skip_to(const char *p, const char *end, const char *s) {
+    size_t len = strlen(s);
+
+    while ((p = memchr(p, s[0], end - p)) != NULL) {
+        if ((size_t)(end - p) < len)
+            return NULL;
+        if (memcmp(p, s, len) == 0)
+            return p + len;
+        ++p;
+    }
+    return NULL;
+}
+
+/*
+   the next element from F->pos on: 1 if T is set, 0 at the end of the
+   file, -1 if the file is broken. Processing instructions, comments and
+   text between the elements are skipped, attributes after the first
+   OSM_XML_MAX_ATTRS are ignored.
+*/
+int osm_xml_next(OSM_File *F, struct osm_xml_tag *T) {
+    const char *start = (const char *)F->map;
+    const char *end   = start + F->size;
+    const char *p     = start + F->pos;
+    const char *name, *val;
+    struct osm_xml_attr *a;
+    char quote;
+
+    while (1) {
+        p = F->map != NULL ? memchr(p, '<', end - p) : NULL;
+        if (p == NULL) {
+            F->pos = F->size;
+            return 0;
+        }
+        if (p + 1 < end && p[1] == '?')
+            p = xml_skip_to(p + 2, end, "?>");
+        else if (end - p >= 4 && memcmp(p, "<!--", 4) == 0)
+            p = xml_skip_to(p + 4, end, "-->");
+        else if (p + 1 < end && p[1] == '!')
+            p = xml_skip_to(p + 2, end, ">");
+        else
+            break;
+        if (p == NULL) {
+            fprintf(stderr, "unterminated <? or <! in .osm file\n");
+            F->pos = F->size;
+            return -1;
+        }
+    }
+
+    T->offset    = p - start;
+    T->type      = OSM_XML_OPEN;
+    T->num_attrs = 0;
+    ++p;
+    if (p < end && *p == '/') {
+        T->type = OSM_XML_CLOSE;
+        ++p;
+    }
+    name = p;
+    while (p < end && !xml_space(*p) && *p != '>' && *p != '/')
+        ++p;
+    T->name     = name;
+    T->name_len = p - name;
+
+    while (1) {
+        while (p < end && xml_space(*p))
+            ++p;
+        if (p >= end)
+            break;
+        if (*p == '>') {
+            F->pos = p + 1 - start;
+            return 1;
+        }
+        if (*p == '/' && p + 1 < end && p[1] == '>') {
+            if (T->type == OSM_XML_OPEN)
+                T->type = OSM_XML_EMPTY;
+            F->pos = p + 2 - start;
+            return 1;
+        }
+
+        name = p;
+        while (p < end && !xml_space(*p) && *p != '=' && *p != '>' && *p != '/')
+            ++p;
+        if (p == name)
+            break;
+        a = T->num_attrs < OSM_XML_MAX_ATTRS ? &T->attrs[T->num_attrs] : NULL;
+        if (a != NULL) {
+            a->name     = name;
+            a->name_len = p - name;
+        }
+        while (p < end && xml_space(*p))
+            ++p;
+        if (p >= end || *p != '=')
+            break;
+        ++p;
+        while (p < end && xml_space(*p))
+            ++p;
+        if (p >= end || (*p != '"' && *p != '\''))
+            break;
+        quote = *p++;
+        val = p;
+        /*
+           well-formed XML has a space, '/' or '>' after the value, so an
+           unescaped quote in it (as written by older tools) doesn't end it
+        */
+        while ((p = memchr(p, quote, end - p)) != NULL && p + 1 < end
+                && !xml_space(p[1]) && p[1] != '/' && p[1] != '>')
+            ++p;
+        if (p == NULL)
+            break;
+        if (a != NULL) {
+            a->val     = val;
+            a->val_len = p - val;
+            T->num_attrs += 1;
+        }
+        ++p;
+    }
+    fprintf(stderr, "broken element at offset %lld of .osm file: '%.*s'\n",
+                    (long long)T->offset, (int)(T->name_len < 64 ? T->name_len : 64),
+                    T->name);
+    F->pos = F->size;
+    return -1;
+}
+
+/* the value of the attribute name of T, NULL if it has none */
+struct osm_xml_attr *osm_xml_attr(struct osm_xml_tag *T, const char *name) {
+    size_t len = strlen(name);
+    uint32_t i;
+
+    for (i = 0; i < T->num_attrs; i++)
+        if (T->attrs[i].name_len == len && memcmp(T->attrs[i].name, name, len) == 0)
+            return &T->attrs[i];
+    return NULL;
+}
+
+/* UTF-8 of the character reference &#NN; / &#xNN; in s, its length */
+static int xml_char_ref(const char *s, uint32_t len, char *out, uint32_t *used) {
+    uint32_t i = 2, c = 0, base = 10, d;
+
+    if (len > 2 && s[2] == 'x') {
+        base = 16;
+        i = 3;
+    }
+    for (; i < len && i < 12 && s[i] != ';'; i++) {
+        if (s[i] >= '0' && s[i] <= '9')
+            d = s[i] - '0';
+        else if (base == 16 && s[i] >= 'a' && s[i] <= 'f')
+            d = s[i] - 'a' + 10;
+        else if (base == 16 && s[i] >= 'A' && s[i] <= 'F')
+            d = s[i] - 'A' + 10;
+        else
+            return 0;
+        c = c * base + d;
+    }
+    if (i >= len || s[i] != ';' || c == 0 || c > 0x10ffff)
+        return 0;
+    *used = i + 1;
+    if (c < 0x80) {
+        out[0] = c;
+        return 1;
+    }
+    if (c < 0x800) {
+        out[0] = 0xc0 | (c >> 6);
+        out[1] = 0x80 | (c & 0x3f);
+        return 2;
+    }
+    if (c < 0x10000) {
+        out[0] = 0xe0 | (c >> 12);
+        out[1] = 0x80 | ((c >> 6) & 0x3f);
+        out[2] = 0x80 | (c & 0x3f);
+        return 3;
+    }
+    out[0] = 0xf0 | (c >> 18);
+    out[1] = 0x80 | ((c >> 12) & 0x3f);
+    out[2] = 0x80 | ((c >> 6) & 0x3f);
+    out[3] = 0x80 | (c & 0x3f);
+    return 4;
+}
+
+/*
+   a malloc()ed copy of the attribute value s with the entities decoded,
+   the literal "" (not to be freed, like everywhere else) if it's empty
+*/
+char *osm_xml_string(const char *s, uint32_t len) {
+    const char *amp, *end = s + len;
+    char *dest, *d;
+    uint32_t used;
+    int n;
+
+    if (len == 0)
+        return "";
+    dest = malloc(len + 1);
+    if (dest == NULL) {
+        fprintf(stderr, "failed to malloc string: %s\n", strerror(errno));
+        return "";
+    }
+    d = dest;
+    while ((amp = memchr(s, '&', end - s)) != NULL) {
+        memcpy(d, s, amp - s);
+        d  += amp - s;
+        len = end - amp;
+        used = 0;
+        if (len >= 5 && memcmp(amp, "&amp;", 5) == 0) {
+            *d++ = '&';
+            used = 5;
+        }
+        else if (len >= 6 && memcmp(amp, "&quot;", 6) == 0) {
+            *d++ = '"';
+            used = 6;
+        }
+        else if (len >= 6 && memcmp(amp, "&apos;", 6) == 0) {
+            *d++ = '\'';
+            used = 6;
+        }
+        else if (len >= 4 && memcmp(amp, "&lt;", 4) == 0) {
+            *d++ = '<';
+            used = 4;
+        }
+        else if (len >= 4 && memcmp(amp, "&gt;", 4) == 0) {
+            *d++ = '>';
+            used = 4;
+        }
+        else if (len >= 4 && amp[1] == '#'
+                 && (n = xml_char_ref(amp, len, d, &used)) > 0)
+            d += n; /* never longer than the reference */
+        else {
+            *d++ = '&'; /* not an entity, keep it */
+            used = 1;
+        }
+        s = amp + used;
+    }
+    memcpy(d, s, end - s);
+    d += end - s;
+    *d = '\0';
+    return dest;
+}
+
+/* like atol(), for a value which isn't \0 terminated */
+int64_t osm_xml_int(const char *s, uint32_t len) {
+    const char *end = s + len;
+    uint64_t v = 0;
+    int neg = 0;
+
+    while (s < end && xml_space(*s))
+        ++s;
+    if (s < end && (*s == '-' || *s == '+'))
+        neg = *s++ == '-';
+    while (s < end && *s >= '0' && *s <= '9')
+        v = v * 10 + (*s++ - '0');
+    return neg ? -(int64_t)v : (int64_t)v;
+}
+
+/*
+   like atof(). Up to 15 digits with at most 22 after the '.' are an exact
+   integer divided by an exact power of ten, which rounds just like
+   strtod() does. Anything else goes to strtod().
+*/
+double osm_xml_double(const char *s, uint32_t len) {
+    static const double pow10[] = {
+        1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    const char *p = s, *end = s + len;
+    uint64_t m = 0;
+    int neg = 0, digits = 0, frac = -1;
+    char buf[64];
+
+    if (p < end && *p == '-') {
+        neg = 1;
+        ++p;
+    }
+    for (; p < end; p++) {
+        if (*p >= '0' && *p <= '9') {
+            m = m * 10 + (*p - '0');
+            ++digits;
+            if (frac >= 0)
+                ++frac;
+        }
+        else if (*p == '.' && frac < 0)
+            frac = 0;
+        else
+            break;
+    }
+    if (p == end && digits > 0 && digits <= 15 && frac <= 22) {
+        double v = frac > 0 ? (double)m / pow10[frac] : (double)m;
+        return neg ? -v : v;
+    }
+
+    if (len >= sizeof(buf))
+        len = sizeof(buf) - 1;
+    memcpy(buf, s, len);
+    buf[len] = '\0';
+    return atof(buf);
+}
+
+/* days since 1970-01-01 of y-m-d */
+static int64_t xml_days(int64_t y, int64_t m, int64_t d) {
+    int64_t era, yoe, doy, doe;
+
+    y  -= m <= 2;
+    era = (y >= 0 ? y : y - 399) / 400;
+    yoe = y - era * 400;
+    doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+#define XML_D(i) (s[i] - '0')
+
+/* "YYYY-MM-DDTHH:MM:SSZ" like osm_timestamp2epoch() */
+uint64_t osm_xml_timestamp(const char *s, uint32_t len) {
+    static const char pattern[] = "dddd-dd-ddTdd:dd:ddZ";
+    char buf[64];
+    uint32_t i;
+
+    for (i = 0; len == 20 && i < 20; i++)
+        if (pattern[i] == 'd' ? s[i] < '0' || s[i] > '9' : s[i] != pattern[i])
+            break;
+    if (i == 20) {
+        int64_t y = XML_D(0) * 1000 + XML_D(1) * 100 + XML_D(2) * 10 + XML_D(3);
+        int64_t m = XML_D(5) * 10 + XML_D(6);
+        int64_t d = XML_D(8) * 10 + XML_D(9);
+        int64_t h = XML_D(11) * 10 + XML_D(12);
+        int64_t n = XML_D(14) * 10 + XML_D(15);
+        int64_t c = XML_D(17) * 10 + XML_D(18);
+        if (m >= 1 && m <= 12 && d >= 1 && d <= 31 && h < 24 && n < 60 && c <= 60)
+            return (uint64_t)(xml_days(y, m, d) * 86400 + h * 3600 + n * 60 + c);
+    }
+
+    if (len >= sizeof(buf))
+        len = sizeof(buf) - 1;
+    memcpy(buf, s, len);
+    buf[len] = '\0';
+    return osm_timestamp2epoch(buf);
+}
+
+/*
+   user, uid, version, changeset or timestamp of o from attribute a,
+   0 if a is none of them
+*/
+#define OSM_XML_INFO_ATTR(o, a) \
+    (  (OSM_XML_ATTR_IS(a, "user")      && (((o)->user      = osm_xml_string((a)->val, (a)->val_len)), 1)) \
+    || (OSM_XML_ATTR_IS(a, "uid")       && (((o)->uid       = osm_xml_int((a)->val, (a)->val_len)), 1)) \
+    || (OSM_XML_ATTR_IS(a, "version")   && (((o)->version   = osm_xml_int((a)->val, (a)->val_len)), 1)) \
+    || (OSM_XML_ATTR_IS(a, "changeset") && (((o)->changeset = osm_xml_int((a)->val, (a)->val_len)), 1)) \
+    || (OSM_XML_ATTR_IS(a, "timestamp") && (((o)->timestamp = osm_xml_timestamp((a)->val, (a)->val_len)), 1)))
+
+int osm_xml_node_attr(OSM_Node *n, struct osm_xml_attr *a) {
+    return OSM_XML_INFO_ATTR(n, a);
+}
+
+int osm_xml_way_attr(OSM_Way *w, struct osm_xml_attr *a) {
+    return OSM_XML_INFO_ATTR(w, a);
+}
+
+int osm_xml_relation_attr(OSM_Relation *r, struct osm_xml_attr *a) {
+    return OSM_XML_INFO_ATTR(r, a);
+}
+
+/*
+   adds the <tag k=".." v=".."/> T to *tl, which is allocated for the
+   first tag. Tags without a key are skipped.
+*/
+void osm_xml_add_tag(OSM_Tag_List **tl, struct osm_xml_tag *T) {
+    struct osm_xml_attr *k = osm_xml_attr(T, "k");
+    struct osm_xml_attr *v = osm_xml_attr(T, "v");
+    OSM_Tag_List *t = *tl;
+
+    if (k == NULL || k->val_len == 0)
+        return;
+    if (t == NULL) {
+        t = malloc(sizeof(OSM_Tag_List));
+        t->data = malloc(sizeof(OSM_Tag) * 16);
+        t->size = 16;
+        t->num  = 0;
+        *tl = t;
+    }
+    osm_realloc_tag_list(t);
+    t->data[t->num].key = osm_xml_string(k->val, k->val_len);
+    t->data[t->num].val = v != NULL ? osm_xml_string(v->val, v->val_len) : "";
+    t->num += 1;
+}
+
+/* END */
@@ -6,7 +6,6 @@
  * Hanno Hecker <vetinari+osm at ankh-morp dot org>
  */
 
-#define _GNU_SOURCE /* strndup ... */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,204 +14,130 @@
 #include "osm.h"
 
 
-OSM_Relation *osm_xml_get_relation(FILE *file, char *buffer, char *param) {
-    char *line, *str;
+OSM_Relation *osm_xml_get_relation(OSM_File *F) {
+    struct osm_xml_tag T;
+    struct osm_xml_attr *a;
     OSM_Relation *rel = NULL;
+    OSM_Rel_Member *m;
+    uint32_t i;
 
-    buffer = fgets(buffer, LINE_SIZE, file);
-    if (buffer == NULL) {
-        if (!feof(file)) {
-            perror("error reading .osm file");
-        }
+    if (osm_xml_next(F, &T) != 1) {
         if (debug)
             fprintf(stderr, "%s:%d:%s(): EOF\n", __FILE__, __LINE__, __FUNCTION__);
         return (OSM_Relation *)NULL;
     }
-
-    line = buffer;
-
-    trim_left(line);
-    if (strncmp(line, "<relation ", 10) != 0) {
-        if (debug)
-            fprintf(stderr, "%s:%d:%s(): not a <relation line: %s\n", 
-                            __FILE__, __LINE__, __FUNCTION__, line);
-        return (OSM_Relation *)NULL;
-    }
-
-    str = osm_xml_fetch_param(line, "id", param);
-    if (str == NULL) {
+    if (T.type == OSM_XML_CLOSE || !OSM_XML_IS(&T, "relation")) {
         if (debug)
-            fprintf(stderr, "%s:%d:%s(): no ID for relation\n", 
-                            __FILE__, __LINE__, __FUNCTION__);
+            fprintf(stderr, "%s:%d:%s(): not a <relation: %.*s\n",
+                            __FILE__, __LINE__, __FUNCTION__,
+                            (int)T.name_len, T.name);
         return (OSM_Relation *)NULL;
     }
 
     rel = malloc(sizeof(OSM_Relation));
-    rel->id = atol(str);
+    rel->flags     = 0;
+    rel->tags      = NULL;
+    rel->id        = 0;
+    rel->user      = "";
+    rel->uid       = 0;
+    rel->version   = 0;
+    rel->changeset = 0;
+    rel->timestamp = 0;
+    rel->member = malloc(sizeof(OSM_Rel_Member_List));
+    rel->member->data = malloc(sizeof(OSM_Rel_Member) * 16);
+    rel->member->size = 16;
+    rel->member->num  = 0;
+    for (i = 0; i < T.num_attrs; i++) {
+        a = &T.attrs[i];
+        if (OSM_XML_ATTR_IS(a, "id"))
+            rel->id = osm_xml_int(a->val, a->val_len);
+        else
+            osm_xml_relation_attr(rel, a);
+    }
     if (rel->id == 0) {
-        free(rel);
         if (debug)
-            fprintf(stderr, "%s:%d:%s(): no ID for relation: atol() failed\n", 
+            fprintf(stderr, "%s:%d:%s(): no ID for relation\n",
                             __FILE__, __LINE__, __FUNCTION__);
+        osm_free_relation(rel);
         return (OSM_Relation *)NULL;
     }
-    rel->member = malloc(sizeof(OSM_Rel_Member_List));
-    rel->member->data = malloc(sizeof(OSM_Rel_Member) * 2048);
-    rel->member->size = 2048;
-    rel->member->num  = 0;
-
-    rel->tags = malloc(sizeof(OSM_Tag_List));
-    rel->tags->data = malloc(sizeof(OSM_Tag) * 64);
-    rel->tags->size = 64;
-    rel->tags->num  = 0;
-    
-    str = osm_xml_fetch_param(line, "user", param);
-    if (str == NULL)
-        rel->user = "";
-    else 
-        rel->user = strdup(str);
-
-    str = osm_xml_fetch_param(line, "version", param);
-    if (str == NULL)
-        rel->version = 0;
-    else
-        rel->version = atoi(str);
-
-    str = osm_xml_fetch_param(line, "changeset", param);
-    if (str == NULL)
-        rel->changeset = 0;
-    else
-        rel->changeset = atoi(str);
-
-    str = osm_xml_fetch_param(line, "uid", param);
-    if (str == NULL)
-        rel->uid = 0;
-    else
-        rel->uid = atoi(str);
-  
-    str = osm_xml_fetch_param(line, "timestamp", param);
-    if (str == NULL)
-        rel->timestamp = 0;
-    else
-        rel->timestamp = osm_timestamp2epoch(str);
-
-    while (1) {
-        buffer = fgets(buffer, LINE_SIZE, file);
-        if (buffer == NULL) {
-            if (!feof(file)) {
-                perror("error reading .osm file");
-                free(rel->user);
-                free(rel);
-                return (OSM_Relation *)NULL;
+    if (T.type == OSM_XML_EMPTY)
+        return rel;
+
+    while (osm_xml_next(F, &T) == 1) {
+        if (T.type == OSM_XML_CLOSE) {
+            if (OSM_XML_IS(&T, "relation")) {
+                if (debug)
+                    fprintf(stderr, "%s:%d:%s(): rel=%lu, </relation>\n",
+                                    __FILE__, __LINE__, __FUNCTION__, rel->id);
+                return rel;
             }
-            if (debug)
-                fprintf(stderr, "%s:%d:%s(): EOF\n", 
-                                __FILE__, __LINE__, __FUNCTION__);
-            break;
         }
-        line = buffer;
-        trim_left(line);
-        if (strncmp(line, "<member ", 8) == 0) {
-            osm_realloc_rel_member(rel->member);
-            
-            int pos = rel->member->num;
-            str = osm_xml_fetch_param(line, "ref", param);
-            if (str == NULL) 
+        else if (OSM_XML_IS(&T, "member")) {
+            a = osm_xml_attr(&T, "ref");
+            if (a == NULL || a->val_len == 0)
                 continue;
-            rel->member->data[pos].ref = atol(str);
-
-            str = osm_xml_fetch_param(line, "type", param);
-            if (str == NULL) 
-                rel->member->data[pos].type = OSM_REL_MEMBER_TYPE_UNKNOWN;
-            else {
-                if (strcmp(str, "node") == 0) 
-                    rel->member->data[pos].type = OSM_REL_MEMBER_TYPE_NODE;
-                else if (strcmp(str, "way") == 0) 
-                    rel->member->data[pos].type = OSM_REL_MEMBER_TYPE_WAY;
-                else if (strcmp(str, "relation") == 0) 
-                    rel->member->data[pos].type = OSM_REL_MEMBER_TYPE_RELATION;
-                else 
-                    rel->member->data[pos].type = OSM_REL_MEMBER_TYPE_UNKNOWN;
+            osm_realloc_rel_member(rel->member);
+            m = &rel->member->data[rel->member->num];
+            m->ref  = osm_xml_int(a->val, a->val_len);
+            m->type = OSM_REL_MEMBER_TYPE_UNKNOWN;
+            m->role = "";
+
+            a = osm_xml_attr(&T, "type");
+            if (a != NULL) {
+                if (a->val_len == 4 && memcmp(a->val, "node", 4) == 0)
+                    m->type = OSM_REL_MEMBER_TYPE_NODE;
+                else if (a->val_len == 3 && memcmp(a->val, "way", 3) == 0)
+                    m->type = OSM_REL_MEMBER_TYPE_WAY;
+                else if (a->val_len == 8 && memcmp(a->val, "relation", 8) == 0)
+                    m->type = OSM_REL_MEMBER_TYPE_RELATION;
             }
-           
-            str = osm_xml_fetch_param(line, "role", param);
-            if (str == NULL) 
-                rel->member->data[pos].role = "";
-            else
-                rel->member->data[pos].role = strdup(str);
+            a = osm_xml_attr(&T, "role");
+            if (a != NULL)
+                m->role = osm_xml_string(a->val, a->val_len);
 
             if (debug)
-                fprintf(stderr, "%s:%d:%s(): rel=%lu, ref=%lu, role=%s type=%d\n", 
-                                __FILE__, __LINE__, __FUNCTION__, 
-                                rel->id, rel->member->data[pos].ref, 
-                                rel->member->data[pos].role,
-                                rel->member->data[pos].type);
-
+                fprintf(stderr, "%s:%d:%s(): rel=%lu, ref=%lu, role=%s type=%d\n",
+                                __FILE__, __LINE__, __FUNCTION__,
+                                rel->id, m->ref, m->role, m->type);
             rel->member->num += 1;
         }
-        else if (strncmp(line, "<tag ", 5) == 0) {
-            /* osm_realloc_tag_list(rel->tags);
-            */
-            int pos = rel->tags->num;
-            FETCH_TAG(rel->tags, pos);
-            /*
-            str = osm_xml_fetch_param(line, "k", param);
-            if (str == NULL)
-                continue;
-            rel->tags->data[pos].key = strdup(str);
-
-            str = osm_xml_fetch_param(line, "v", param);
-            if (str == NULL)
-                rel->tags->data[pos].val = "";
-            else
-                rel->tags->data[pos].val = strdup(str);
-            */
-            if (debug)
-                fprintf(stderr, "%s:%d:%s(): rel=%lu, tag: k=%s, v=%s\n", 
-                                __FILE__, __LINE__, __FUNCTION__, 
-                                rel->id, rel->tags->data[pos].key, 
-                                rel->tags->data[pos].val);
-            /* rel->tags->num += 1; */
-        }
-        else if (strncmp(line, "</relation>", 11) == 0) {
-            if (debug)
-                fprintf(stderr, "%s:%d:%s(): rel=%lu, </relation>\n", 
-                                __FILE__, __LINE__, __FUNCTION__, rel->id); 
-            return rel;
+        else if (OSM_XML_IS(&T, "tag")) {
+            osm_xml_add_tag(&rel->tags, &T);
+            if (debug && rel->tags != NULL)
+                fprintf(stderr, "%s:%d:%s(): rel=%lu, tag: k=%s, v=%s\n",
+                                __FILE__, __LINE__, __FUNCTION__, rel->id,
+                                rel->tags->data[rel->tags->num - 1].key,
+                                rel->tags->data[rel->tags->num - 1].val);
         }
     }
-    /* if we ever get here... */
-    // if (debug)
-        fprintf(stderr, "%s:%d:%s(): we should not be here ...\n",
-                        __FILE__, __LINE__, __FUNCTION__); 
+    if (debug)
+        fprintf(stderr, "%s:%d:%s(): EOF\n", __FILE__, __LINE__, __FUNCTION__);
+    osm_free_relation(rel);
     return (OSM_Relation *)NULL;
 }
 
-OSM_Relation_List *osm_xml_parse_relations(long int start, 
-                            FILE *file, 
+OSM_Relation_List *osm_xml_parse_relations(off_t start,
+                            OSM_File *F,
                             int mode, 
                             int(*filter)(OSM_Relation *r),
-                            struct osm_members *mem_way,
-                            struct osm_members *mem_node)
+                            OSM_Filter *cfilter,
+                            OSM_Id_Set *mem_way,
+                            OSM_Id_Bitmap *mem_node,
+                            OSM_Arena *arena)
 {
     OSM_Relation_List *rl = NULL;
     OSM_Relation      *R  = NULL;
-    char *buffer, *param;
 
-    buffer = malloc(LINE_SIZE);
-    param  = malloc(LINE_SIZE);
     rl     = malloc(sizeof(OSM_Relation_List));
     rl->data = malloc(sizeof(OSM_Relation) * 2048);
     rl->size = 2048;
     rl->num  = 0;
 
-    fseek(file, start, SEEK_SET);
-    
-    for (R = osm_xml_get_relation(file, buffer, param);
-         R != NULL;
-         R = osm_xml_get_relation(file, buffer, param)) 
-    {
-        if (filter != NULL && !filter(R)) {
+    F->pos = start;
+
+    for (R = osm_xml_get_relation(F); R != NULL; R = osm_xml_get_relation(F)) {
+        if (!osm_filter_take_relation(filter, cfilter, R)) {
             if (debug)
                 fprintf(stderr, "%s:%d:%s(): rel=%lu filtered\n",
                                 __FILE__, __LINE__, __FUNCTION__, R->id); 
@@ -220,36 +145,40 @@ OSM_Relation_List *osm_xml_parse_relations(long int start,
             continue;
         }
 
-        osm_realloc_rel_list(rl);
-        rl->data[rl->num] = R;
-        rl->num += 1;
         if (mode != OSMDATA_DUMP && R->member->num) {
             int i = 0;
-            uint64_t *nref = malloc(sizeof(uint64_t) * R->member->num);
-            uint64_t *wref = malloc(sizeof(uint64_t) * R->member->num);
             int num_nref = 0;
             int num_wref = 0;
             for (i=0; i<R->member->num; i++) {
+                int ret = 0;
                 if (R->member->data[i].type == OSM_REL_MEMBER_TYPE_NODE) {
-                    nref[num_nref] = R->member->data[i].ref;
+                    ret = osm_id_bitmap_add(mem_node, R->member->data[i].ref);
                     ++num_nref;
                 }
                 else if (R->member->data[i].type == OSM_REL_MEMBER_TYPE_WAY) {
-                    wref[num_wref] = R->member->data[i].ref;
+                    ret = osm_id_set_add(mem_way, R->member->data[i].ref);
                     ++num_wref;
                 }
+                if (ret < 0) {
+                    osm_free_relation(R);
+                    for (i=0; i<rl->num; i++)
+                        osm_free_relation(rl->data[i]);
+                    free(rl->data);
+                    free(rl);
+                    return (OSM_Relation_List *)NULL;
+                }
             }
             if (debug)
                 fprintf(stderr, "%s:%d:%s(): rel=%lu adding %d way and %d node members\n",
                                 __FILE__, __LINE__, __FUNCTION__, R->id, 
                                                         num_wref, num_nref); 
-            osm_add_members(mem_way,  num_wref, wref, 0);
-            osm_add_members(mem_node, num_nref, nref, 0);
         }
-        R = osm_xml_get_relation(file, buffer, param);
+        if (arena != NULL)
+            R = osm_arena_relation(arena, R);
+        osm_realloc_rel_list(rl);
+        rl->data[rl->num] = R;
+        rl->num += 1;
     }
-    free(buffer);
-    free(param);
     if (debug)
         fprintf(stderr, "%s:%d:%s(): returning %d relations\n",
                         __FILE__, __LINE__, __FUNCTION__, rl->num); 
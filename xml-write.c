@@ -1,126 +1,437 @@
 /*
  * xml-write.c - .osm XML writing
- *        
- * This file is licenced licenced under the General Public License 3. 
+ *
+ * The entities are formatted into the buffer of an OSM_Xml_Writer, which
+ * is written with one fwrite() when it holds OSM_XML_WRITE_FLUSH bytes.
+ * Numbers and coordinates are formatted here instead of by printf(), the
+ * output is the same as with the "%li" / "%.7f" formats.
+ *
+ *   X = osm_xml_writer_open(stdout);
+ *   osm_xml_put_header(X, "me");
+ *   osm_xml_put_node(X, n); ...
+ *   osm_xml_put_footer(X);
+ *   osm_xml_writer_close(X);
+ *
+ * osm_xml_put_file() writes all entities of a file, for .osm.pbf files
+ * the blocks are formatted in parallel by F->threads threads (see
+ * osm_pbf_xml()), the output is the same as with one thread.
+ *
+ * The osm_xml_write_*() functions write a single entity to a FILE.
+ *
+ * This file is licenced licenced under the General Public License 3.
  *
  * Hanno Hecker <vetinari+osm at ankh-morp dot org>
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
 
 #include "osm.h"
 
-void osm_xml_write_header(char *who, FILE *outfh) {
-    fprintf(outfh, "<?xml version='1.0' encoding='UTF-8'?>\n");
-    fprintf(outfh, "<osm version=\"0.6\" generator=\"%s (libosm v" LIBOSM_VERSION  ")\">\n",
-                    who);
+#define OSM_XML_WRITE_FLUSH (1024*1024)
+
+static int xml_reserve(OSM_Xml_Writer *X, size_t n) {
+    size_t size;
+    char *tmp;
+
+    if (X->len + n <= X->size)
+        return 0;
+    if (X->failed)
+        return -1;
+    size = X->size ? X->size : 4096;
+    while (size < X->len + n)
+        size *= 2;
+    tmp = realloc(X->data, size);
+    if (tmp == NULL) {
+        fprintf(stderr, "failed to grow XML write buffer to %zu bytes: %s\n",
+                        size, strerror(errno));
+        X->failed = 1;
+        return -1;
+    }
+    X->data = tmp;
+    X->size = size;
+    return 0;
 }
 
-void osm_xml_write_footer(FILE *outfh) {
-    fprintf(outfh, "</osm>\n");
+static void xml_put(OSM_Xml_Writer *X, const char *s, size_t len) {
+    if (xml_reserve(X, len) != 0)
+        return;
+    memcpy(X->data + X->len, s, len);
+    X->len += len;
 }
 
-void osm_xml_write_tags(OSM_Tag_List *t, FILE *outfh) {
+#define xml_put_lit(X, s) xml_put(X, s, sizeof(s) - 1)
+
+static void xml_put_str(OSM_Xml_Writer *X, const char *s) {
+    xml_put(X, s, strlen(s));
+}
+
+/* the digits of v, right aligned in buf[20] */
+static inline char *xml_digits(uint64_t v, char *end) {
+    do {
+        *--end = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    return end;
+}
+
+static void xml_put_uint(OSM_Xml_Writer *X, uint64_t v) {
+    char buf[20], *s = xml_digits(v, buf + sizeof(buf));
+    xml_put(X, s, buf + sizeof(buf) - s);
+}
+
+static void xml_put_int(OSM_Xml_Writer *X, int64_t v) {
+    char buf[21], *s;
+
+    s = xml_digits(v < 0 ? -(uint64_t)v : (uint64_t)v, buf + sizeof(buf));
+    if (v < 0)
+        *--s = '-';
+    xml_put(X, s, buf + sizeof(buf) - s);
+}
+
+/*
+   v as "%.7f": v * 1e7 rounded to an integer, ties to even like printf()
+   does with the exact binary value. The mantissa * 1e7 fits in 77 bits,
+   without __int128 (or for odd values) printf() does it.
+*/
+static void xml_put_coord(OSM_Xml_Writer *X, double v) {
+    char buf[32], *s;
+#ifdef __SIZEOF_INT128__
+    unsigned __int128 m;
+    uint64_t bits, q, frac;
+    int exp, i;
+
+    if (!(fabs(v) < 1e9)) {
+#endif
+        xml_reserve(X, 512);
+        if (!X->failed)
+            X->len += snprintf(X->data + X->len, 512, "%.7f", v);
+        return;
+#ifdef __SIZEOF_INT128__
+    }
+
+    /* v = m * 2^exp */
+    memcpy(&bits, &v, sizeof(bits));
+    exp = (bits >> 52) & 0x7ff;
+    m   = bits & ((1ULL << 52) - 1);
+    if (exp == 0)
+        exp = 1;
+    else
+        m |= 1ULL << 52;
+    exp -= 1075;
+
+    m *= 10000000;
+    if (exp >= 0)
+        q = m << exp;
+    else if (exp < -100)
+        q = 0; /* < 2^77 / 2^100 */
+    else {
+        unsigned __int128 rest = m & (((unsigned __int128)1 << -exp) - 1);
+        unsigned __int128 half = (unsigned __int128)1 << (-exp - 1);
+        q = m >> -exp;
+        if (rest > half || (rest == half && (q & 1)))
+            q += 1;
+    }
+
+    s    = buf + sizeof(buf);
+    frac = q % 10000000;
+    for (i = 0; i < 7; i++) {
+        *--s = '0' + frac % 10;
+        frac /= 10;
+    }
+    *--s = '.';
+    s = xml_digits(q / 10000000, s);
+    if (bits >> 63)
+        *--s = '-';
+    xml_put(X, s, buf + sizeof(buf) - s);
+#endif
+}
+
+/* s with &"<> as entities, the plain runs are copied as they are */
+static void xml_put_escaped(OSM_Xml_Writer *X, const char *s) {
+    size_t len = strlen(s), n;
+
+    while ((n = osm_xml_plain_len(s, len)) < len) {
+        xml_put(X, s, n);
+        xml_put_str(X, osm_xml_entity(s[n]));
+        s   += n + 1;
+        len -= n + 1;
+    }
+    xml_put(X, s, len);
+}
+
+static void xml_put_timestamp(OSM_Xml_Writer *X, uint64_t timestamp) {
+    char tsbuf[OSM_TIMESTAMP_SIZE];
+    int len = osm_timestamp_format(&X->ts, timestamp, tsbuf);
+
+    xml_put_lit(X, " timestamp=\"");
+    xml_put(X, tsbuf, len);
+    xml_put_lit(X, "\"");
+}
+
+/* version, user, uid, changeset and timestamp, if set */
+#define xml_put_info(X, o) { \
+        if ((o)->version) { \
+            xml_put_lit(X, " version=\""); \
+            xml_put_uint(X, (o)->version); \
+            xml_put_lit(X, "\""); \
+        } \
+        if (*(o)->user) { \
+            xml_put_lit(X, " user=\""); \
+            xml_put_escaped(X, (o)->user); \
+            xml_put_lit(X, "\""); \
+        } \
+        if ((o)->uid) { \
+            xml_put_lit(X, " uid=\""); \
+            xml_put_uint(X, (o)->uid); \
+            xml_put_lit(X, "\""); \
+        } \
+        if ((o)->changeset) { \
+            xml_put_lit(X, " changeset=\""); \
+            xml_put_uint(X, (o)->changeset); \
+            xml_put_lit(X, "\""); \
+        } \
+        if ((o)->timestamp) \
+            xml_put_timestamp(X, (o)->timestamp); \
+    }
+
+/* writes a full buffer */
+static void xml_entity_done(OSM_Xml_Writer *X) {
+    if (X->outfh != NULL && X->len >= OSM_XML_WRITE_FLUSH)
+        osm_xml_writer_flush(X);
+}
+
+/*
+   a writer to outfh, NULL if out of memory. With outfh == NULL the output
+   just collects in X->data (X->len bytes).
+*/
+OSM_Xml_Writer *osm_xml_writer_open(FILE *outfh) {
+    OSM_Xml_Writer *X = calloc(1, sizeof(OSM_Xml_Writer));
+
+    if (X == NULL) {
+        fprintf(stderr, "failed to malloc XML writer: %s\n", strerror(errno));
+        return (OSM_Xml_Writer *)NULL;
+    }
+    X->outfh = outfh;
+    if (outfh != NULL && xml_reserve(X, OSM_XML_WRITE_FLUSH + 4096) != 0) {
+        free(X);
+        return (OSM_Xml_Writer *)NULL;
+    }
+    return X;
+}
+
+/* writes the buffer, returns -1 if this or any earlier write failed */
+int osm_xml_writer_flush(OSM_Xml_Writer *X) {
+    if (X->outfh != NULL && X->len && !X->failed) {
+        if (fwrite(X->data, 1, X->len, X->outfh) != X->len) {
+            fprintf(stderr, "failed to write XML: %s\n", strerror(errno));
+            X->failed = 1;
+        }
+    }
+    X->len = 0;
+    return X->failed ? -1 : 0;
+}
+
+/* flushes and frees X, returns -1 if anything failed */
+int osm_xml_writer_close(OSM_Xml_Writer *X) {
+    int ret = osm_xml_writer_flush(X);
+
+    if (ret == 0 && X->outfh != NULL && fflush(X->outfh) != 0) {
+        fprintf(stderr, "failed to write XML: %s\n", strerror(errno));
+        ret = -1;
+    }
+    free(X->data);
+    free(X);
+    return ret;
+}
+
+void osm_xml_put_header(OSM_Xml_Writer *X, char *who) {
+    xml_put_lit(X, "<?xml version='1.0' encoding='UTF-8'?>\n"
+                   "<osm version=\"0.6\" generator=\"");
+    xml_put_str(X, who);
+    xml_put_lit(X, " (libosm v" LIBOSM_VERSION ")\">\n");
+}
+
+void osm_xml_put_footer(OSM_Xml_Writer *X) {
+    xml_put_lit(X, "</osm>\n");
+    xml_entity_done(X);
+}
+
+void osm_xml_put_tags(OSM_Xml_Writer *X, OSM_Tag_List *t) {
     int i;
     for (i=0; i<t->num; i++) {
-        fprintf(outfh, "  <tag k=\"%s\" v=\"%s\"/>\n",
-                            t->data[i].key,
-                            osm_encode_xml(t->data[i].val));
+        xml_put_lit(X, "  <tag k=\"");
+        xml_put_escaped(X, t->data[i].key);
+        xml_put_lit(X, "\" v=\"");
+        xml_put_escaped(X, t->data[i].val);
+        xml_put_lit(X, "\"/>\n");
     }
 }
 
-void osm_xml_write_node(OSM_Node *n, FILE *outfh) {
-    char tsbuf[21];
-    
-    fprintf(outfh, " <node id=\"%li\" lon=\"%.7f\" lat=\"%.7f\"",
-            n->id, n->lon, n->lat);
-
-    if (n->version)
-        fprintf(outfh, " version=\"%u\"", n->version);
-    if (*n->user)
-        fprintf(outfh, " user=\"%s\"", n->user);
-    if (n->uid)
-        fprintf(outfh, " uid=\"%u\"", n->uid);
-    if (n->changeset)
-        fprintf(outfh, " changeset=\"%lu\"", n->changeset);
-    if (n->timestamp) {
-        osm_pbf_timestamp(n->timestamp, tsbuf);
-        fprintf(outfh, " timestamp=\"%s\"", tsbuf);
-    }
+void osm_xml_put_node(OSM_Xml_Writer *X, OSM_Node *n) {
+    xml_put_lit(X, " <node id=\"");
+    xml_put_int(X, n->id);
+    xml_put_lit(X, "\" lon=\"");
+    xml_put_coord(X, n->lon);
+    xml_put_lit(X, "\" lat=\"");
+    xml_put_coord(X, n->lat);
+    xml_put_lit(X, "\"");
+    xml_put_info(X, n);
     if (n->tags != NULL && n->tags->num) {
-        fprintf(outfh, ">\n");
-        osm_xml_write_tags(n->tags, outfh);
-        fprintf(outfh, " </node>\n");
+        xml_put_lit(X, ">\n");
+        osm_xml_put_tags(X, n->tags);
+        xml_put_lit(X, " </node>\n");
     }
     else {
-        fprintf(outfh, "/>\n");
+        xml_put_lit(X, "/>\n");
     }
+    xml_entity_done(X);
 }
 
-void osm_xml_write_way(OSM_Way *w, FILE *outfh) {
-    char tsbuf[21];
-    fprintf(outfh, " <way id=\"%li\"", w->id);
-    if (w->version)
-        fprintf(outfh, " version=\"%u\"", w->version);
-    if (*w->user)
-        fprintf(outfh, " user=\"%s\"", w->user);
-    if (w->uid)
-        fprintf(outfh, " uid=\"%u\"", w->uid);
-    if (w->changeset)
-        fprintf(outfh, " changeset=\"%lu\"", w->changeset);
-    if (w->timestamp) {
-        osm_pbf_timestamp(w->timestamp, tsbuf);
-        fprintf(outfh, " timestamp=\"%s\"", tsbuf);
+/* all nodes of the columns, in the order they were added */
+void osm_xml_put_node_columns(OSM_Xml_Writer *X, OSM_Node_Columns *C) {
+    OSM_Node n;
+    uint32_t i;
+
+    for (i=0; i<C->num; i++) {
+        osm_node_columns_get(C, i, &n);
+        osm_xml_put_node(X, &n);
     }
+}
+
+void osm_xml_put_way(OSM_Xml_Writer *X, OSM_Way *w) {
+    int i;
+
+    xml_put_lit(X, " <way id=\"");
+    xml_put_int(X, w->id);
+    xml_put_lit(X, "\"");
+    xml_put_info(X, w);
     if (w->tags == NULL && w->nodes[0] == 0) {
-        fprintf(outfh, "/>\n");
+        xml_put_lit(X, "/>\n");
     }
     else {
-        fprintf(outfh, ">\n");
-        int i = 0;
-        while (w->nodes[i] != 0) {
-            fprintf(outfh, "  <nd ref=\"%li\"/>\n", w->nodes[i]);
-            ++i;
+        xml_put_lit(X, ">\n");
+        for (i=0; w->nodes[i] != 0; i++) {
+            xml_put_lit(X, "  <nd ref=\"");
+            xml_put_int(X, w->nodes[i]);
+            xml_put_lit(X, "\"/>\n");
         }
         if (w->tags != NULL)
-            osm_xml_write_tags(w->tags, outfh);
-        fprintf(outfh, " </way>\n");
+            osm_xml_put_tags(X, w->tags);
+        xml_put_lit(X, " </way>\n");
     }
+    xml_entity_done(X);
 }
 
-void osm_xml_write_relation(OSM_Relation *r, FILE *outfh) {
-    char tsbuf[21];
-
-    fprintf(outfh, " <relation id=\"%li\"", r->id);
-    if (r->version)
-        fprintf(outfh, " version=\"%u\"", r->version);
-    if (*r->user)
-        fprintf(outfh, " user=\"%s\"", r->user);
-    if (r->uid)
-        fprintf(outfh, " uid=\"%u\"", r->uid);
-    if (r->changeset)
-        fprintf(outfh, " changeset=\"%li\"", r->changeset);
-
-    if (r->timestamp) {
-        osm_pbf_timestamp(r->timestamp, tsbuf);
-        fprintf(outfh, " timestamp=\"%s\"", tsbuf);
-    }
+void osm_xml_put_relation(OSM_Xml_Writer *X, OSM_Relation *r) {
+    int i;
+
+    xml_put_lit(X, " <relation id=\"");
+    xml_put_int(X, r->id);
+    xml_put_lit(X, "\"");
+    xml_put_info(X, r);
     if (r->tags == NULL && r->member == 0) {
-        fprintf(outfh, "/>\n");
+        xml_put_lit(X, "/>\n");
     }
     else {
-        fprintf(outfh, ">\n");
-        int i = 0;
-        for (i=0; i<r->member->num; i++) {
-            fprintf(outfh, "  <member type=\"%s\" ref=\"%li\" role=\"%s\"/>\n",
-                    osm_relmember_type(r->member->data[i].type),
-                    r->member->data[i].ref,
-                    r->member->data[i].role);
+        xml_put_lit(X, ">\n");
+        for (i=0; r->member != NULL && i<r->member->num; i++) {
+            xml_put_lit(X, "  <member type=\"");
+            xml_put_str(X, osm_relmember_type(r->member->data[i].type));
+            xml_put_lit(X, "\" ref=\"");
+            xml_put_int(X, r->member->data[i].ref);
+            xml_put_lit(X, "\" role=\"");
+            xml_put_escaped(X, r->member->data[i].role);
+            xml_put_lit(X, "\"/>\n");
         }
         if (r->tags != NULL)
-            osm_xml_write_tags(r->tags, outfh);
-        fprintf(outfh, " </relation>\n");
+            osm_xml_put_tags(X, r->tags);
+        xml_put_lit(X, " </relation>\n");
+    }
+    xml_entity_done(X);
+}
+
+/* appends the output collected in C to X, C is emptied */
+void osm_xml_put_chunk(OSM_Xml_Writer *X, OSM_Xml_Writer *C) {
+    if (X->outfh == NULL || X->len + C->len < OSM_XML_WRITE_FLUSH)
+        xml_put(X, C->data, C->len);
+    else if (osm_xml_writer_flush(X) == 0 && C->len
+             && fwrite(C->data, 1, C->len, X->outfh) != C->len)
+    {
+        fprintf(stderr, "failed to write XML: %s\n", strerror(errno));
+        X->failed = 1;
+    }
+    C->len = 0;
+}
+
+static int xml_file_node(OSM_Node *n, void *ctx) {
+    osm_xml_put_node((OSM_Xml_Writer *)ctx, n);
+    return ((OSM_Xml_Writer *)ctx)->failed ? -1 : 0;
+}
+
+static int xml_file_way(OSM_Way *w, void *ctx) {
+    osm_xml_put_way((OSM_Xml_Writer *)ctx, w);
+    return ((OSM_Xml_Writer *)ctx)->failed ? -1 : 0;
+}
+
+static int xml_file_relation(OSM_Relation *r, void *ctx) {
+    osm_xml_put_relation((OSM_Xml_Writer *)ctx, r);
+    return ((OSM_Xml_Writer *)ctx)->failed ? -1 : 0;
+}
+
+/*
+   all entities of F in file order, without header and footer. Returns 0,
+   or -1 on errors.
+*/
+int osm_xml_put_file(OSM_Xml_Writer *X, OSM_File *F) {
+    OSM_Stream_Handler h = { xml_file_node, xml_file_way, xml_file_relation,
+                             NULL, X };
+    int ret;
+
+    if (F->type == OSM_FTYPE_PBF)
+        ret = osm_pbf_xml(F, X);
+    else
+        ret = osm_stream(F, &h);
+    return ret != 0 || X->failed ? -1 : 0;
+}
+
+/* the FILE versions, through a writer on the stack */
+#define XML_WRITE_FILE(outfh, call) { \
+        OSM_Xml_Writer X = { outfh, NULL, 0, 0, 0, { 0, 0, "" } }; \
+        call; \
+        osm_xml_writer_flush(&X); \
+        free(X.data); \
     }
+
+void osm_xml_write_header(char *who, FILE *outfh) {
+    XML_WRITE_FILE(outfh, osm_xml_put_header(&X, who));
+}
+
+void osm_xml_write_footer(FILE *outfh) {
+    XML_WRITE_FILE(outfh, osm_xml_put_footer(&X));
+}
+
+void osm_xml_write_tags(OSM_Tag_List *t, FILE *outfh) {
+    XML_WRITE_FILE(outfh, osm_xml_put_tags(&X, t));
+}
+
+void osm_xml_write_node(OSM_Node *n, FILE *outfh) {
+    XML_WRITE_FILE(outfh, osm_xml_put_node(&X, n));
+}
+
+void osm_xml_write_node_columns(OSM_Node_Columns *C, FILE *outfh) {
+    XML_WRITE_FILE(outfh, osm_xml_put_node_columns(&X, C));
+}
+
+void osm_xml_write_way(OSM_Way *w, FILE *outfh) {
+    XML_WRITE_FILE(outfh, osm_xml_put_way(&X, w));
+}
+
+void osm_xml_write_relation(OSM_Relation *r, FILE *outfh) {
+    XML_WRITE_FILE(outfh, osm_xml_put_relation(&X, r));
 }
 
 /* END */
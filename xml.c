@@ -6,7 +6,7 @@
  * Hanno Hecker <vetinari+osm at ankh-morp dot org>
  */
 
-#define _GNU_SOURCE /* strndup */
+#define _GNU_SOURCE /* strptime, memmem */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -20,146 +20,65 @@
 
 uint64_t osm_timestamp2epoch(char *timestamp) {
     struct tm tm;
+    memset(&tm, 0, sizeof(struct tm)); /* strptime() doesn't set tm_isdst */
     strptime(timestamp, "%Y-%m-%dT%H:%M:%SZ", &tm);
     time_t ep = mktime(&tm);
     return (uint64_t)ep;    
 }
 
-char *osm_xml_decode(char *src) {
-    char buffer[LINE_SIZE];
-    char *dest = buffer;
-    char *source = src;
-    while (*src) {
-        if (*src == '&') {
-            if (strncmp(src, "&amp;", 5) == 0) {
-                *dest = '&'; ++dest;
-                src += 4;
-            }
-            else if (strncmp(src, "&quot;", 6) == 0) {
-                *dest = '"'; ++dest;
-                src += 5;
-            }
-            else if (strncmp(src, "&lt;", 4) == 0) {
-                *dest = '<'; ++dest;
-                src += 3;
-            }
-            else if (strncmp(src, "&gt;", 4) == 0) {
-                *dest = '>'; ++dest;
-                src += 3;
-            }
-            else {
-                fprintf(stderr, "warning: missing decode for %s\n", src);
-            }
-        }
-        else {
-            *dest = *src;
-            ++dest;
-        }
-        ++src;
+/* offset of the first element s in F from off on, 0 if there is none */
+static off_t find_start(OSM_File *F, off_t off, const char *s) {
+    const unsigned char *map = F->map, *p;
+    size_t len = strlen(s);
+
+    if (map == NULL)
+        return 0;
+    while ((p = memmem(map + off, F->size - off, s, len)) != NULL) {
+        off = p - map + len;
+        if (off < F->size
+            && (map[off] == ' ' || map[off] == '\t' || map[off] == '\n'
+                || map[off] == '\r' || map[off] == '/' || map[off] == '>'))
+            return p - map;
     }
-    *dest = '\0';
-    if (debug) 
-        fprintf(stderr, "%s:%d:%s: src='%s', dest='%s'\n", 
-                        __FILE__, __LINE__, __FUNCTION__, source, buffer);
-    
-    if (buffer[0])
-        return strdup(buffer);
-    else
-        return "";
+    return 0;
 }
 
-char *osm_xml_fetch_param(char *src, char *str, char *dest) {
-    char *start, *ptr, *res;
-
-    char search[64] = "";
-    strncpy(search, str, 62);
-    ptr = search;
-    while (*ptr) ++ptr;
-    *ptr = '=';
-    ++ptr;
-    *ptr = '\0';
-
-    start = strstr(src, search);
-    if (start == NULL) {
-        if (debug)
-            fprintf(stderr, "%s:%d:%s(): no %s in line: %s\n", 
-                            __FILE__, __LINE__, __FUNCTION__, search, src);
-        return NULL;
-    }
-    start += strlen(search)+1;
-
-    if (*start && (*start == '"' || *start == '\'')) {
-        if (debug)
-            fprintf(stderr, "%s:%d:%s(): empty value...\n", __FILE__, __LINE__, __FUNCTION__);
-        return NULL; /* empty value */
-    }
-
-    ptr = start;
-    while (*ptr && *(ptr + 1)) {
-        if ((*ptr == '"' || *ptr == '\'')
-         && (   *(ptr+1) == ' ' || *(ptr+1) == '\t'
-             || *(ptr+1) == '/' || *(ptr+1) == '>')) {
-            res = strncpy(dest, (const char *)start, ptr - start);
-            dest[ptr-start] = '\0';
-            if (debug)
-                fprintf(stderr, "%s:%d:%s(): param %s\"%s\"\n", 
-                            __FILE__, __LINE__, __FUNCTION__, search, dest);
-            return dest;
-        }
-        ++ptr;
-    }
-    if (debug)
-        fprintf(stderr, "%s:%d:%s(): param %s: we should not be here\n", 
-                __FILE__, __LINE__, __FUNCTION__, search);
-    return NULL;
-}
-
-static void find_starts(FILE *file, long int *nodes, long int *ways, long int *relations /*, long int *changesets*/){
-    char *buffer;
-    char *line;
-
-    buffer = malloc(LINE_SIZE);
-    fseek(file, 0, SEEK_SET);
-    *nodes = 0;
-    *ways  = 0;
+/*
+   the first entity is found with the tokenizer, so the header and any
+   comments before it are skipped. The nodes, ways and relations come in
+   this order, so the later sections are only searched after it.
+*/
+static void find_starts(OSM_File *F, off_t *nodes, off_t *ways, off_t *relations /*, off_t *changesets*/){
+    struct osm_xml_tag T;
+    off_t first = 0;
+
+    *nodes     = 0;
+    *ways      = 0;
     *relations = 0;
-    while (1) {
-        buffer = fgets(buffer, LINE_SIZE, file);
-        if (buffer == NULL) {
-            return;
-        }
-        line = buffer;
-        while (*line && (*line == ' ' || *line == '\t'))
-            ++line;
-        if (!*nodes) {
-            if (strncmp(line, "<node ", 6) == 0) {
-                *nodes = ftell(file) - strlen(buffer);
-                continue;
-            }
-        }
-
-        if (!*ways) {
-            if (strncmp(line, "<way ", 5) == 0) {
-                *ways = ftell(file) - strlen(buffer);
-                continue;
-            }
-        }
-
-        if (!*relations) {
-            if (strncmp(line, "<relation ", 10) == 0) {
-                *relations = ftell(file) - strlen(buffer);
-                continue;
-            }
-        }
-
-        else {
-            free(buffer);
-            if (debug)
-                fprintf(stderr, "%s:%d:%s(): <node>=%lu, <way>=%lu, <relation>=%lu\n", 
-                __FILE__, __LINE__, __FUNCTION__, *nodes, *ways, *relations);
-            return;
-        }
+    F->pos = 0;
+    while (osm_xml_next(F, &T) == 1) {
+        if (T.type == OSM_XML_CLOSE)
+            continue;
+        if (OSM_XML_IS(&T, "node"))
+            *nodes = first = T.offset;
+        else if (OSM_XML_IS(&T, "way"))
+            *ways = first = T.offset;
+        else if (OSM_XML_IS(&T, "relation"))
+            *relations = first = T.offset;
+        else
+            continue;
+        break;
     }
+    if (first == 0)
+        return;
+    if (*nodes)
+        *ways = find_start(F, first, "<way");
+    if (!*relations)
+        *relations = find_start(F, *ways ? *ways : first, "<relation");
+    if (debug)
+        fprintf(stderr, "%s:%d:%s(): <node>=%lld, <way>=%lld, <relation>=%lld\n",
+                __FILE__, __LINE__, __FUNCTION__,
+                (long long)*nodes, (long long)*ways, (long long)*relations);
 }
 
 OSM_Data *osm_xml_parse(OSM_File *F,
@@ -171,40 +90,53 @@ OSM_Data *osm_xml_parse(OSM_File *F,
               int (*cset_filter)(OSM_Changeset *) */
         )
 {
-    struct osm_members *mem_node = NULL;
-    struct osm_members *mem_way  = NULL;
-    long int node_start = 0, way_start = 0, rel_start = 0;
+    OSM_Id_Bitmap *mem_node = NULL;
+    OSM_Id_Set *mem_way  = NULL;
+    off_t node_start = 0, way_start = 0, rel_start = 0;
     OSM_Data *data = NULL;
+    OSM_Arena *arena = NULL;
+
+    if (mode & OSMDATA_ARENA) {
+        arena = osm_arena_new(0);
+        mode &= ~OSMDATA_ARENA;
+    }
 
     data = malloc(sizeof(OSM_Data));
     data->relations = NULL;
     data->ways      = NULL;
     data->nodes     = NULL;
+    data->node_cols = NULL;
+    data->arena     = arena;
+
+    if (mode & OSMDATA_COLUMNS) {
+        data->node_cols = osm_node_columns_new();
+        mode &= ~OSMDATA_COLUMNS;
+    }
+    /* the XML entities are complete anyway */
+    mode &= ~OSMDATA_LAZY;
 
     if (debug) 
         fprintf(stderr, "%s:%d:%s(): MODE=%d\n",
                 __FILE__, __LINE__, __FUNCTION__, mode);
     if (mode != OSMDATA_DUMP) {
-        mem_node = malloc(sizeof(struct osm_members));
-        mem_node->data = malloc(sizeof(uint64_t) * 65536);
-        mem_node->num = 0;
-        mem_node->size = 65536;
-
-        mem_way = malloc(sizeof(struct osm_members));
-        mem_way->data = malloc(sizeof(uint64_t) * 65536);
-        mem_way->num = 0;
-        mem_way->size = 65536;
+        mem_node = osm_id_bitmap_new();
+        mem_way  = osm_id_set_new();
     }
-    find_starts(F->file, &node_start, &way_start, &rel_start);
+    find_starts(F, &node_start, &way_start, &rel_start);
     
     if (mode & (OSMDATA_REL|OSMDATA_DUMP|OSMDATA_BBOX)) { 
         if (debug) 
             fprintf(stderr, "%s:%d:%s(): parsing relations...\n",
                     __FILE__, __LINE__, __FUNCTION__);
         data->relations = 
-            osm_xml_parse_relations(rel_start, F->file, mode, rel_filter,
-                                                        mem_way, mem_node);
-        osm_sort_member(mem_way);
+            osm_xml_parse_relations(rel_start, F, mode, rel_filter, F->filter,
+                                                mem_way, mem_node, arena);
+        if (data->relations == NULL) {
+            osm_id_bitmap_free(mem_node);
+            osm_id_set_free(mem_way);
+            osm_free_data(data);
+            return NULL;
+        }
     }
 
     if (mode == OSMDATA_REL)
@@ -218,11 +150,16 @@ OSM_Data *osm_xml_parse(OSM_File *F,
             fprintf(stderr, "%s:%d:%s(): parsing ways...\n",
                     __FILE__, __LINE__, __FUNCTION__);
         data->ways = 
-            osm_xml_parse_ways(way_start, F->file, mode, way_filter, 
-                                                    mem_way, mem_node);
+            osm_xml_parse_ways(way_start, F, mode, way_filter, F->filter,
+                                                mem_way, mem_node, arena);
+        if (data->ways == NULL) {
+            osm_id_bitmap_free(mem_node);
+            osm_id_set_free(mem_way);
+            osm_free_data(data);
+            return NULL;
+        }
     }
 
-    osm_sort_member(mem_node);
     if (mode == OSMDATA_WAY)
         mode = OSMDATA_NODE;
 
@@ -231,8 +168,8 @@ OSM_Data *osm_xml_parse(OSM_File *F,
             fprintf(stderr, "%s:%d:%s(): parsing nodes...\n",
                     __FILE__, __LINE__, __FUNCTION__);
         data->nodes = 
-            osm_xml_parse_nodes(node_start, F->file, mode, node_filter,
-                                                mem_node);
+            osm_xml_parse_nodes(node_start, F, mode, node_filter, F->filter,
+                                                mem_node, arena, data->node_cols);
     }
 
     if (debug)
@@ -249,7 +186,65 @@ OSM_Data *osm_xml_parse(OSM_File *F,
                 __FILE__, __LINE__, __FUNCTION__, x, data->nodes->data[x]->id);
         }
     }
+    osm_id_bitmap_free(mem_node);
+    osm_id_set_free(mem_way);
     return data;
 }
 
+/* counts the streamed entities, runs the block callback every OSM_STREAM_XML_BLOCK */
+static int xml_stream_count(OSM_Stream_Handler *h, uint32_t *num) {
+    *num += 1;
+    if (*num < OSM_STREAM_XML_BLOCK || h->block == NULL)
+        return 0;
+    *num = 0;
+    return h->block(h->ctx);
+}
+
+/*
+   osm_xml_stream(): the nodes, ways and relations in file order, every
+   entity is freed after its callback returned
+*/
+int osm_xml_stream(OSM_File *F, OSM_Stream_Handler *h) {
+    off_t node_start = 0, way_start = 0, rel_start = 0;
+    OSM_Node *N;
+    OSM_Way *W;
+    OSM_Relation *R;
+    uint32_t num = 0;
+    int ret = 0;
+
+    find_starts(F, &node_start, &way_start, &rel_start);
+
+    if (h->node != NULL && node_start) {
+        F->pos = node_start;
+        while (ret == 0 && (N = osm_xml_get_node(F)) != NULL) {
+            ret = h->node(N, h->ctx);
+            osm_free_node(N);
+            if (ret == 0)
+                ret = xml_stream_count(h, &num);
+        }
+    }
+    if (h->way != NULL && way_start) {
+        F->pos = way_start;
+        while (ret == 0 && (W = osm_xml_get_way(F)) != NULL) {
+            ret = h->way(W, h->ctx);
+            osm_free_way(W);
+            if (ret == 0)
+                ret = xml_stream_count(h, &num);
+        }
+    }
+    if (h->relation != NULL && rel_start) {
+        F->pos = rel_start;
+        while (ret == 0 && (R = osm_xml_get_relation(F)) != NULL) {
+            ret = h->relation(R, h->ctx);
+            osm_free_relation(R);
+            if (ret == 0)
+                ret = xml_stream_count(h, &num);
+        }
+    }
+    if (ret == 0 && num > 0 && h->block != NULL)
+        ret = h->block(h->ctx);
+
+    return ret;
+}
+
 /* END */